@@ -0,0 +1,127 @@
+#ifndef MY_ARENA_CLASS
+#define MY_ARENA_CLASS
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+// Memory for the state of one client query, so a worker that has warmed up answers without
+// calling into the global heap, and its threads never meet in malloc.
+// Every request slot has a bump allocator over fixed-size blocks. Whatever the request builds
+// (results copied out of replies or out of the cache, the strings in them) is carved out of its
+// blocks and nothing is freed one by one, the whole arena is reset when the response is out and
+// its blocks go back to the worker's pool for the next request.
+
+// Block size, most requests fit in one, longer ones chain a few
+constexpr size_t kArenaBlockSize = 4096;
+
+// Fixed-size blocks, taken and given back by the worker owning the pool, never returned to the heap
+class BlockPool
+{
+public:
+    BlockPool() = default;
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+    ~BlockPool()
+    {
+        for (char *block : freeBlocks)
+        {
+            ::operator delete(block);
+        }
+    }
+
+    char *take()
+    {
+        if (freeBlocks.empty())
+        {
+            allocated++;
+            return static_cast<char *>(::operator new(kArenaBlockSize));
+        }
+        char *block = freeBlocks.back();
+        freeBlocks.pop_back();
+        return block;
+    }
+
+    // Keeps its capacity, once it has held every block there is it never grows again
+    void give(char *block) { freeBlocks.push_back(block); }
+
+    size_t blocks() const { return allocated; }
+
+private:
+    std::vector<char *> freeBlocks;
+    size_t allocated = 0;
+};
+
+// Bump allocator of one request, released all at once by reset
+// Allocations bigger than half a block (a huge RDATA over TCP) go to the heap and are freed on reset
+class RequestArena : public std::pmr::memory_resource
+{
+public:
+    RequestArena() = default;
+    RequestArena(const RequestArena &) = delete;
+    RequestArena &operator=(const RequestArena &) = delete;
+    ~RequestArena() { reset(); }
+
+    // Must be set before the first allocation, and outlive the arena
+    void setPool(BlockPool *p) { pool = p; }
+
+    // Everything allocated here is gone, the containers using the arena have to be emptied first
+    void reset()
+    {
+        for (char *block : blocks)
+        {
+            pool->give(block);
+        }
+        blocks.clear();
+        for (const Large &l : large)
+        {
+            std::pmr::new_delete_resource()->deallocate(l.p, l.bytes, l.alignment);
+        }
+        large.clear();
+        cursor = end = nullptr;
+    }
+
+private:
+    struct Large
+    {
+        void *p;
+        size_t bytes;
+        size_t alignment;
+    };
+
+    BlockPool *pool = nullptr;
+    std::vector<char *> blocks; // Taken from the pool, the last one is being bumped
+    std::vector<Large> large;
+    char *cursor = nullptr;
+    char *end = nullptr;
+
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        size_t pad = -reinterpret_cast<uintptr_t>(cursor) & (alignment - 1);
+        if (cursor && pad + bytes <= size_t(end - cursor))
+        {
+            void *p = cursor + pad;
+            cursor += pad + bytes;
+            return p;
+        }
+        if (bytes + alignment > kArenaBlockSize / 2 || alignment > alignof(std::max_align_t))
+        {
+            void *p = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+            large.push_back({p, bytes, alignment});
+            return p;
+        }
+        // The rest of the current block is left unused, a fresh block is aligned for any of the rest
+        char *block = pool->take();
+        blocks.push_back(block);
+        cursor = block + bytes;
+        end = block + kArenaBlockSize;
+        return block;
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+};
+
+#endif
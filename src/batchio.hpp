@@ -0,0 +1,134 @@
+#ifndef MY_BATCHIO_CLASS
+#define MY_BATCHIO_CLASS
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <cerrno>
+#include <cstring>
+#include "logging.hpp"
+#include <vector>
+
+// Batched datagram I/O, so a busy socket costs one syscall per batch instead of one per packet.
+// All buffers are allocated once up front and reused for every batch.
+
+// Datagrams moved per recvmmsg/sendmmsg call, can be changed with --batch
+constexpr size_t kDefaultBatchSize = 32;
+constexpr size_t kMaxBatchSize = 1024;
+// Size of every packet buffer, also the most --edns-size can advertise
+constexpr size_t kPacketSize = 4096;
+
+// Pull up to batchSize datagrams per recvmmsg into a ring of preallocated buffers
+class BatchReceiver
+{
+public:
+    explicit BatchReceiver(size_t batchSize)
+        : buffers(batchSize * kPacketSize), iov(batchSize), msgs(batchSize), addresses(batchSize)
+    {
+        for (size_t i = 0; i < batchSize; i++)
+        {
+            iov[i] = {&buffers[i * kPacketSize], kPacketSize};
+        }
+    }
+
+    // Receive the next batch from a non-blocking socket
+    // Return the number of datagrams received, 0 when there is nothing left to read
+    size_t receive(int fd)
+    {
+        for (size_t i = 0; i < msgs.size(); i++)
+        {
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name = &addresses[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        while (true)
+        {
+            int n = recvmmsg(fd, msgs.data(), msgs.size(), 0, nullptr);
+            if (n >= 0)
+                return n;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_SAMPLED(LogLevel::Warn, "Error receiving data: %s", strerror(errno));
+            return 0;
+        }
+    }
+
+    size_t capacity() const { return msgs.size(); }
+    char *data(size_t i) { return &buffers[i * kPacketSize]; }
+    size_t length(size_t i) const { return msgs[i].msg_len; }
+    bool truncated(size_t i) const { return msgs[i].msg_hdr.msg_flags & MSG_TRUNC; }
+    const sockaddr_in &address(size_t i) const { return addresses[i]; }
+    socklen_t addressLen(size_t i) const { return msgs[i].msg_hdr.msg_namelen; }
+
+private:
+    std::vector<char> buffers;
+    std::vector<iovec> iov;
+    std::vector<mmsghdr> msgs;
+    std::vector<sockaddr_in> addresses;
+};
+
+// Queue outgoing datagrams and hand them to sendmmsg in batches
+class BatchSender
+{
+public:
+    BatchSender(int fd, size_t batchSize)
+        : fd(fd), buffers(batchSize * kPacketSize), iov(batchSize), msgs(batchSize), addresses(batchSize) {}
+
+    // Buffer for the next datagram, fill at most kPacketSize bytes then call commit
+    char *reserve() { return &buffers[count * kPacketSize]; }
+
+    // Queue the datagram written into reserve(), sending the batch once it is full
+    void commit(size_t length, const sockaddr_in &address, socklen_t addressLen)
+    {
+        addresses[count] = address;
+        iov[count] = {&buffers[count * kPacketSize], length};
+        msgs[count] = {};
+        msgs[count].msg_hdr.msg_name = &addresses[count];
+        msgs[count].msg_hdr.msg_namelen = addressLen;
+        msgs[count].msg_hdr.msg_iov = &iov[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        count++;
+        if (count == msgs.size())
+            flush();
+    }
+
+    // Send everything queued so far
+    void flush()
+    {
+        size_t sent = 0;
+        while (sent < count)
+        {
+            int n = sendmmsg(fd, msgs.data() + sent, count - sent, 0);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    // The socket buffer is full, UDP may drop what is left
+                    LOG_SAMPLED(LogLevel::Warn, "Send buffer full, dropping %zu datagrams.", count - sent);
+                    break;
+                }
+                // Only the first datagram failed, skip it and carry on with the rest
+                LOG_SAMPLED(LogLevel::Warn, "Send data fails: %s", strerror(errno));
+                n = 1;
+            }
+            sent += n;
+        }
+        count = 0;
+    }
+
+    size_t queued() const { return count; }
+
+private:
+    int fd;
+    std::vector<char> buffers;
+    std::vector<iovec> iov;
+    std::vector<mmsghdr> msgs;
+    std::vector<sockaddr_in> addresses;
+    size_t count = 0;
+};
+
+#endif
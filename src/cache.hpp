@@ -0,0 +1,396 @@
+#ifndef MY_CACHE_CLASS
+#define MY_CACHE_CLASS
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include "netstruct.hpp"
+
+// TTL aware answer cache in front of the upstream resolver, shared by every worker.
+// Entries are keyed by (qName, qType, qClass) and hold every section of the upstream result.
+// They live as long as the smallest TTL among their records, negative ones (NXDOMAIN or no
+// answer) as long as the SOA says (RFC 2308).
+// An entry asked for again in the last tenth of its lifetime is due for a refresh, the caller
+// fetches it anew before it runs out. With serve-stale on (RFC 8767), an expired entry is kept a
+// while longer, to answer from when the upstream can not be reached.
+//
+// Layout: fixed size slots in sets of kCacheWays, a key can only live in the set its hash picks.
+// The sets are split into shards, each with a writer lock on its own cache line. Readers take no
+// lock at all: every slot carries a sequence number, odd while a writer is in it, and a reader
+// copies the slot out and keeps the copy only if the number did not move meanwhile (seqlock).
+// Hits only write to the slot to count the first few of them and to claim a refresh, a hot entry
+// is read without any store to shared memory.
+
+// Default memory cap for cached answers, can be changed with --cache-size
+constexpr size_t kDefaultCacheBytes = 64 << 20;
+// Hits in the last tenth of its TTL an entry needs before it is refreshed ahead of its expiry
+constexpr uint32_t kPrefetchHits = 2;
+// A refresh that has not replaced the entry by then went wrong, the next hit may ask again
+// Longer than every attempt the forwarder makes at one question
+constexpr std::chrono::seconds kPrefetchRetry{10};
+// TTL of records served stale (RFC 8767 section 4)
+constexpr uint32_t kStaleTtl = 30;
+// Bytes per slot, key and records included, results that do not fit are not cached
+constexpr size_t kCacheSlotBytes = 1024;
+// Slots per set, a key is looked for in these only
+constexpr size_t kCacheWays = 4;
+// Writer locks, sets are spread over them
+constexpr size_t kCacheShards = 64;
+// Hits counted per entry, enough to tell the popular ones when a set is full
+constexpr uint32_t kCacheHitCap = 64;
+
+// Lowercased wire name, then type and class in network order and the DNSSEC OK bit, built on the stack
+// DNSSEC records only come back with DO set, so those answers are kept apart
+struct CacheKey
+{
+    char data[kMaxNameLength + 2 * sizeof(uint16_t) + 1];
+    size_t length;
+
+    CacheKey(const DNSQuestionView &q, bool dnssecOk)
+    {
+        length = q.qName.toLowerWire(data);
+        memcpy(data + length, &q.qType, sizeof(uint16_t));
+        length += sizeof(uint16_t);
+        memcpy(data + length, &q.qClass, sizeof(uint16_t));
+        length += sizeof(uint16_t);
+        data[length++] = dnssecOk;
+    }
+
+    std::string_view view() const { return std::string_view(data, length); }
+};
+
+class AnswerCache
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // staleFor: how long past its expiry an entry may still be served stale, 0 to never
+    explicit AnswerCache(size_t maxBytes = kDefaultCacheBytes, std::chrono::seconds staleFor = std::chrono::seconds(0))
+        : staleFor(staleFor)
+    {
+        // Sets are a power of two, so the slot count is maxBytes rounded down to one
+        size_t sets = maxBytes / (sizeof(Slot) * kCacheWays);
+        while (sets & (sets - 1))
+        {
+            sets &= sets - 1;
+        }
+        setMask = sets ? sets - 1 : 0;
+        if (sets)
+            slots.reset(new Slot[sets * kCacheWays]);
+        slotCount = sets * kCacheWays;
+        shardCount = std::min(sets, kCacheShards);
+        if (shardCount)
+            shards.reset(new Shard[shardCount]);
+    }
+    AnswerCache(const AnswerCache &) = delete;
+    AnswerCache &operator=(const AnswerCache &) = delete;
+
+    // Copy the cached result of a question into dest with its TTLs counted down
+    // Return false on miss or when the entry has expired
+    // refresh is set on the one hit that finds a popular entry close to its expiry
+    bool lookup(const CacheKey &key, Clock::time_point now, DNSResult &dest, bool &refresh)
+    {
+        refresh = false;
+        Snapshot s;
+        Slot *slot = find(key, s);
+        if (slot == nullptr || s.expiry <= now)
+            return false;
+        // A writer may have reused the slot since the copy, at worst a refresh is missed or
+        // asked for the new entry, the answer itself comes from the checked copy
+        if (slot->hits.load(std::memory_order_relaxed) < kCacheHitCap)
+            slot->hits.fetch_add(1, std::memory_order_relaxed);
+        // Only hits in the last tenth of the TTL tell the entry is still wanted as it runs out
+        if ((s.expiry - now) * 10 < s.expiry - s.storedAt)
+        {
+            uint32_t windowHits = slot->windowHits.load(std::memory_order_relaxed);
+            if (windowHits < kPrefetchHits)
+                windowHits = slot->windowHits.fetch_add(1, std::memory_order_relaxed) + 1;
+            // The first hit past refreshAfter claims the refresh and holds off the others for a while,
+            // so a prefetch that fails or is not cached does not keep the entry from refreshing again
+            int64_t ticks = now.time_since_epoch().count();
+            int64_t after = slot->refreshAfter.load(std::memory_order_relaxed);
+            if (windowHits >= kPrefetchHits && after <= ticks &&
+                slot->refreshAfter.compare_exchange_strong(after, (now + kPrefetchRetry).time_since_epoch().count(),
+                                                           std::memory_order_relaxed))
+                refresh = true;
+        }
+        uint32_t elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - s.storedAt).count();
+        return decode(s, key.length, dest, [elapsed](uint32_t ttl)
+                      { return ttl - elapsed; });
+    }
+
+    // Whether lookupStale would find an answer
+    bool hasStale(const CacheKey &key, Clock::time_point now) const
+    {
+        Snapshot s;
+        return find(key, s) && s.expiry <= now && now < s.expiry + staleFor;
+    }
+
+    // Copy an expired result still within the stale window into dest, every TTL set to kStaleTtl
+    bool lookupStale(const CacheKey &key, Clock::time_point now, DNSResult &dest)
+    {
+        Snapshot s;
+        if (!find(key, s) || s.expiry > now || now >= s.expiry + staleFor)
+            return false;
+        return decode(s, key.length, dest, [](uint32_t)
+                      { return kStaleTtl; });
+    }
+
+    // Remember the result of a question until its TTL runs out, see cacheTtl
+    void insert(const CacheKey &key, const DNSResult &result, Clock::time_point now)
+    {
+        if (slotCount == 0)
+            return;
+        uint32_t ttl = cacheTtl(result);
+        if (ttl == 0)
+            return;
+        // Encoded on the stack first, outside the lock, a result too big for a slot is dropped here
+        Snapshot s;
+        memcpy(s.bytes, key.data, key.length);
+        size_t length = encode(result, s.bytes + key.length, sizeof(s.bytes) - key.length);
+        if (length == 0)
+            return;
+        s.dataLength = key.length + length;
+
+        uint32_t hash = hashWireName(key.data, key.length);
+        size_t set = hash & setMask;
+        Shard &shard = shards[set % shardCount];
+        while (shard.locked.exchange(true, std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+        Slot *victim = pickSlot(set, hash, key, now);
+        uint32_t seq = victim->seq.load(std::memory_order_relaxed);
+        victim->seq.store(seq + 1, std::memory_order_relaxed); // Odd, readers stay away
+        std::atomic_thread_fence(std::memory_order_release);
+        victim->hash = hash;
+        victim->keyLength = key.length;
+        victim->dataLength = s.dataLength;
+        victim->rcode = result.rcode;
+        victim->storedAt = now;
+        victim->expiry = now + std::chrono::seconds(ttl);
+        memcpy(victim->bytes, s.bytes, s.dataLength);
+        victim->hits.store(0, std::memory_order_relaxed);
+        victim->windowHits.store(0, std::memory_order_relaxed);
+        victim->refreshAfter.store(0, std::memory_order_relaxed);
+        victim->seq.store(seq + 2, std::memory_order_release);
+        shard.locked.store(false, std::memory_order_release);
+    }
+
+    size_t capacity() const { return slotCount; }
+
+private:
+    static constexpr size_t kSlotHeader = 64;
+
+    struct alignas(64) Slot
+    {
+        std::atomic<uint32_t> seq{0}; // Odd while a writer is in the slot
+        std::atomic<uint32_t> hits{0}; // Over the whole life of the entry, up to kCacheHitCap
+        std::atomic<uint32_t> windowHits{0}; // In the last tenth of its TTL, up to kPrefetchHits
+        std::atomic<int64_t> refreshAfter{0}; // Clock ticks, a refresh was asked for and no other is until then
+        uint32_t hash = 0;
+        uint16_t keyLength = 0; // 0 for a slot never used
+        uint16_t dataLength = 0; // Key and records
+        uint8_t rcode = 0;
+        Clock::time_point storedAt;
+        Clock::time_point expiry;
+        char bytes[kCacheSlotBytes - kSlotHeader]; // The key, then the records, see encode
+    };
+    static_assert(sizeof(Slot) == kCacheSlotBytes, "slot header outgrew kSlotHeader");
+
+    // Writer lock of a run of sets, alone on its cache line
+    struct alignas(64) Shard
+    {
+        std::atomic<bool> locked{false};
+    };
+
+    // A checked copy of a slot, taken by a reader
+    struct Snapshot
+    {
+        uint16_t dataLength;
+        uint8_t rcode;
+        Clock::time_point storedAt;
+        Clock::time_point expiry;
+        char bytes[kCacheSlotBytes - kSlotHeader];
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::unique_ptr<Shard[]> shards;
+    size_t slotCount = 0;
+    size_t shardCount = 0;
+    size_t setMask = 0;
+    std::chrono::seconds staleFor;
+
+    // Find the slot holding key and copy it into s, nullptr on miss
+    // A slot a writer keeps busy through every try counts as a miss
+    Slot *find(const CacheKey &key, Snapshot &s) const
+    {
+        if (slotCount == 0)
+            return nullptr;
+        uint32_t hash = hashWireName(key.data, key.length);
+        Slot *set = &slots[(hash & setMask) * kCacheWays];
+        for (size_t way = 0; way < kCacheWays; way++)
+        {
+            Slot &slot = set[way];
+            for (int attempt = 0; attempt < 4; attempt++)
+            {
+                uint32_t before = slot.seq.load(std::memory_order_acquire);
+                if (before & 1)
+                    continue;
+                if (slot.hash != hash || slot.keyLength != key.length)
+                    break;
+                s.dataLength = std::min<size_t>(slot.dataLength, sizeof(s.bytes));
+                s.rcode = slot.rcode;
+                s.storedAt = slot.storedAt;
+                s.expiry = slot.expiry;
+                memcpy(s.bytes, slot.bytes, s.dataLength);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.seq.load(std::memory_order_relaxed) != before)
+                    continue;
+                if (memcmp(s.bytes, key.data, key.length) != 0)
+                    break;
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    // Slot of the set for a new entry: the one holding the key already, else an empty one, else
+    // one past its stale window, else the least hit one, the earliest to expire among equals
+    // Called with the shard locked, so only readers race with it
+    Slot *pickSlot(size_t set, uint32_t hash, const CacheKey &key, Clock::time_point now)
+    {
+        Slot *ways = &slots[set * kCacheWays];
+        for (size_t way = 0; way < kCacheWays; way++)
+        {
+            Slot &slot = ways[way];
+            if (slot.keyLength && slot.hash == hash && slot.keyLength == key.length &&
+                memcmp(slot.bytes, key.data, key.length) == 0)
+                return &slot;
+        }
+        Slot *best = nullptr;
+        for (size_t way = 0; way < kCacheWays; way++)
+        {
+            Slot &slot = ways[way];
+            if (slot.keyLength == 0 || slot.expiry + staleFor <= now)
+                return &slot;
+            if (best == nullptr || slot.hits.load(std::memory_order_relaxed) < best->hits.load(std::memory_order_relaxed) ||
+                (slot.hits.load(std::memory_order_relaxed) == best->hits.load(std::memory_order_relaxed) && slot.expiry < best->expiry))
+                best = &slot;
+        }
+        return best;
+    }
+
+    // Records go one after the other as: section, name length and name in text, type, class and
+    // TTL as received, RDATA length and RDATA. A name equal to the one before is stored as
+    // length 0xFF and no name, so an RRset pays for its owner once. 0 if it does not fit
+    static size_t encode(const DNSResult &result, char *dest, size_t capacity)
+    {
+        size_t pos = 0;
+        const DNSString *previous = nullptr;
+        uint8_t section = 0;
+        for (const DNSVector<DNSAnswer> *records : {&result.answers, &result.authorities, &result.additionals})
+        {
+            for (const DNSAnswer &a : *records)
+            {
+                bool same = previous && *previous == a.name;
+                size_t need = 2 + (same ? 0 : a.name.size()) + 10 + a.rData.size();
+                if (pos + need > capacity || a.name.size() >= 0xFF || a.rData.size() > UINT16_MAX)
+                    return 0;
+                dest[pos++] = section;
+                dest[pos++] = same ? char(0xFF) : char(a.name.size());
+                if (!same)
+                {
+                    memcpy(dest + pos, a.name.data(), a.name.size());
+                    pos += a.name.size();
+                }
+                uint16_t rdLength = htons(a.rData.size());
+                memcpy(dest + pos, &a.type, sizeof(uint16_t));
+                memcpy(dest + pos + 2, &a._class, sizeof(uint16_t));
+                memcpy(dest + pos + 4, &a.ttl, sizeof(uint32_t));
+                memcpy(dest + pos + 8, &rdLength, sizeof(uint16_t));
+                pos += 10;
+                memcpy(dest + pos, a.rData.data(), a.rData.size());
+                pos += a.rData.size();
+                previous = &a.name;
+            }
+            section++;
+        }
+        // An empty result still takes a byte, 0 means it did not fit
+        if (pos == 0 && capacity)
+            dest[pos++] = char(0xFF);
+        return pos;
+    }
+
+    // Rebuild the result from a copy made by find, ttl maps every stored TTL (host order) to the one to give out
+    template <typename TtlFn>
+    static bool decode(const Snapshot &s, size_t keyLength, DNSResult &dest, TtlFn ttl)
+    {
+        dest.clear();
+        dest.rcode = s.rcode;
+        DNSVector<DNSAnswer> *sections[] = {&dest.answers, &dest.authorities, &dest.additionals};
+        const char *p = s.bytes + keyLength, *end = s.bytes + s.dataLength;
+        std::string_view previous;
+        while (end - p >= 2 && uint8_t(p[0]) < 3)
+        {
+            DNSVector<DNSAnswer> &section = *sections[uint8_t(p[0])];
+            uint8_t nameLength = p[1];
+            p += 2;
+            if (nameLength != 0xFF)
+            {
+                if (end - p < nameLength)
+                    return false;
+                previous = std::string_view(p, nameLength);
+                p += nameLength;
+            }
+            DNSAnswer &a = section.emplace_back();
+            a.name = previous;
+            if (end - p < 10)
+                return false;
+            memcpy(&a.type, p, sizeof(uint16_t));
+            memcpy(&a._class, p + 2, sizeof(uint16_t));
+            memcpy(&a.ttl, p + 4, sizeof(uint32_t));
+            memcpy(&a.rdLength, p + 8, sizeof(uint16_t));
+            p += 10;
+            if (end - p < ntohs(a.rdLength))
+                return false;
+            a.rData.assign(p, ntohs(a.rdLength));
+            p += ntohs(a.rdLength);
+            a.ttl = htonl(ttl(ntohl(a.ttl)));
+        }
+        return true;
+    }
+
+    // Seconds a result may be kept: the smallest TTL among its records, capped for a negative
+    // result by the TTL and MINIMUM of the SOA that came with it. 0 when it should not be kept,
+    // errors other than NXDOMAIN and negative results without a SOA are never cached.
+    static uint32_t cacheTtl(const DNSResult &result)
+    {
+        if (result.rcode != 0 && result.rcode != 3)
+            return 0;
+        uint32_t ttl = UINT32_MAX;
+        const DNSAnswer *soa = nullptr;
+        for (const DNSVector<DNSAnswer> *section : {&result.answers, &result.authorities, &result.additionals})
+        {
+            for (const DNSAnswer &a : *section)
+            {
+                ttl = std::min(ttl, ntohl(a.ttl));
+                if (section == &result.authorities && ntohs(a.type) == kTypeSOA && !soa)
+                    soa = &a;
+            }
+        }
+        if (result.rcode == 0 && !result.answers.empty())
+            return ttl;
+        if (!soa || soa->rData.size() < sizeof(uint32_t))
+            return 0;
+        uint32_t minimum;
+        memcpy(&minimum, soa->rData.data() + soa->rData.size() - sizeof(uint32_t), sizeof(uint32_t));
+        return std::min(ttl, ntohl(minimum));
+    }
+};
+
+#endif
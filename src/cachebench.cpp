@@ -0,0 +1,216 @@
+/////////////////////////////////////////////
+//////////     cache benchmark      /////////
+/////////////////////////////////////////////
+// Lookup throughput of the shared answer cache as threads are added, next to the same cache
+// behind one mutex, which is what sharing it naively would look like.
+// Every thread looks up random names out of a warm key set, --writes makes that share of the
+// operations inserts instead.
+#include <iostream>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cache.hpp"
+
+const char *usage = "Usage: cache-bench [--threads <max>] [--keys <n>] [--seconds <s>] [--writes <percent>]";
+
+struct BenchKey
+{
+    char wire[kMaxNameLength];
+    DNSQuestionView question;
+};
+
+// host<i>.example.com A, each with one A record
+std::vector<BenchKey> make_keys(size_t count)
+{
+    std::vector<BenchKey> keys(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string label = "host" + std::to_string(i);
+        char *w = keys[i].wire;
+        size_t pos = 0;
+        w[pos++] = label.size();
+        memcpy(w + pos, label.data(), label.size());
+        pos += label.size();
+        memcpy(w + pos, "\x07" "example" "\x03" "com", 13);
+        pos += 13;
+        uint16_t length = pos;
+        keys[i].question = {{w, length, 0, length}, htons(kTypeA), htons(kClassIN)};
+    }
+    return keys;
+}
+
+DNSResult make_result(const BenchKey &key, size_t i)
+{
+    DNSResult result;
+    result.clear();
+    DNSAnswer &a = result.answers.emplace_back();
+    char name[kMaxNameLength];
+    a.name.assign(name, key.question.qName.toWire(name));
+    a.type = htons(kTypeA);
+    a._class = htons(kClassIN);
+    a.ttl = htonl(3600);
+    uint32_t address = htonl(0x0A000000 | uint32_t(i));
+    a.rData.assign(reinterpret_cast<const char *>(&address), sizeof(address));
+    a.rdLength = htons(a.rData.size());
+    return result;
+}
+
+// Run threads workers for the given time, return operations per second over all of them
+template <typename LookupFn, typename InsertFn>
+double run(size_t threads, const std::vector<BenchKey> &keys, double seconds, unsigned writes, LookupFn lookup, InsertFn insert)
+{
+    std::atomic<bool> stop{false};
+    std::vector<uint64_t> counts(threads * 8); // Padded, every thread counts on its own cache line
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
+                             {
+                                 std::mt19937_64 random(t + 1);
+                                 DNSResult dest;
+                                 uint64_t done = 0;
+                                 while (!stop.load(std::memory_order_relaxed))
+                                 {
+                                     for (int i = 0; i < 256; i++)
+                                     {
+                                         size_t k = random() % keys.size();
+                                         CacheKey key(keys[k].question, false);
+                                         if (writes && random() % 100 < writes)
+                                             insert(key, make_result(keys[k], k));
+                                         else
+                                             lookup(key, dest);
+                                     }
+                                     done += 256;
+                                 }
+                                 counts[t * 8] = done; });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    uint64_t total = 0;
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers[t].join();
+        total += counts[t * 8];
+    }
+    return total / seconds;
+}
+
+// Whole string as a non-negative integer, false on anything else
+bool parse_number(size_t &dst, const std::string &src)
+{
+    try
+    {
+        size_t idx = 0;
+        dst = std::stoull(src, &idx);
+        return idx == src.size() && src[0] != '-';
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+// Whole string as a finite non-negative number, false on anything else
+bool parse_decimal(double &dst, const std::string &src)
+{
+    try
+    {
+        size_t idx = 0;
+        dst = std::stod(src, &idx);
+        return idx == src.size() && std::isfinite(dst) && dst >= 0;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    size_t keyCount = 10000;
+    double seconds = 1;
+    unsigned writes = 0;
+    for (int i = 1; i < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+        std::string value = argv[i + 1];
+        bool valid = true;
+        size_t number = 0;
+        if (flag == "--threads")
+            valid = parse_number(maxThreads, value);
+        else if (flag == "--keys")
+            valid = parse_number(keyCount, value);
+        else if (flag == "--seconds")
+            valid = parse_decimal(seconds, value);
+        else if (flag == "--writes")
+        {
+            valid = parse_number(number, value);
+            writes = std::min<size_t>(100, number);
+        }
+        else
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+        if (!valid)
+        {
+            std::cerr << "Not a correct value for " << flag << ": " << value << std::endl
+                      << usage << std::endl;
+            return 1;
+        }
+    }
+    if (maxThreads == 0 || keyCount == 0 || seconds <= 0)
+    {
+        std::cerr << usage << std::endl;
+        return 1;
+    }
+
+    std::vector<BenchKey> keys = make_keys(keyCount);
+    // Room for every key many times over, so the numbers are about hits and not evictions
+    AnswerCache cache(keyCount * kCacheSlotBytes * 8);
+    std::mutex lock;
+    auto now = AnswerCache::Clock::now();
+    for (size_t k = 0; k < keys.size(); k++)
+    {
+        cache.insert(CacheKey(keys[k].question, false), make_result(keys[k], k), now);
+    }
+
+    auto sharedLookup = [&](const CacheKey &key, DNSResult &dest)
+    {
+        bool refresh;
+        cache.lookup(key, AnswerCache::Clock::now(), dest, refresh);
+    };
+    auto sharedInsert = [&](const CacheKey &key, const DNSResult &result)
+    { cache.insert(key, result, AnswerCache::Clock::now()); };
+    auto mutexLookup = [&](const CacheKey &key, DNSResult &dest)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        sharedLookup(key, dest);
+    };
+    auto mutexInsert = [&](const CacheKey &key, const DNSResult &result)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        sharedInsert(key, result);
+    };
+
+    std::cout << keyCount << " keys, " << writes << "% writes, " << seconds << " s per run" << std::endl;
+    std::cout << "threads  sharded Mops/s  one mutex Mops/s" << std::endl;
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        double sharded = run(threads, keys, seconds, writes, sharedLookup, sharedInsert);
+        double locked = run(threads, keys, seconds, writes, mutexLookup, mutexInsert);
+        printf("%7zu  %14.2f  %16.2f\n", threads, sharded / 1e6, locked / 1e6);
+        if (threads < maxThreads && threads * 2 > maxThreads)
+            threads = maxThreads / 2; // The last run uses every thread asked for
+    }
+    return 0;
+}
@@ -1,12 +1,453 @@
 /////////////////////////////////////////////
 //////////       client side        /////////
 /////////////////////////////////////////////
+// Load generator: replays a query mix against a DNS server with many queries in flight, either
+// flat-out or at a target rate, and reports throughput, loss and the latency distribution.
+// Queries come from a name list, from a pcap capture (such as the one dns-server --capture
+// writes) or are made up. Point it at dns-server running in front of dns-stub to measure the
+// whole forwarding path on one machine.
 #include <iostream>
+#include <cmath>
 #include <cstring>
-#include "netstruct.hpp"
+#include <deque>
 #include <fstream>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
 #include <vector>
-int main(int argc, char **argv) // Take in a ipv4 address argument and send to the server a dns query
+#include "netstruct.hpp"
+#include "batchio.hpp"
+#include "metrics.hpp"
+
+const char *usage = "Usage: dns-bench [--server <ip>:<port>] [--names <file> | --pcap <file> | --unique <n>] [--qps <n>] [--inflight <n>]"
+                    " [--sockets <n>] [--duration <seconds>] [--timeout <ms>]";
+
+using Clock = std::chrono::steady_clock;
+
+// Each socket tells its queries apart by transaction id: the slot in the top 12 bits, and the low
+// 4 bits of the slot's sequence so a reply coming after its query timed out is rarely taken for
+// the query that reuses the slot. The deque of sent queries keeps the whole sequence, an entry
+// left there after its reply never matches a later query of the same slot
+constexpr size_t kMaxSlotsPerSocket = 4096;
+
+struct BenchOptions
+{
+    sockaddr_in server = {.sin_family = AF_INET, .sin_port = htons(2053), .sin_addr = {htonl(INADDR_LOOPBACK)}};
+    double qps = 0; // 0 sends as fast as replies free up slots
+    size_t inflight = 256;
+    size_t sockets = 8; // Several source ports, so the server's SO_REUSEPORT workers all get a share
+    double duration = 5;
+    std::chrono::milliseconds timeout{1000};
+};
+
+struct Slot
+{
+    Clock::time_point sentAt;
+    uint32_t sequence = 0; // Queries sent from this slot so far
+    bool busy = false;
+};
+
+// A query sent and not answered yet, in the order they were sent
+struct Outstanding
+{
+    uint32_t socket;
+    uint16_t slot;
+    uint32_t sequence;
+    Clock::time_point sentAt;
+};
+
+// Serialize a one question query asking for up to kDefaultEdnsSize, so big answers do not come back truncated
+bool make_query(std::string &dst, const std::string &name, uint16_t type)
+{
+    DNSMessage req;
+    req.header.transactionId = 0;
+    req.header.flags = htons(0x0100); // RD
+    req.header.qdCount = htons(1);
+    req.header.anCount = 0;
+    req.header.nsCount = 0;
+    req.header.arCount = 0;
+    DNSQuestion q;
+    char wire[kMaxNameLength];
+    size_t wireLen = dottedToWire(name, wire);
+    if (wireLen == 0)
+        return false;
+    q.qName.assign(wire, wireLen);
+    q.qType = htons(type);
+    q.qClass = htons(kClassIN);
+    req.questions.push_back(q);
+    DNSAnswer opt;
+    opt.name.assign(1, '\0'); // The root
+    opt.type = htons(kTypeOPT);
+    opt._class = htons(kDefaultEdnsSize);
+    opt.ttl = 0;
+    opt.rdLength = 0;
+    req.additionals.push_back(opt);
+
+    char sendBuf[kDefaultEdnsSize];
+    size_t offset = 0;
+    if (!serializeDNSMessage(sendBuf, sizeof(sendBuf), req, offset))
+        return false;
+    dst.assign(sendBuf, offset);
+    return true;
+}
+
+// One query per line, "<name> [type]", A when the type is left out, # starts a comment
+bool load_names(std::vector<std::string> &queries, const std::string &path, std::string &error_mes)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        error_mes = "Can not open name list \"" + path + "\".";
+        return false;
+    }
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string name, typeText;
+        if (!(fields >> name))
+            continue;
+        uint16_t type = kTypeA;
+        if (fields >> typeText && !parseTypeName(typeText, type))
+        {
+            error_mes = path + ":" + std::to_string(lineNumber) + ": unknown type \"" + typeText + "\".";
+            return false;
+        }
+        std::string query;
+        if (!make_query(query, name, type))
+        {
+            error_mes = path + ":" + std::to_string(lineNumber) + ": \"" + name + "\" is not a valid name.";
+            return false;
+        }
+        queries.push_back(std::move(query));
+    }
+    return true;
+}
+
+// The DNS queries out of the UDP packets of a pcap file, raw IPv4 (what --capture writes) or Ethernet
+// Responses and anything that is not UDP over IPv4 are skipped
+bool load_pcap(std::vector<std::string> &queries, const std::string &path, std::string &error_mes)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!file && !file.eof())
+    {
+        error_mes = "Can not read capture \"" + path + "\".";
+        return false;
+    }
+    auto read32 = [&](size_t at, bool swap)
+    {
+        uint32_t v;
+        memcpy(&v, data.data() + at, 4);
+        return swap ? __builtin_bswap32(v) : v;
+    };
+    if (data.size() < 24)
+    {
+        error_mes = "\"" + path + "\" is not a pcap file.";
+        return false;
+    }
+    uint32_t magic = read32(0, false);
+    bool swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    if (!swap && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d)
+    {
+        error_mes = "\"" + path + "\" is not a pcap file (pcapng is not supported).";
+        return false;
+    }
+    uint32_t linkType = read32(20, swap);
+    size_t linkHeader = linkType == 1 ? 14 : (linkType == 101 || linkType == 228) ? 0 : SIZE_MAX;
+    if (linkHeader == SIZE_MAX)
+    {
+        error_mes = "\"" + path + "\" has link type " + std::to_string(linkType) + ", only raw IPv4 and Ethernet are supported.";
+        return false;
+    }
+
+    for (size_t pos = 24; pos + 16 <= data.size();)
+    {
+        size_t capLength = read32(pos + 8, swap);
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data.data()) + pos + 16;
+        pos += 16 + capLength;
+        if (pos > data.size())
+            break;
+        if (linkHeader && (capLength < linkHeader || p[12] != 0x08 || p[13] != 0x00))
+            continue;
+        p += linkHeader;
+        capLength -= linkHeader;
+        if (capLength < 20 || (p[0] >> 4) != 4 || p[9] != 17)
+            continue;
+        size_t ipHeader = (p[0] & 0xF) * 4;
+        if (capLength < ipHeader + 8)
+            continue;
+        size_t udpLength = (p[ipHeader + 4] << 8) | p[ipHeader + 5];
+        if (udpLength < 8 + 12 || udpLength - 8 > kPacketSize || ipHeader + udpLength > capLength)
+            continue;
+        const char *dns = reinterpret_cast<const char *>(p + ipHeader + 8);
+        if (dns[2] & 0x80)
+            continue;
+        queries.emplace_back(dns, udpLength - 8);
+    }
+    return true;
+}
+
+// Whole string as a non-negative integer, false on anything else
+bool parse_number(size_t &dst, const std::string &src)
+{
+    try
+    {
+        size_t idx = 0;
+        dst = std::stoull(src, &idx);
+        return idx == src.size() && src[0] != '-';
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+// Whole string as a finite non-negative number, false on anything else
+bool parse_decimal(double &dst, const std::string &src)
+{
+    try
+    {
+        size_t idx = 0;
+        dst = std::stod(src, &idx);
+        return idx == src.size() && std::isfinite(dst) && dst >= 0;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+bool parse_server(sockaddr_in &dst, const std::string &src)
+{
+    size_t colon = src.find(':');
+    std::string ip = src.substr(0, colon);
+    if (!inet_pton(AF_INET, ip.c_str(), &dst.sin_addr))
+        return false;
+    if (colon != std::string::npos)
+    {
+        size_t port;
+        if (!parse_number(port, src.substr(colon + 1)) || port == 0 || port > UINT16_MAX)
+            return false;
+        dst.sin_port = htons(port);
+    }
+    return true;
+}
+
+class Bench
+{
+public:
+    Bench(const BenchOptions &options, const std::vector<std::string> &queries)
+        : options(options), queries(queries), receiver(kDefaultBatchSize)
+    {
+        slotsPerSocket = std::min(kMaxSlotsPerSocket, (options.inflight + options.sockets - 1) / options.sockets);
+        for (size_t s = 0; s < options.sockets; s++)
+        {
+            int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            if (fd == -1)
+                throw std::runtime_error("Socket creation failed: " + std::string(strerror(errno)));
+            int size = 4 << 20;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            if (connect(fd, reinterpret_cast<const sockaddr *>(&options.server), sizeof(options.server)) != 0)
+                throw std::runtime_error("Connect failed: " + std::string(strerror(errno)));
+            fds.push_back({fd, POLLIN, 0});
+            senders.emplace_back(new BatchSender(fd, kDefaultBatchSize));
+            slots.emplace_back(slotsPerSocket);
+            for (size_t i = slotsPerSocket; i-- > 0;)
+            {
+                freeSlots.push_back({uint32_t(s), uint16_t(i), 0, {}});
+            }
+        }
+    }
+
+    ~Bench()
+    {
+        for (pollfd &p : fds)
+        {
+            close(p.fd);
+        }
+    }
+
+    void run()
+    {
+        start = Clock::now();
+        auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+        auto nextReport = start + std::chrono::seconds(1);
+        // Keep going after the last send until every query is answered or timed out
+        while (true)
+        {
+            auto now = Clock::now();
+            if (now < end)
+                send(now);
+            else if (outstanding.empty())
+                break;
+            expire(now);
+
+            if (now >= nextReport)
+            {
+                printf("%5.0fs  sent %10llu  answered %10llu  lost %8llu\n",
+                       std::chrono::duration<double>(now - start).count(), (unsigned long long)sent,
+                       (unsigned long long)answered, (unsigned long long)lost);
+                nextReport += std::chrono::seconds(1);
+            }
+
+            // Sleep until a reply comes in, the next query is due or the oldest one times out
+            auto wake = std::min(nextReport, outstanding.empty() ? end : outstanding.front().sentAt + options.timeout);
+            if (now < end && !freeSlots.empty())
+                wake = std::min(wake, options.qps > 0 ? scheduled(sent) : now);
+            int timeout = std::max<int64_t>(0, std::chrono::ceil<std::chrono::milliseconds>(wake - now).count());
+            if (poll(fds.data(), fds.size(), timeout) > 0)
+                receive();
+        }
+        finish = Clock::now();
+    }
+
+    void report() const
+    {
+        HistogramSnapshot latency;
+        latency.add(histogram);
+        double elapsed = std::chrono::duration<double>(finish - start).count();
+        printf("\nSent      %llu queries in %.2f s, %.0f qps\n", (unsigned long long)sent, elapsed, sent / elapsed);
+        printf("Answered  %llu, %.0f qps\n", (unsigned long long)answered, answered / elapsed);
+        printf("Lost      %llu (%.3f%%), %llu answered after the %lld ms timeout\n", (unsigned long long)lost,
+               sent ? 100.0 * lost / sent : 0.0, (unsigned long long)late, (long long)options.timeout.count());
+        printf("RCODEs   ");
+        static const char *names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+        for (size_t r = 0; r < 16; r++)
+        {
+            if (rcodes[r])
+                printf(" %s %llu", r < 6 ? names[r] : std::to_string(r).c_str(), (unsigned long long)rcodes[r]);
+        }
+        if (truncated)
+            printf(" (%llu with TC)", (unsigned long long)truncated);
+        printf("\nLatency   mean %.3f ms  p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+               latency.count ? latency.sumNanoseconds / 1e6 / latency.count : 0.0, latency.quantile(0.5) / 1e3,
+               latency.quantile(0.99) / 1e3, latency.quantile(0.999) / 1e3, maxLatency.count() / 1e6);
+    }
+
+private:
+    const BenchOptions &options;
+    const std::vector<std::string> &queries;
+    std::vector<pollfd> fds;
+    std::vector<std::unique_ptr<BatchSender>> senders;
+    BatchReceiver receiver;
+    std::vector<std::vector<Slot>> slots;
+    size_t slotsPerSocket;
+    std::vector<Outstanding> freeSlots;
+    std::deque<Outstanding> outstanding;
+    size_t nextSocket = 0;
+
+    Clock::time_point start, finish;
+    uint64_t sent = 0, answered = 0, lost = 0, late = 0, truncated = 0;
+    uint64_t rcodes[16] = {};
+    LatencyHistogram histogram;
+    Clock::duration maxLatency{0};
+
+    // When query n is due at the target rate
+    Clock::time_point scheduled(uint64_t n) const
+    {
+        return start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(n / options.qps));
+    }
+
+    void send(Clock::time_point now)
+    {
+        while (!freeSlots.empty())
+        {
+            // At a target rate, latency counts from when the query was due rather than when a slot
+            // freed up, so a server that falls behind is not flattered by the queue it caused
+            Clock::time_point sentAt = now;
+            if (options.qps > 0)
+            {
+                sentAt = scheduled(sent);
+                if (sentAt > now)
+                    break;
+            }
+            Outstanding o = freeSlots.back();
+            freeSlots.pop_back();
+            Slot &slot = slots[o.socket][o.slot];
+            slot.busy = true;
+            slot.sequence++;
+            slot.sentAt = sentAt;
+            o.sequence = slot.sequence;
+            o.sentAt = sentAt;
+            outstanding.push_back(o);
+
+            const std::string &query = queries[sent % queries.size()];
+            uint16_t id = htons(uint16_t(o.slot << 4 | (o.sequence & 0xF)));
+            char *packet = senders[o.socket]->reserve();
+            memcpy(packet, query.data(), query.size());
+            memcpy(packet, &id, 2);
+            senders[o.socket]->commit(query.size(), options.server, sizeof(options.server));
+            sent++;
+        }
+        for (auto &sender : senders)
+        {
+            sender->flush();
+        }
+    }
+
+    void receive()
+    {
+        for (size_t s = 0; s < fds.size(); s++)
+        {
+            if (!(fds[s].revents & POLLIN))
+                continue;
+            while (size_t n = receiver.receive(fds[s].fd))
+            {
+                auto now = Clock::now();
+                for (size_t i = 0; i < n; i++)
+                {
+                    const char *reply = receiver.data(i);
+                    if (receiver.length(i) < 12)
+                        continue;
+                    uint16_t id = (uint8_t(reply[0]) << 8) | uint8_t(reply[1]);
+                    size_t index = id >> 4;
+                    if (index >= slotsPerSocket || !slots[s][index].busy || (slots[s][index].sequence & 0xF) != (id & 0xF))
+                    {
+                        late++;
+                        continue;
+                    }
+                    Slot &slot = slots[s][index];
+                    slot.busy = false;
+                    freeSlots.push_back({uint32_t(s), uint16_t(index), 0, {}});
+                    answered++;
+                    rcodes[reply[3] & 0xF]++;
+                    if (reply[2] & 0x02)
+                        truncated++;
+                    histogram.record(now - slot.sentAt);
+                    maxLatency = std::max(maxLatency, now - slot.sentAt);
+                }
+                if (n < receiver.capacity())
+                    break;
+            }
+        }
+    }
+
+    // Give up on queries past the timeout, the oldest are at the front
+    void expire(Clock::time_point now)
+    {
+        while (!outstanding.empty())
+        {
+            const Outstanding &o = outstanding.front();
+            Slot &slot = slots[o.socket][o.slot];
+            if (slot.busy && slot.sequence == o.sequence)
+            {
+                if (o.sentAt + options.timeout > now)
+                    break;
+                slot.busy = false;
+                freeSlots.push_back({o.socket, o.slot, 0, {}});
+                lost++;
+            }
+            outstanding.pop_front();
+        }
+    }
+};
+
+int main(int argc, char **argv)
 {
     // Flush after every std::cout / std::cerr
     std::cout << std::unitbuf;
@@ -14,76 +455,114 @@ int main(int argc, char **argv) // Take in a ipv4 address argument and send to t
     // Disable output buffering
     setbuf(stdout, NULL);
 
-    if (argc != 2)
+    BenchOptions options;
+    std::string namesPath, pcapPath;
+    size_t unique = 1000;
+    for (int i = 1; i < argc; i += 2)
     {
-        std::cerr << "Your are giving " << argc - 1 << " arguments, 1 expected!" << std::endl;
-        return 1;
+        std::string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+        std::string value = argv[i + 1];
+        bool valid = true;
+        size_t number = 0;
+        if (flag == "--server")
+        {
+            if (!parse_server(options.server, value))
+            {
+                std::cerr << "Not a correct <ip>:<port>: " << value << std::endl
+                          << usage << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--names")
+            namesPath = value;
+        else if (flag == "--pcap")
+            pcapPath = value;
+        else if (flag == "--unique")
+            valid = parse_number(unique, value);
+        else if (flag == "--qps")
+            valid = parse_decimal(options.qps, value);
+        else if (flag == "--inflight")
+            valid = parse_number(options.inflight, value);
+        else if (flag == "--sockets")
+            valid = parse_number(options.sockets, value);
+        else if (flag == "--duration")
+            valid = parse_decimal(options.duration, value);
+        else if (flag == "--timeout")
+        {
+            valid = parse_number(number, value);
+            options.timeout = std::chrono::milliseconds(number);
+        }
+        else
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+        if (!valid)
+        {
+            std::cerr << "Not a correct value for " << flag << ": " << value << std::endl
+                      << usage << std::endl;
+            return 1;
+        }
     }
-    // Convert the argument into network ip address
-    uint32_t ser_ip;
-    if (!inet_pton(AF_INET, argv[1], &ser_ip))
+    if (options.inflight == 0 || options.sockets == 0 || options.duration <= 0 || unique == 0)
     {
-        std::cerr << "Not a correct IPv4 address!" << std::endl;
+        std::cerr << usage << std::endl;
         return 1;
     }
-    int udpSocket;
-    udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udpSocket == -1)
+    options.sockets = std::min(options.sockets, options.inflight);
+    if (options.inflight > options.sockets * kMaxSlotsPerSocket)
     {
-        std::cerr << "Socket creation failed. Please try again!" << std::endl;
+        std::cerr << "At most " << kMaxSlotsPerSocket << " queries can be in flight per socket." << std::endl;
         return 1;
     }
-    sockaddr_in serverAddress = {
-        .sin_family = AF_INET,
-        .sin_port = htons(2053),
-        .sin_addr = {ser_ip},
-    };
-    // Construct a normal dns query
-    DNSMessage req;
-    req.header.transactionId = htons(1904);
-    req.header.flags = 0;
-    req.header.qdCount = htons(2);
-    req.header.anCount = 0;
-    req.header.nsCount = 0;
-    req.header.arCount = 0;
-
-    DNSQuestion q1;
-    q1.qName = "codecrafters.io";
-    q1.qType = htons(1);
-    q1.qClass = htons(1);
-    req.questions.push_back(q1);
-    DNSQuestion q2;
-    q2.qName = "baolam.top";
-    q2.qType = htons(1);
-    q2.qClass = htons(1);
-    req.questions.push_back(q2);
-    // Serialize everything into a buffer:
-    char sendBuf[512];
-    size_t offset = 0;
 
-    serializeDNSMessage(sendBuf, req, offset);
-    // Send to serverAddress a dns query
-    if (sendto(udpSocket, sendBuf, offset, 0, reinterpret_cast<sockaddr *>(&serverAddress), sizeof(serverAddress)) == -1)
+    // The query mix, replayed in order and from the start again once used up
+    std::vector<std::string> queries;
+    std::string error_mes;
+    if (!namesPath.empty() && !load_names(queries, namesPath, error_mes))
     {
-        std::cerr << "Send data fails. Please try again!" << std::endl;
+        std::cerr << error_mes << std::endl;
+        return 1;
+    }
+    if (!pcapPath.empty() && !load_pcap(queries, pcapPath, error_mes))
+    {
+        std::cerr << error_mes << std::endl;
+        return 1;
+    }
+    if (namesPath.empty() && pcapPath.empty())
+    {
+        for (size_t i = 0; i < unique; i++)
+        {
+            queries.emplace_back();
+            make_query(queries.back(), "host" + std::to_string(i) + ".bench.test", kTypeA);
+        }
+    }
+    if (queries.empty())
+    {
+        std::cerr << "No queries to send." << std::endl;
         return 1;
     }
 
-    // Hear back the dns response from server
-    char buffer[512];
-    sockaddr_in recvAddr;
-    socklen_t recvAddrLen = sizeof(sockaddr_in);
-    int bytesReceived;
-    bytesReceived = recvfrom(udpSocket, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr *>(&recvAddr), &recvAddrLen);
-    if (bytesReceived == -1)
+    char server[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &options.server.sin_addr, server, sizeof(server));
+    std::cout << "Sending " << queries.size() << " distinct queries to " << server << ":" << ntohs(options.server.sin_port)
+              << " for " << options.duration << " s, " << options.inflight << " in flight over " << options.sockets
+              << " sockets, " << (options.qps > 0 ? std::to_string(size_t(options.qps)) + " qps" : std::string("flat-out")) << "." << std::endl;
+    try
+    {
+        Bench bench(options, queries);
+        bench.run();
+        bench.report();
+    }
+    catch (const std::exception &e)
     {
-        std::cerr << "Error receiving dns response! " << std::endl;
+        std::cerr << e.what() << std::endl;
         return 1;
     }
-    // Write back the dns response into a file
-    std::ofstream file("./src/serverResponse.txt", std::ios::out | std::ios::trunc);
-    file.write(buffer, bytesReceived);
-    file.close();
-    std::cout << "Received a dns response with" << bytesReceived << "bytes, stored in src/serverResponse.txt." << std::endl;
-    close(udpSocket);
-}
\ No newline at end of file
+    return 0;
+}
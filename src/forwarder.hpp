@@ -0,0 +1,1396 @@
+#ifndef MY_FORWARDER_CLASS
+#define MY_FORWARDER_CLASS
+
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "netstruct.hpp"
+#include "cache.hpp"
+#include "batchio.hpp"
+#include "upstream.hpp"
+#include "zone.hpp"
+#include "templates.hpp"
+#include "tcp.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "arena.hpp"
+#include "ratelimit.hpp"
+
+// Event driven forwarding engine.
+// Client queries are read from the listening socket, every question is sent to the fastest
+// healthy upstream resolver under a rewritten transaction id, and the reply for the client is assembled once
+// the upstream answers come back (in any order). Nothing in here blocks, so a slow upstream
+// answer only delays the client that asked for it.
+// A query with several questions is fanned out: all of its sub-queries leave in one sendmmsg
+// batch, so it costs about one upstream round trip instead of one per question.
+// Sockets are read with recvmmsg and written with sendmmsg, replies produced while handling one
+// batch are flushed together at the end of the loop iteration.
+// Questions inside the zones we serve are answered from the zone index, the ones answered
+// recently from the answer cache, neither touches the upstream. The hottest single questions
+// skip even that and are answered by patching a copy of a response sent before.
+// A sub-query the upstream does not answer within its per-try timeout is sent again, to another
+// upstream when several are configured, before the response goes out without it.
+// The upstream reply to a single question query is passed on byte for byte, whatever the record
+// types and sections in it. Only fanned out queries get a response rebuilt from the results.
+// EDNS(0) is spoken on both sides: upstream queries advertise our buffer size, and a client that
+// sent an OPT gets responses up to the size it advertised, with our own OPT at the end.
+// Clients may also come over TCP and keep several queries in flight per connection, each
+// response goes out as soon as it is ready. A reply that comes back from the upstream truncated
+// is asked for again over a TCP connection to that upstream, kept open for the next ones.
+// A question already on its way to the upstream is not sent again: the later queries asking it
+// wait on the same sub-query and all of them are answered from its reply.
+// A popular cached answer close to its expiry is fetched again in the background, under a request
+// of our own, so clients keep hitting the cache. With --serve-stale, a question the upstream fails
+// on (timeout or SERVFAIL) is answered from an expired entry if the cache still has one.
+// Once warmed up, a worker handles queries without touching the global heap: what a request
+// builds lives in the arena of its slot, reset when the response is out, and the tables that
+// change with every query take their nodes from a pool of the worker's own.
+// With --rate-limit, a UDP query from a client prefix over its rate is refused before it is even
+// parsed, dropped or answered truncated so the client comes back over TCP.
+
+using Clock = std::chrono::steady_clock;
+
+// Maximum number of client queries waiting on the upstream at the same time
+constexpr size_t kMaxInFlight = 4096;
+// Queries are small, every waiting query holds room for one this big. A bigger one over UDP is
+// dropped, one over TCP (up to kMaxTcpMessage) is copied into the arena of its request instead
+constexpr size_t kMaxQuerySize = kClassicUdpSize;
+
+// Counters of one forwarder, only ever written by the thread running it, the metrics endpoint reads them
+// On its own cache lines, next to another worker's it would make both workers slower
+struct alignas(64) ForwarderStats
+{
+    Counter queries;
+    Counter responses;
+    Counter servfails;
+    Counter truncated; // Responses that did not fit and went out with TC set
+    Counter dropped; // Queries we could not take (not a query, too many in flight)
+    Counter malformed; // Queries answered with FORMERR, and upstream replies thrown away
+    Counter upstreamQueries;
+    Counter upstreamReplies;
+    Counter upstreamTimeouts;
+    Counter upstreamRetries;
+    Counter localAnswers; // Responses written straight from our zones
+    Counter templateAnswers; // Responses copied from a template
+    Counter tcpQueries; // Of the queries, the ones that came over TCP
+    Counter tcpConnections; // Client connections accepted
+    Counter upstreamTcpQueries; // Upstream tries sent over TCP, after a truncated reply
+    Counter coalesced; // Questions that waited on a sub-query already in flight
+    Counter rateLimited; // UDP queries over the rate of their client prefix, dropped or slipped
+    Counter slipped; // Of those, the ones answered truncated
+    Counter prefetches; // Cached answers fetched again ahead of their expiry
+    Counter staleAnswers; // Questions answered from an expired entry after an upstream failure
+    Counter cacheHits;
+    Counter cacheMisses;
+    Counter rcodes[16]; // Responses by RCODE
+    LatencyHistogram clientLatency; // From receiving a query to queueing its response
+    LatencyHistogram upstreamRtt; // Round trips of answered upstream tries over UDP
+};
+
+// Where a response goes: back to a UDP peer, or onto one of our TCP client connections
+struct ClientRoute
+{
+    sockaddr_in address;
+    socklen_t addressLen;
+    int tcpFd = -1;         // -1 for UDP
+    uint64_t tcpSerial = 0; // The connection the query came on, its fd may have been reused since
+    Clock::time_point receivedAt; // For the latency of the response
+};
+
+// One client connection over TCP
+struct TcpClient
+{
+    TcpStream stream;
+    sockaddr_in address;
+    socklen_t addressLen;
+    uint64_t serial;
+    size_t waiting = 0;      // Queries of this connection waiting on the upstream
+    bool peerClosed = false; // Nothing more to read, closed once the last response is out
+    bool dirty = false;      // Output queued since the last flush
+    uint32_t interest = 0;   // Events epoll watches for
+    Clock::time_point fullSince; // When its output went over kMaxTcpOutput, zero while below
+};
+
+// Our connection to one upstream over TCP, opened for the first truncated reply and then kept
+struct UpstreamConnection
+{
+    TcpStream stream;
+    bool connected = false;
+    bool dirty = false;
+    uint32_t interest = 0;
+};
+
+// One client query waiting for its upstream answers
+struct ClientRequest
+{
+    RequestArena arena; // Holds results and everything in them, reset by releaseRequest
+    bool active = false;
+    ClientRoute route;
+    char *packet = inlinePacket; // Copy of the client query, the question views point into it
+    char inlinePacket[kMaxQuerySize]; // Where packet is, unless the query was too big for it
+    DNSHeader header;
+    Edns edns;
+    size_t questionCount;
+    DNSQuestionView questions[kMaxViewQuestions];
+    DNSVector<DNSResult> results{&arena}; // Result per question, replies may land in any order
+    bool settled[kMaxViewQuestions]; // Has its result, from a zone, the cache or the upstream
+    size_t outstanding = 0;          // Sub-queries neither answered nor expired yet
+    size_t answered = 0;
+    bool prefetch = false;           // Ours, to refresh the cache, nobody waits for the response
+};
+
+// A question of a client request
+struct QuestionRef
+{
+    uint32_t requestSlot;
+    uint16_t questionIndex;
+};
+
+// One upstream sub-query in flight, indexed by the transaction id we rewrote it to
+struct PendingQuery
+{
+    bool active = false;
+    uint32_t generation = 0; // Bumped on every reuse so stale timeout entries can be told apart
+    uint32_t requestSlot;
+    uint16_t questionIndex;
+    uint8_t upstream;      // Where the current try went
+    uint8_t attempts;      // Tries sent so far
+    bool tcp;              // Truncated over UDP once, every further try goes over TCP
+    bool listed;           // In the in-flight table under keyHash, later identical questions wait on it
+    size_t keyHash;
+    std::vector<QuestionRef> waiters; // The same question asked by other requests meanwhile
+    Clock::time_point sentAt; // Send time of the current try, for the RTT estimate
+};
+
+// Per-try timeouts differ between upstreams, so deadlines are kept in a min-heap
+struct PendingDeadline
+{
+    Clock::time_point deadline;
+    uint16_t id;
+    uint32_t generation;
+
+    bool operator>(const PendingDeadline &other) const { return deadline > other.deadline; }
+};
+
+class Forwarder
+{
+public:
+    Forwarder(int listenSocket, int tcpListenSocket, int upstreamSocket, const std::vector<sockaddr_in> &resolvers,
+              ZoneStore &zoneStore, AnswerCache &cache, RateLimiter &limiter, ForwarderStats &stats, size_t workerIndex,
+              size_t templateCount, size_t ednsSize, size_t batchSize)
+        : listenSocket(listenSocket), tcpListenSocket(tcpListenSocket), upstreamSocket(upstreamSocket),
+          upstreams(resolvers), upstreamConnections(resolvers.size()),
+          zoneStore(zoneStore), workerIndex(workerIndex), ednsSize(ednsSize),
+          requests(kMaxInFlight), pending(1 << 16), inFlight(&tablePool), freeIds(&tablePool), cache(cache), limiter(limiter),
+          templates(templateCount, &tablePool), stats(stats),
+          clientIn(batchSize), upstreamIn(batchSize),
+          clientOut(listenSocket, batchSize), upstreamOut(upstreamSocket, batchSize),
+          tcpScratch(kMaxTcpMessage)
+    {
+        // Only needed to fill in captured packets
+        socklen_t localLen = sizeof(localAddress);
+        getsockname(listenSocket, reinterpret_cast<sockaddr *>(&localAddress), &localLen);
+        for (uint32_t i = 0; i < kMaxInFlight; i++)
+        {
+            freeRequests.push_back(kMaxInFlight - 1 - i);
+            requests[i].arena.setPool(&arenaBlocks);
+        }
+        // Hand out upstream ids in a random order, so they can not be guessed from the client ids
+        std::vector<uint16_t> ids(1 << 16);
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            ids[i] = i;
+        }
+        std::shuffle(ids.begin(), ids.end(), std::mt19937(std::random_device{}()));
+        freeIds.assign(ids.begin(), ids.end());
+    }
+
+    const ForwarderStats &getStats() const { return stats; }
+    const AnswerCache &getCache() const { return cache; }
+    const UpstreamSet &getUpstreams() const { return upstreams; }
+    const ResponseTemplates &getTemplates() const { return templates; }
+
+    // Run the event loop forever, only returns on a fatal epoll error
+    bool run()
+    {
+        epfd = epoll_create1(0);
+        if (epfd == -1)
+        {
+            LOG_ERROR("epoll_create1 failed: %s", strerror(errno));
+            return false;
+        }
+        if (!watch(listenSocket) || !watch(upstreamSocket) || !watch(tcpListenSocket))
+        {
+            close(epfd);
+            return false;
+        }
+
+        epoll_event events[16];
+        while (true)
+        {
+            int n = epoll_wait(epfd, events, 16, nextTimeoutMs());
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+                close(epfd);
+                return false;
+            }
+            // Idle while in epoll_wait, so a zone reload never waits on a sleeping worker
+            uint64_t generation = zoneStore.generation();
+            zones = zoneStore.enter(workerIndex);
+            if (generation != zoneGeneration)
+            {
+                // Templates may hold answers from the zones just replaced
+                templates.clear();
+                zoneGeneration = generation;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == listenSocket)
+                    onClientReadable();
+                else if (fd == upstreamSocket)
+                    onUpstreamReadable();
+                else if (fd == tcpListenSocket)
+                    onTcpAccept();
+                else
+                    onStreamEvent(fd, events[i].events);
+            }
+            Clock::time_point now = Clock::now();
+            expirePending(now);
+            resumeClients();
+            if (now >= nextSweep)
+                sweepConnections(now);
+            upstreamOut.flush();
+            clientOut.flush();
+            flushStreams();
+            zoneStore.leave(workerIndex);
+            zones = nullptr;
+        }
+    }
+
+private:
+    int listenSocket;
+    int tcpListenSocket;
+    int upstreamSocket;
+    int epfd = -1;
+    UpstreamSet upstreams;
+    std::vector<UpstreamConnection> upstreamConnections; // One per upstream, every TCP try to it is pipelined on it
+    ZoneStore &zoneStore; // Shared by every worker, swapped on reload
+    size_t workerIndex;
+    size_t ednsSize; // UDP payload we advertise, to clients and upstreams alike
+    const ZoneIndex *zones = nullptr; // Taken from zoneStore for one batch of events at a time
+    uint64_t zoneGeneration = 0;
+    sockaddr_in localAddress = {};
+
+    // Declared ahead of everything allocating from them, so they go last
+    BlockPool arenaBlocks;                            // Blocks of the request arenas
+    std::pmr::unsynchronized_pool_resource tablePool; // Nodes of the in-flight table, the id queue and the template index
+
+    std::vector<ClientRequest> requests;
+    std::vector<uint32_t> freeRequests;
+    std::vector<PendingQuery> pending;   // Indexed by transaction id
+    std::pmr::unordered_map<size_t, uint16_t> inFlight; // Hash of the cache key of a question, to its sub-query
+    std::pmr::deque<uint16_t> freeIds; // FIFO, so a released id is reused as late as possible
+    std::priority_queue<PendingDeadline, std::vector<PendingDeadline>, std::greater<>> deadlines;
+    AnswerCache &cache; // Shared by every worker
+    RateLimiter &limiter; // Shared by every worker too
+    size_t refusedQueries = 0; // Counts to the next slip
+    ResponseTemplates templates;
+    ForwarderStats &stats; // Owned by main, for the metrics endpoint
+    BatchReceiver clientIn;
+    BatchReceiver upstreamIn;
+    BatchSender clientOut;
+    BatchSender upstreamOut;
+    DNSMessageView scratchView; // Scratch space for parsing, too big to live on the stack every time
+    ZoneAnswer zoneAnswers[kMaxViewQuestions];
+    std::unordered_map<int, TcpClient> tcpClients; // By fd
+    uint64_t tcpSerial = 0;
+    size_t connectedUpstreams = 0;   // Upstream connections open or being opened
+    std::vector<int> dirtyClients;   // Client connections with output to flush
+    std::vector<int> pausedClients;  // Client connections that may read again
+    std::vector<char> tcpScratch;    // Responses to TCP clients are written here, they may be bigger than a datagram
+    Clock::time_point nextSweep;
+
+    bool watch(int fd, uint32_t events = EPOLLIN, int op = EPOLL_CTL_ADD)
+    {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, op, fd, &ev) == -1)
+        {
+            LOG_ERROR("epoll_ctl failed: %s", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    int nextTimeoutMs()
+    {
+        // Open connections are looked at once a second for idle ones
+        Clock::time_point wake = Clock::time_point::max();
+        if (!deadlines.empty())
+            wake = deadlines.top().deadline;
+        if (!tcpClients.empty() || connectedUpstreams)
+            wake = std::min(wake, nextSweep);
+        // Connections that may read again are picked up on the next round
+        if (!pausedClients.empty())
+            return 0;
+        if (wake == Clock::time_point::max())
+            return -1;
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(wake - Clock::now());
+        return left.count() > 0 ? int(left.count()) + 1 : 0;
+    }
+
+    // Take one batch of client datagrams, epoll reports the socket again if more are waiting
+    void onClientReadable()
+    {
+        size_t n = clientIn.receive(listenSocket);
+        Clock::time_point receivedAt = Clock::now();
+        for (size_t i = 0; i < n; i++)
+        {
+            if (clientIn.truncated(i) || clientIn.length(i) > kMaxQuerySize)
+            {
+                LOG_SAMPLED(LogLevel::Warn, "Dropping a query larger than %zu bytes.", kMaxQuerySize);
+                continue;
+            }
+            LOG_SAMPLED(LogLevel::Debug, "Received a %zu-byte query.", clientIn.length(i));
+            if (Logger::instance().capturing())
+                Logger::instance().capture(clientIn.data(i), clientIn.length(i), clientIn.address(i), localAddress);
+            ClientRoute route = {clientIn.address(i), clientIn.addressLen(i), -1, 0, receivedAt};
+            if (!limiter.admit(clientIn.address(i), receivedAt))
+            {
+                stats.queries++;
+                stats.rateLimited++;
+                if (limiter.slip() && ++refusedQueries % limiter.slip() == 0)
+                    replyTruncated(clientIn.data(i), clientIn.length(i), route);
+                continue;
+            }
+            handleQuery(clientIn.data(i), clientIn.length(i), route);
+        }
+    }
+
+    void handleQuery(const char *buffer, size_t length, const ClientRoute &route)
+    {
+        stats.queries++;
+        if (freeRequests.empty())
+        {
+            LOG_SAMPLED(LogLevel::Warn, "Too many queries in flight, dropping one.");
+            stats.dropped++;
+            return;
+        }
+        uint32_t slot = freeRequests.back();
+        ClientRequest &req = requests[slot];
+        // Keep our own copy of the packet, the batch buffer is reused on the next receive
+        // A free slot has nothing in its arena but maybe the copy of a big query that never got this far
+        req.packet = req.inlinePacket;
+        if (length > kMaxQuerySize)
+        {
+            req.arena.reset();
+            req.packet = static_cast<char *>(req.arena.allocate(length, 1));
+        }
+        memcpy(req.packet, buffer, length);
+        ParseStatus status = parseDNSMessageView(scratchView, req.packet, length);
+        if (status != ParseStatus::Ok)
+        {
+            LOG_SAMPLED(LogLevel::Info, "Malformed query: %s.", parseStatusText(status));
+            stats.malformed++;
+            replyFormErr(buffer, length, route);
+            return;
+        }
+        if (ntohs(scratchView.header.flags) & (1 << 15)) // if flag bit is reply, then wrong
+        {
+            LOG_SAMPLED(LogLevel::Info, "Expected a query, received reply.");
+            stats.dropped++;
+            return;
+        }
+        Edns edns;
+        if ((status = parseEdns(scratchView, edns)) != ParseStatus::Ok)
+        {
+            LOG_SAMPLED(LogLevel::Info, "Malformed query: %s.", parseStatusText(status));
+            stats.malformed++;
+            replyFormErr(buffer, length, route);
+            return;
+        }
+        if (edns.present && edns.version != 0)
+        {
+            replyBadVersion(edns, route);
+            return;
+        }
+
+        // A hot question is answered from its template, standard queries only
+        Clock::time_point now = Clock::now();
+        if (scratchView.questionCount == 1 && (ntohs(scratchView.header.flags) & 0x7800) == 0)
+        {
+            size_t replyLength = templates.render(scratchView.header, scratchView.questions[0], edns, responseBuffer(route),
+                                                  responseLimit(route, edns), now);
+            if (replyLength)
+            {
+                sendToClient(replyLength, route);
+                stats.responses++;
+                stats.templateAnswers++;
+                return;
+            }
+        }
+
+        // Questions inside our own zones never reach the cache or the upstream
+        size_t local = 0;
+        for (size_t i = 0; i < scratchView.questionCount; i++)
+        {
+            if (zones->resolve(scratchView.questions[i], zoneAnswers[i]) != ZoneResult::NotOurs)
+                local++;
+        }
+        if (local && local == scratchView.questionCount)
+        {
+            replyFromZones(edns, route, now);
+            return;
+        }
+
+        freeRequests.pop_back();
+        req.active = true;
+        req.prefetch = false;
+        req.route = route;
+        if (route.tcpFd != -1)
+            tcpClients[route.tcpFd].waiting++;
+        req.header = scratchView.header;
+        req.edns = edns;
+        req.questionCount = scratchView.questionCount;
+        std::copy(scratchView.questions, scratchView.questions + scratchView.questionCount, req.questions);
+        req.outstanding = 0;
+        req.answered = 0;
+
+        // Answer what we can locally and from the cache, only the rest goes to the upstream
+        req.results.resize(req.questionCount);
+        for (size_t i = 0; i < req.questionCount; i++)
+        {
+            DNSResult &result = req.results[i];
+            result.clear();
+            req.settled[i] = false;
+            if (zoneAnswers[i].result != ZoneResult::NotOurs)
+            {
+                zones->toDNSAnswers(zoneAnswers[i], result.answers);
+                zones->toDNSAuthority(zoneAnswers[i], result.authorities);
+                result.rcode = zoneAnswers[i].result == ZoneResult::NXDomain ? 3 : 0;
+            }
+            else
+            {
+                bool refresh;
+                if (!cache.lookup(CacheKey(req.questions[i], edns.dnssecOk), now, result, refresh))
+                {
+                    stats.cacheMisses++;
+                    continue;
+                }
+                stats.cacheHits++;
+                if (refresh)
+                    prefetch(req.header, req.questions[i], edns);
+            }
+            req.settled[i] = true;
+            req.answered++;
+        }
+        if (req.answered == req.questionCount)
+        {
+            complete(slot);
+            return;
+        }
+        forwardQuestions(slot);
+    }
+
+    // Ask the upstream for q again before its cache entry runs out, the reply only goes to the cache
+    void prefetch(const DNSHeader &header, const DNSQuestionView &q, const Edns &edns)
+    {
+        if (freeRequests.empty())
+            return;
+        uint32_t slot = freeRequests.back();
+        freeRequests.pop_back();
+        ClientRequest &req = requests[slot];
+        req.active = true;
+        req.prefetch = true;
+        req.route = ClientRoute{};
+        req.header = header;
+        req.edns = edns;
+        // The packet holds nothing but the question name, the view points at it
+        req.packet = req.inlinePacket;
+        uint16_t nameLength = q.qName.toWire(req.packet);
+        req.questionCount = 1;
+        req.questions[0] = {{req.packet, nameLength, 0, nameLength}, q.qType, q.qClass};
+        req.outstanding = 0;
+        req.answered = 0;
+        req.results.resize(1);
+        req.results[0].clear();
+        req.settled[0] = false;
+        stats.prefetches++;
+        forwardQuestions(slot);
+    }
+
+    // Every question is inside our zones, the reply is written straight from the index in scratchView order
+    void replyFromZones(const Edns &edns, const ClientRoute &route, Clock::time_point now)
+    {
+        DNSHeader header = scratchView.header;
+        // Set AA, the RCODE follows the first question
+        uint16_t rcode = zoneAnswers[0].result == ZoneResult::NXDomain ? 3 : 0;
+        header.flags = responseFlags(header.flags, (1 << 10) | rcode);
+        header.anCount = header.nsCount = header.arCount = 0;
+        DNSWriter writer = startResponse(route, edns);
+        writer.writeHeader(header);
+        for (size_t i = 0; i < scratchView.questionCount; i++)
+        {
+            writer.writeQuestion(scratchView.questions[i]);
+        }
+        // All answers first, then the SOAs of the negative ones
+        uint16_t anCount = 0, nsCount = 0;
+        for (size_t i = 0; i < scratchView.questionCount && !writer.truncated(); i++)
+        {
+            zones->writeAnswers(writer, zoneAnswers[i], anCount);
+        }
+        for (size_t i = 0; i < scratchView.questionCount && !writer.truncated(); i++)
+        {
+            zones->writeAuthority(writer, zoneAnswers[i], nsCount);
+        }
+        if (writer.truncated())
+        {
+            header.flags |= htons(1 << 9);
+            stats.truncated++;
+        }
+        header.anCount = htons(anCount);
+        header.nsCount = htons(nsCount);
+        endResponse(writer, header, edns);
+        writer.patchHeader(header);
+        if (scratchView.questionCount == 1 && !writer.truncated())
+            templates.offer(scratchView.questions[0], edns, responseBuffer(route), writer.size(), false, now);
+        sendToClient(writer.size(), route);
+        stats.responses++;
+        stats.localAnswers++;
+    }
+
+    // Where the response to a client is written, sendToClient takes it from there
+    char *responseBuffer(const ClientRoute &route)
+    {
+        return route.tcpFd == -1 ? clientOut.reserve() : tcpScratch.data();
+    }
+
+    // Largest response a client takes, a TCP message is only limited by its length prefix
+    size_t responseLimit(const ClientRoute &route, const Edns &edns) const
+    {
+        return route.tcpFd == -1 ? edns.responseLimit(ednsSize) : kMaxTcpMessage;
+    }
+
+    // Start a response in the response buffer, sized for the client and with room held back for our OPT
+    DNSWriter startResponse(const ClientRoute &route, const Edns &edns)
+    {
+        size_t limit = responseLimit(route, edns);
+        return DNSWriter(responseBuffer(route), edns.present ? limit - kOptRecordSize : limit);
+    }
+
+    // Close a response with our OPT when the query had one, DO echoed (RFC 3225)
+    void endResponse(DNSWriter &writer, DNSHeader &header, const Edns &edns)
+    {
+        if (!edns.present)
+            return;
+        writer.grow(kOptRecordSize);
+        writer.writeOpt(ednsSize, edns.dnssecOk);
+        header.arCount = htons(ntohs(header.arCount) + 1);
+    }
+
+    // The query wants an EDNS version we do not speak, answer BADVERS with the one we do (RFC 6891 6.1.3)
+    void replyBadVersion(const Edns &edns, const ClientRoute &route)
+    {
+        DNSHeader header = scratchView.header;
+        // The RCODE is all in the upper bits kept by the OPT
+        header.flags = responseFlags(header.flags, kRcodeBadVers & 0xF);
+        header.qdCount = header.anCount = header.nsCount = 0;
+        header.arCount = htons(1);
+        DNSWriter writer(responseBuffer(route), kClassicUdpSize);
+        writer.writeHeader(header);
+        writer.writeOpt(ednsSize, edns.dnssecOk, kRcodeBadVers);
+        sendToClient(writer.size(), route);
+        stats.responses++;
+    }
+
+    // Flags of a response we write ourselves, queryFlags and extra in network and host order:
+    // opcode and RD as asked, CD echoed (RFC 4035 3.1.6), QR and RA set. AD is never set, nothing
+    // here was validated by us, and AA, TC and the RCODE only come from extra
+    static uint16_t responseFlags(uint16_t queryFlags, uint16_t extra)
+    {
+        return htons((ntohs(queryFlags) & 0x7910) | (1 << 15) | (1 << 7) | extra);
+    }
+
+    // Answer a query we could not parse with FORMERR, just the header with our id and opcode
+    void replyFormErr(const char *buffer, size_t length, const ClientRoute &route)
+    {
+        DNSHeader header;
+        if (length < sizeof(DNSHeader))
+            return; // Not even a header, nothing to answer to
+        memcpy(&header, buffer, sizeof(DNSHeader));
+        if (ntohs(header.flags) & (1 << 15))
+            return; // Never answer a reply, two servers could bounce errors forever
+        // RCODE 1
+        header.flags = responseFlags(header.flags, 1);
+        header.qdCount = header.anCount = header.nsCount = header.arCount = 0;
+        memcpy(responseBuffer(route), &header, sizeof(DNSHeader));
+        sendToClient(sizeof(DNSHeader), route);
+        stats.responses++;
+    }
+
+    // Slip for a rate limited query: an empty response with TC set, so the client asks again over TCP
+    // Only the header and the first question are looked at, the query has not been parsed
+    void replyTruncated(const char *buffer, size_t length, const ClientRoute &route)
+    {
+        DNSHeader header;
+        if (length < sizeof(DNSHeader))
+            return;
+        memcpy(&header, buffer, sizeof(DNSHeader));
+        if (ntohs(header.flags) & (1 << 15))
+            return;
+        // The question is echoed if there is exactly one and its name is not compressed, as in any sane query
+        size_t end = sizeof(DNSHeader);
+        bool question = ntohs(header.qdCount) == 1;
+        while (question && end < length && buffer[end] != 0)
+        {
+            if (uint8_t(buffer[end]) > 63)
+                question = false;
+            end += uint8_t(buffer[end]) + 1;
+        }
+        end += 1 + 2 * sizeof(uint16_t);
+        if (!question || end > length)
+            end = sizeof(DNSHeader);
+        // Set TC
+        header.flags = responseFlags(header.flags, 1 << 9);
+        header.qdCount = htons(end > sizeof(DNSHeader) ? 1 : 0);
+        header.anCount = header.nsCount = header.arCount = 0;
+        char *out = responseBuffer(route);
+        memcpy(out, &header, sizeof(DNSHeader));
+        memcpy(out + sizeof(DNSHeader), buffer + sizeof(DNSHeader), end - sizeof(DNSHeader));
+        sendToClient(end, route);
+        stats.responses++;
+        stats.truncated++;
+        stats.slipped++;
+    }
+
+    // Send every question the cache could not answer upstream at once, each under a fresh id
+    // A question already in flight waits on that sub-query instead
+    void forwardQuestions(uint32_t slot)
+    {
+        ClientRequest &req = requests[slot];
+        Clock::time_point now = Clock::now();
+        for (size_t i = 0; i < req.questionCount; i++)
+        {
+            if (req.settled[i])
+                continue;
+            size_t keyHash = std::hash<std::string_view>{}(CacheKey(req.questions[i], req.edns.dnssecOk).view());
+            auto it = inFlight.find(keyHash);
+            if (it != inFlight.end() && sameQuestion(it->second, req, i))
+            {
+                pending[it->second].waiters.push_back({slot, uint16_t(i)});
+                req.outstanding++;
+                stats.coalesced++;
+                continue;
+            }
+            if (freeIds.empty())
+            {
+                LOG_SAMPLED(LogLevel::Warn, "Out of upstream ids, question %zu is left unanswered.", i);
+                break;
+            }
+            uint16_t id = freeIds.front();
+            freeIds.pop_front();
+            PendingQuery &p = pending[id];
+            p.active = true;
+            p.generation++;
+            p.requestSlot = slot;
+            p.questionIndex = i;
+            p.attempts = 0;
+            p.tcp = false;
+            // On a hash collision the question goes on its own, the table keeps the first one
+            p.listed = it == inFlight.end();
+            p.keyHash = keyHash;
+            if (p.listed)
+                inFlight.emplace(keyHash, id);
+            req.outstanding++;
+            sendSubQuery(id, upstreams.select(now), now);
+        }
+
+        if (req.outstanding == 0)
+            complete(slot);
+    }
+
+    // Whether question i of req is the one sub-query id asks, DO bit included
+    bool sameQuestion(uint16_t id, const ClientRequest &req, size_t i) const
+    {
+        const PendingQuery &p = pending[id];
+        const ClientRequest &asker = requests[p.requestSlot];
+        const DNSQuestionView &a = asker.questions[p.questionIndex], &b = req.questions[i];
+        return asker.edns.dnssecOk == req.edns.dnssecOk && a.qType == b.qType && a.qClass == b.qClass &&
+               equalNames(a.qName, b.qName);
+    }
+
+    // Queue one try of a sub-query to the given upstream and arm its timeout
+    // Queued, the sub-queries leave together when the batch is flushed
+    void sendSubQuery(uint16_t id, size_t upstream, Clock::time_point now)
+    {
+        PendingQuery &p = pending[id];
+        ClientRequest &req = requests[p.requestSlot];
+        p.upstream = upstream;
+        p.attempts++;
+        p.sentAt = now;
+        // A TCP try may need a handshake first, it gets the longest timeout
+        deadlines.push({now + (p.tcp ? kMaxUpstreamTimeout : upstreams.timeout(upstream)), id, p.generation});
+        stats.upstreamQueries++;
+
+        // Split query if mutiple questions to forward
+        DNSHeader splitHeader = req.header; // Header always the same for each seperate question
+        splitHeader.transactionId = htons(id);
+        splitHeader.flags |= htons(1 << 8);
+        // This line is depend on query, but on test case with 1.1.1.1, it requires you to activate this bit
+        splitHeader.qdCount = htons(1); // IMPORTANT!!!
+        splitHeader.anCount = 0;
+        splitHeader.nsCount = 0;
+        splitHeader.arCount = htons(1);
+        DNSWriter writer(upstreamOut.reserve(), kPacketSize);
+        writer.writeHeader(splitHeader);
+        writer.writeQuestion(req.questions[p.questionIndex]);
+        // Advertise our buffer whatever the client did, DO follows the client
+        writer.writeOpt(ednsSize, req.edns.dnssecOk);
+        if (p.tcp)
+        {
+            // Written like a datagram, then copied behind its length onto the connection
+            stats.upstreamTcpQueries++;
+            sendUpstreamTcp(upstream, upstreamOut.reserve(), writer.size(), now);
+            return;
+        }
+        const sockaddr_in &address = upstreams[upstream].address;
+        upstreamOut.commit(writer.size(), address, sizeof(address));
+    }
+
+    // Take one batch of upstream replies
+    void onUpstreamReadable()
+    {
+        size_t n = upstreamIn.receive(upstreamSocket);
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t from = upstreams.find(upstreamIn.address(i));
+            if (from == UpstreamSet::npos)
+            {
+                LOG_SAMPLED(LogLevel::Warn, "Dropping a reply that does not come from a resolver.");
+                continue;
+            }
+            if (upstreamIn.length(i) < sizeof(DNSHeader) || upstreamIn.truncated(i))
+                continue;
+            handleReply(upstreamIn.data(i), upstreamIn.length(i), from, false);
+        }
+    }
+
+    // A late reply to an earlier try is as good as one to the current try, from is the upstream it came from
+    void handleReply(const char *buffer, size_t length, size_t from, bool overTcp)
+    {
+        uint16_t id;
+        memcpy(&id, buffer, sizeof(id));
+        id = ntohs(id);
+        PendingQuery &p = pending[id];
+        if (!p.active)
+            return; // Late reply for a sub-query we already gave up on
+
+        ParseStatus status = parseDNSMessageView(scratchView, buffer, length);
+        if (status != ParseStatus::Ok)
+        {
+            LOG_SAMPLED(LogLevel::Warn, "Dropping a malformed reply from the upstream: %s.", parseStatusText(status));
+            stats.malformed++;
+            return;
+        }
+        Edns edns;
+        if ((status = parseEdns(scratchView, edns)) != ParseStatus::Ok)
+        {
+            LOG_SAMPLED(LogLevel::Warn, "Dropping a malformed reply from the upstream: %s.", parseStatusText(status));
+            stats.malformed++;
+            return;
+        }
+        uint32_t slot = p.requestSlot;
+        ClientRequest &req = requests[slot];
+        const DNSQuestionView &asked = req.questions[p.questionIndex];
+        // The id alone is only 16 bits, the echoed question has to match as well
+        if (scratchView.questionCount != 1 || !equalNames(scratchView.questions[0].qName, asked.qName) ||
+            scratchView.questions[0].qType != asked.qType || scratchView.questions[0].qClass != asked.qClass)
+        {
+            LOG_SAMPLED(LogLevel::Warn, "Dropping a reply whose question does not match the query.");
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        // Counted whatever is done with it next, a SERVFAIL that falls back on stale or a truncated one included
+        stats.upstreamReplies++;
+        // Only a reply to the current try measures the round trip, an earlier one would look too fast
+        // TCP round trips include the handshake, they would make the upstream look slow
+        if (from == p.upstream && !overTcp)
+        {
+            upstreams.onReply(from, now - p.sentAt);
+            stats.upstreamRtt.record(now - p.sentAt);
+        }
+        if ((ntohs(scratchView.header.flags) & 0xF) == 2 && cache.hasStale(CacheKey(asked, req.edns.dnssecOk), now))
+        {
+            // The upstream failed, but an expired answer is there to fall back on
+            giveUp(id, now);
+            return;
+        }
+        if (!overTcp && (ntohs(scratchView.header.flags) & (1 << 9)))
+        {
+            // Truncated, ask the same upstream over TCP so the whole answer gets cached
+            // A truncated reply to an earlier try is ignored, the TCP try is on its way
+            if (!p.tcp)
+            {
+                p.tcp = true;
+                p.generation++;
+                sendSubQuery(id, from, now);
+            }
+            return;
+        }
+        DNSResult &result = req.results[p.questionIndex];
+        toDNSResult(scratchView, result);
+        // A reply cut short, by the upstream or by the records the view keeps, is not cached
+        bool whole = !(ntohs(scratchView.header.flags) & (1 << 9)) && scratchView.droppedRecords == 0;
+        if (whole)
+            cache.insert(CacheKey(asked, req.edns.dnssecOk), result, now);
+
+        // The requests that waited on this sub-query first, the result they copy belongs to the asker
+        for (const QuestionRef &w : p.waiters)
+        {
+            requests[w.requestSlot].results[w.questionIndex] = result;
+            settle(w, buffer, length, whole, now);
+        }
+        QuestionRef asker = {slot, p.questionIndex};
+        releaseId(id);
+        settle(asker, buffer, length, whole, now);
+    }
+
+    // The upstream reply in buffer answered question q, respond once it was the last one missing
+    void settle(const QuestionRef &q, const char *buffer, size_t length, bool whole, Clock::time_point now)
+    {
+        ClientRequest &req = requests[q.requestSlot];
+        req.settled[q.questionIndex] = true;
+        req.answered++;
+        if (req.questionCount == 1 && !req.prefetch && relayReply(q.requestSlot, buffer, length, whole, now))
+            return;
+        req.outstanding--;
+        if (req.outstanding == 0)
+            complete(q.requestSlot);
+    }
+
+    // Pass the reply to a single question query on as the upstream wrote it, only the id, the
+    // RD bit, the spelling of the question and the OPT record become the client's. False if it
+    // can not be patched in place or is too big for the client, the response is then rebuilt
+    // from the result instead
+    bool relayReply(uint32_t slot, const char *buffer, size_t length, bool whole, Clock::time_point now)
+    {
+        ClientRequest &req = requests[slot];
+        // The question has to be written out in full right after the header to be respelled
+        size_t inPlace = 0;
+        walkName(buffer, length, sizeof(DNSHeader), inPlace, [](const char *, uint8_t) {});
+        if (inPlace != req.questions[0].qName.wireLen || scratchView.droppedRecords)
+            return false;
+        DNSHeader header;
+        memcpy(&header, buffer, sizeof(DNSHeader));
+        // The upstream OPT is cut off, which takes it being the last record as it usually is
+        size_t body = length;
+        for (size_t i = 0; i < scratchView.additionalCount; i++)
+        {
+            const DNSRecordView &r = scratchView.additionals()[i];
+            if (ntohs(r.type) != kTypeOPT)
+                continue;
+            if (r.rData.data() + r.rData.size() != buffer + length)
+                return false;
+            body = r.name.offset;
+            header.arCount = htons(ntohs(header.arCount) - 1);
+        }
+        size_t optSize = req.edns.present ? kOptRecordSize : 0;
+        if (body + optSize > responseLimit(req.route, req.edns))
+            return false;
+
+        char *out = responseBuffer(req.route);
+        memcpy(out, buffer, body);
+        header.transactionId = req.header.transactionId;
+        header.flags = (header.flags & htons(~(1 << 8))) | (req.header.flags & htons(1 << 8));
+        if (req.edns.present)
+        {
+            encodeOpt(out + body, ednsSize, req.edns.dnssecOk);
+            header.arCount = htons(ntohs(header.arCount) + 1);
+        }
+        memcpy(out, &header, sizeof(DNSHeader));
+        req.questions[0].qName.toWire(out + sizeof(DNSHeader));
+        if (ntohs(header.flags) & (1 << 9))
+            stats.truncated++;
+        // A clean positive answer is worth keeping ready, its TTLs count down from here
+        if (whole && (ntohs(header.flags) & 0xF) == 0 && header.anCount)
+            templates.offer(req.questions[0], req.edns, out, body + optSize, true, now);
+        sendToClient(body + optSize, req.route);
+        stats.responses++;
+        releaseRequest(slot);
+        return true;
+    }
+
+    // The sub-query failed for good, its questions are answered stale if the cache can, or left unanswered
+    void giveUp(uint16_t id, Clock::time_point now)
+    {
+        PendingQuery &p = pending[id];
+        for (const QuestionRef &w : p.waiters)
+        {
+            settleStale(w, now);
+        }
+        QuestionRef asker = {p.requestSlot, p.questionIndex};
+        releaseId(id);
+        settleStale(asker, now);
+    }
+
+    void settleStale(const QuestionRef &q, Clock::time_point now)
+    {
+        ClientRequest &req = requests[q.requestSlot];
+        size_t i = q.questionIndex;
+        if (!req.prefetch && cache.lookupStale(CacheKey(req.questions[i], req.edns.dnssecOk), now, req.results[i]))
+        {
+            req.settled[i] = true;
+            req.answered++;
+            stats.staleAnswers++;
+        }
+        if (--req.outstanding == 0)
+            complete(q.requestSlot);
+    }
+
+    // Every sub-query is answered or expired, send the combined response back to the client
+    void complete(uint32_t slot)
+    {
+        ClientRequest &req = requests[slot];
+        if (req.prefetch)
+        {
+            releaseRequest(slot);
+            return;
+        }
+        // Construct response straight into the send buffer, the question section echoes the query
+        DNSHeader header = req.header;
+        header.flags = responseFlags(req.header.flags, 0);
+        header.anCount = header.nsCount = header.arCount = 0;
+        DNSWriter writer = startResponse(req.route, req.edns);
+        writer.writeHeader(header);
+        for (size_t i = 0; i < req.questionCount; i++)
+        {
+            writer.writeQuestion(req.questions[i]);
+        }
+        // Section by section, the records of every question in question order
+        DNSVector<DNSAnswer> DNSResult::*sections[] = {&DNSResult::answers, &DNSResult::authorities, &DNSResult::additionals};
+        uint16_t counts[3] = {};
+        for (size_t s = 0; s < 3 && !writer.truncated(); s++)
+        {
+            for (size_t i = 0; i < req.questionCount && !writer.truncated(); i++)
+            {
+                for (const DNSAnswer &a : req.results[i].*sections[s])
+                {
+                    if (!writer.writeRecord(a))
+                        break;
+                    counts[s]++;
+                }
+            }
+        }
+        // The RCODE follows the first question that got a result
+        size_t first = 0;
+        while (first < req.questionCount && !req.settled[first])
+            first++;
+        if (first < req.questionCount)
+        {
+            header.flags = (header.flags & htons(0xFFF0)) | htons(req.results[first].rcode);
+        }
+        else if (req.questionCount)
+        {
+            // Nothing came back from the upstream, report SERVFAIL
+            header.flags = (header.flags & htons(0xFFF0)) | htons(2);
+            stats.servfails++;
+        }
+        if (writer.truncated())
+        {
+            // Whatever did not fit is left out, the client may retry over TCP
+            header.flags |= htons(1 << 9);
+            stats.truncated++;
+        }
+        header.anCount = htons(counts[0]);
+        header.nsCount = htons(counts[1]);
+        header.arCount = htons(counts[2]);
+        endResponse(writer, header, req.edns);
+        writer.patchHeader(header);
+        // A clean single answer is worth keeping ready, its TTLs count down from here
+        if (req.questionCount == 1 && req.answered == 1 && req.results[0].rcode == 0 && counts[0] && !writer.truncated())
+            templates.offer(req.questions[0], req.edns, responseBuffer(req.route), writer.size(), true, Clock::now());
+        sendToClient(writer.size(), req.route);
+        stats.responses++;
+        releaseRequest(slot);
+    }
+
+    // Queue the reply written into responseBuffer(route)
+    void sendToClient(size_t length, const ClientRoute &route)
+    {
+        stats.rcodes[uint8_t(responseBuffer(route)[3]) & 0xF]++;
+        stats.clientLatency.record(Clock::now() - route.receivedAt);
+        if (route.tcpFd != -1)
+        {
+            auto it = tcpClients.find(route.tcpFd);
+            if (it == tcpClients.end() || it->second.serial != route.tcpSerial)
+                return; // The connection is gone, nobody to answer to
+            TcpClient &c = it->second;
+            c.stream.queue(tcpScratch.data(), length);
+            if (!c.dirty)
+            {
+                c.dirty = true;
+                dirtyClients.push_back(route.tcpFd);
+            }
+            return;
+        }
+        if (Logger::instance().capturing())
+            Logger::instance().capture(clientOut.reserve(), length, localAddress, route.address);
+        clientOut.commit(length, route.address, route.addressLen);
+    }
+
+    void releaseId(uint16_t id)
+    {
+        PendingQuery &p = pending[id];
+        p.active = false;
+        p.waiters.clear();
+        if (p.listed)
+            inFlight.erase(p.keyHash);
+        freeIds.push_back(id);
+    }
+
+    void releaseRequest(uint32_t slot)
+    {
+        ClientRequest &req = requests[slot];
+        req.active = false;
+        // Empty the results before their memory goes, the arena is whole again for the next query
+        DNSVector<DNSResult>(&req.arena).swap(req.results);
+        req.arena.reset();
+        freeRequests.push_back(slot);
+        if (req.route.tcpFd == -1)
+            return;
+        auto it = tcpClients.find(req.route.tcpFd);
+        if (it == tcpClients.end() || it->second.serial != req.route.tcpSerial)
+            return;
+        // A connection that stopped reading at the pipeline limit goes on, at the end of the loop
+        TcpClient &c = it->second;
+        if (c.waiting-- == kMaxTcpPipeline || c.peerClosed)
+            pausedClients.push_back(req.route.tcpFd);
+    }
+
+    // Take every connection waiting on the TCP listening socket
+    void onTcpAccept()
+    {
+        while (true)
+        {
+            sockaddr_in address;
+            socklen_t addressLen = sizeof(address);
+            int fd = accept4(tcpListenSocket, reinterpret_cast<sockaddr *>(&address), &addressLen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    LOG_SAMPLED(LogLevel::Warn, "accept failed: %s", strerror(errno));
+                return;
+            }
+            if (tcpClients.size() >= kMaxTcpClients)
+            {
+                LOG_SAMPLED(LogLevel::Warn, "Too many TCP clients, closing a new connection.");
+                close(fd);
+                continue;
+            }
+            if (!watch(fd))
+            {
+                close(fd);
+                continue;
+            }
+            TcpClient &c = tcpClients[fd];
+            c.stream.fd = fd;
+            c.stream.lastActive = Clock::now();
+            c.address = address;
+            c.addressLen = addressLen;
+            c.serial = ++tcpSerial;
+            c.interest = EPOLLIN;
+            stats.tcpConnections++;
+        }
+    }
+
+    // Events on a client connection or on one of ours to an upstream
+    void onStreamEvent(int fd, uint32_t events)
+    {
+        auto it = tcpClients.find(fd);
+        if (it != tcpClients.end())
+        {
+            onClientStreamEvent(it->second, events);
+            return;
+        }
+        for (size_t i = 0; i < upstreamConnections.size(); i++)
+        {
+            if (upstreamConnections[i].stream.fd == fd)
+            {
+                onUpstreamStreamEvent(i, events);
+                return;
+            }
+        }
+    }
+
+    void onClientStreamEvent(TcpClient &c, uint32_t events)
+    {
+        if ((events & EPOLLERR) || ((events & EPOLLOUT) && !c.stream.flush()))
+        {
+            closeClient(c);
+            return;
+        }
+        if (events & (EPOLLIN | EPOLLHUP))
+        {
+            // The peer may close its side right after its last query, the responses still go out
+            if (!c.stream.receive())
+                c.peerClosed = true;
+            c.stream.lastActive = Clock::now();
+            readQueries(c);
+            return;
+        }
+        updateClient(c);
+    }
+
+    // Handle the complete queries read from a connection, up to the pipeline limit
+    void readQueries(TcpClient &c)
+    {
+        std::string_view message;
+        while (c.waiting < kMaxTcpPipeline && c.stream.queuedBytes() < kMaxTcpOutput && c.stream.next(message))
+        {
+            stats.tcpQueries++;
+            ClientRoute route = {c.address, c.addressLen, c.stream.fd, c.serial, c.stream.lastActive};
+            handleQuery(message.data(), message.size(), route);
+        }
+        updateClient(c);
+    }
+
+    // Watch for what the connection needs next, or close it once it is done
+    void updateClient(TcpClient &c)
+    {
+        if (c.peerClosed && c.waiting == 0 && !c.stream.writing() && !c.dirty)
+        {
+            closeClient(c);
+            return;
+        }
+        // Reading stops while too much output waits for the client, and goes on once it drained
+        bool full = c.stream.queuedBytes() >= kMaxTcpOutput;
+        if (full && c.fullSince == Clock::time_point())
+        {
+            c.fullSince = Clock::now();
+        }
+        else if (!full && c.fullSince != Clock::time_point())
+        {
+            c.fullSince = Clock::time_point();
+            pausedClients.push_back(c.stream.fd);
+        }
+        uint32_t interest = (!c.peerClosed && c.waiting < kMaxTcpPipeline && !full ? uint32_t(EPOLLIN) : 0u) |
+                            (c.stream.writing() ? uint32_t(EPOLLOUT) : 0u);
+        if (interest != c.interest && watch(c.stream.fd, interest, EPOLL_CTL_MOD))
+            c.interest = interest;
+    }
+
+    void closeClient(TcpClient &c)
+    {
+        int fd = c.stream.fd;
+        c.stream.close(); // Closing the fd takes it out of epoll too
+        tcpClients.erase(fd);
+    }
+
+    // Connections that went below the pipeline limit, or wait to be closed, pick up where they stopped
+    void resumeClients()
+    {
+        // Reading may answer from the cache and pause or close more connections, index as the list grows
+        for (size_t i = 0; i < pausedClients.size(); i++)
+        {
+            auto it = tcpClients.find(pausedClients[i]);
+            if (it != tcpClients.end())
+                readQueries(it->second);
+        }
+        pausedClients.clear();
+    }
+
+    // Send one message to an upstream over TCP, connecting first if there is no connection
+    // If the connection can not be made the try times out like a lost datagram
+    void sendUpstreamTcp(size_t upstream, const char *message, size_t length, Clock::time_point now)
+    {
+        UpstreamConnection &u = upstreamConnections[upstream];
+        if (u.stream.fd == -1 && !connectUpstream(upstream))
+            return;
+        u.stream.queue(message, length);
+        u.stream.lastActive = now;
+        u.dirty = true;
+    }
+
+    bool connectUpstream(size_t upstream)
+    {
+        UpstreamConnection &u = upstreamConnections[upstream];
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            LOG_SAMPLED(LogLevel::Warn, "Upstream TCP socket creation failed: %s", strerror(errno));
+            return false;
+        }
+        const sockaddr_in &address = upstreams[upstream].address;
+        if (connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1 && errno != EINPROGRESS)
+        {
+            LOG_SAMPLED(LogLevel::Warn, "Connecting to the upstream over TCP failed: %s", strerror(errno));
+            close(fd);
+            return false;
+        }
+        // Writable once connected, what was queued meanwhile goes out then
+        if (!watch(fd, EPOLLIN | EPOLLOUT))
+        {
+            close(fd);
+            return false;
+        }
+        u.stream.fd = fd;
+        u.connected = false;
+        u.interest = EPOLLIN | EPOLLOUT;
+        connectedUpstreams++;
+        return true;
+    }
+
+    void onUpstreamStreamEvent(size_t upstream, uint32_t events)
+    {
+        UpstreamConnection &u = upstreamConnections[upstream];
+        if (!u.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            int error = 0;
+            socklen_t errorLen = sizeof(error);
+            getsockopt(u.stream.fd, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+            if (error)
+            {
+                LOG_SAMPLED(LogLevel::Warn, "Connecting to the upstream over TCP failed: %s", strerror(error));
+                closeUpstream(upstream);
+                return;
+            }
+            u.connected = true;
+        }
+        if ((events & EPOLLERR) || ((events & EPOLLOUT) && !u.stream.flush()))
+        {
+            closeUpstream(upstream);
+            return;
+        }
+        if (events & (EPOLLIN | EPOLLHUP))
+        {
+            bool open = u.stream.receive();
+            std::string_view message;
+            while (u.stream.next(message))
+            {
+                if (message.size() >= sizeof(DNSHeader))
+                    handleReply(message.data(), message.size(), upstream, true);
+            }
+            if (!open)
+            {
+                // Tries still waiting on this connection time out and are retried
+                closeUpstream(upstream);
+                return;
+            }
+        }
+        updateUpstream(upstream);
+    }
+
+    void updateUpstream(size_t upstream)
+    {
+        UpstreamConnection &u = upstreamConnections[upstream];
+        uint32_t interest = EPOLLIN | (!u.connected || u.stream.writing() ? uint32_t(EPOLLOUT) : 0u);
+        if (interest != u.interest && watch(u.stream.fd, interest, EPOLL_CTL_MOD))
+            u.interest = interest;
+    }
+
+    void closeUpstream(size_t upstream)
+    {
+        UpstreamConnection &u = upstreamConnections[upstream];
+        u.stream.close();
+        u.connected = false;
+        u.dirty = false;
+        connectedUpstreams--;
+    }
+
+    // Write out what was queued on the connections while handling this round of events
+    void flushStreams()
+    {
+        for (int fd : dirtyClients)
+        {
+            auto it = tcpClients.find(fd);
+            if (it == tcpClients.end())
+                continue;
+            TcpClient &c = it->second;
+            c.dirty = false;
+            if (!c.stream.flush())
+                closeClient(c);
+            else
+                updateClient(c);
+        }
+        dirtyClients.clear();
+        for (size_t i = 0; i < upstreamConnections.size(); i++)
+        {
+            UpstreamConnection &u = upstreamConnections[i];
+            if (!u.dirty)
+                continue;
+            u.dirty = false;
+            if (u.connected && !u.stream.flush())
+                closeUpstream(i);
+            else
+                updateUpstream(i);
+        }
+    }
+
+    // Close the client connections idle for too long, and the upstream ones nothing went out on lately
+    void sweepConnections(Clock::time_point now)
+    {
+        nextSweep = now + std::chrono::seconds(1);
+        for (auto it = tcpClients.begin(); it != tcpClients.end();)
+        {
+            TcpClient &c = it->second;
+            bool idle = c.waiting == 0 && !c.stream.writing() && now - c.stream.lastActive > kTcpIdleTimeout;
+            bool notReading = c.fullSince != Clock::time_point() && now - c.fullSince > kTcpIdleTimeout;
+            if (idle || notReading)
+            {
+                c.stream.close();
+                it = tcpClients.erase(it);
+                continue;
+            }
+            ++it;
+        }
+        for (size_t i = 0; i < upstreamConnections.size(); i++)
+        {
+            UpstreamConnection &u = upstreamConnections[i];
+            if (u.stream.fd != -1 && now - u.stream.lastActive > kUpstreamTcpIdleTimeout)
+                closeUpstream(i);
+        }
+    }
+
+    // Retry sub-queries whose try timed out, and give up on the ones out of tries
+    // The response then goes out with what arrived
+    void expirePending(Clock::time_point now)
+    {
+        while (!deadlines.empty() && deadlines.top().deadline <= now)
+        {
+            PendingDeadline d = deadlines.top();
+            deadlines.pop();
+            PendingQuery &p = pending[d.id];
+            if (!p.active || p.generation != d.generation)
+                continue; // Already answered
+            stats.upstreamTimeouts++;
+            upstreams.onTimeout(p.upstream, now);
+            if (p.attempts < kUpstreamAttempts)
+            {
+                // Same id, so a late reply to the first try still counts
+                p.generation++;
+                stats.upstreamRetries++;
+                sendSubQuery(d.id, upstreams.select(now, p.upstream), now);
+                continue;
+            }
+            LOG_SAMPLED(LogLevel::Info, "Upstream did not answer in time, question %u is left unanswered.", unsigned(p.questionIndex));
+            giveUp(d.id, now);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,105 @@
+/////////////////////////////////////////////
+//////////        fuzz target       /////////
+/////////////////////////////////////////////
+// libFuzzer target for the codec in netstruct.hpp.
+// Arbitrary bytes go through the view parser, whatever parses is written back out with the
+// serializer and has to parse again. The owning parser and serializer get the same bytes.
+// Build with -DBUILD_FUZZER=ON and clang, then: ./build/netstruct-fuzz corpus/
+// With another compiler the target replays the files given on the command line instead.
+#include <iostream>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include "netstruct.hpp"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const char *src = reinterpret_cast<const char *>(data);
+
+    static DNSMessageView view, again;
+    if (parseDNSMessageView(view, src, size) == ParseStatus::Ok)
+    {
+        // Small buffer on purpose, so the truncation path gets exercised too
+        char out[512];
+        DNSWriter writer(out, sizeof(out));
+        DNSHeader header = view.header;
+        header.qdCount = header.anCount = header.nsCount = header.arCount = 0;
+        writer.writeHeader(header);
+        uint16_t qdCount = 0, counts[3] = {};
+        for (size_t i = 0; i < view.questionCount && writer.writeQuestion(view.questions[i]); i++)
+        {
+            qdCount++;
+        }
+        // Records stay in their sections, writing stops at the first one that does not fit
+        size_t sectionSizes[] = {view.answerCount, view.authorityCount, view.additionalCount};
+        size_t written = 0;
+        for (size_t s = 0, first = 0; s < 3; first += sectionSizes[s++])
+        {
+            for (size_t i = 0; i < sectionSizes[s] && !writer.truncated() && writer.writeRecord(view.records[first + i]); i++)
+            {
+                counts[s]++;
+                written++;
+            }
+            if (counts[s] != sectionSizes[s])
+                break;
+        }
+        header.qdCount = htons(qdCount);
+        header.anCount = htons(counts[0]);
+        header.nsCount = htons(counts[1]);
+        header.arCount = htons(counts[2]);
+        writer.patchHeader(header);
+
+        // What we wrote must always be readable, with the same sections and the same RDATA once
+        // names are expanded, whatever got compressed on the way
+        if (parseDNSMessageView(again, out, writer.size()) != ParseStatus::Ok || again.questionCount != qdCount ||
+            again.answerCount != counts[0] || again.authorityCount != counts[1] || again.additionalCount != counts[2])
+            abort();
+        for (size_t i = 0; i < qdCount; i++)
+        {
+            if (!equalNames(again.questions[i].qName, view.questions[i].qName))
+                abort();
+        }
+        for (size_t i = 0; i < written; i++)
+        {
+            char before[kMaxTypedRData], after[kMaxTypedRData];
+            if (!equalNames(again.records[i].name, view.records[i].name) ||
+                expandRData(again.records[i], after) != expandRData(view.records[i], before))
+                abort();
+        }
+    }
+
+    DNSMessage message;
+    if (parseDNSMessage(message, src, size) == ParseStatus::Ok)
+    {
+        char out[512];
+        size_t pos = 0;
+        serializeDNSMessage(out, sizeof(out), message, pos);
+        // Names come back exactly as they were received, case and all
+        if (parseDNSMessageView(again, out, pos) != ParseStatus::Ok)
+            abort();
+        for (size_t i = 0; i < again.questionCount && i < message.questions.size(); i++)
+        {
+            char wire[kMaxNameLength];
+            size_t wireLen = again.questions[i].qName.toWire(wire);
+            if (std::string_view(wire, wireLen) != message.questions[i].qName)
+                abort();
+        }
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+// Replay saved inputs when libFuzzer is not available
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::ifstream file(argv[i], std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    }
+    std::cout << "Replayed " << argc - 1 << " inputs." << std::endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,393 @@
+#ifndef MY_LOGGING_CLASS
+#define MY_LOGGING_CLASS
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Asynchronous, leveled logging and packet capture.
+// Callers only format their line into a slot of a lock-free ring, a background thread takes the
+// slots out and does the actual writing, so nothing on the hot path waits on a file or terminal.
+// When the ring is full the line is dropped and counted instead of blocking the caller.
+
+enum class LogLevel : uint8_t
+{
+    Debug,
+    Info,
+    Warn,
+    Error,
+    Off,
+};
+
+constexpr size_t kLogRingSize = 4096;    // Lines waiting for the background thread, power of two
+constexpr size_t kLogLineSize = 240;     // Longer lines are cut
+constexpr size_t kCaptureRingSize = 1024; // Packets waiting to be written to the capture file
+constexpr size_t kCaptureSnapLength = 1500;
+constexpr size_t kDefaultCaptureBytes = 64 << 20; // Capture file size before it is rotated
+
+// Bounded queue for many producers and a single consumer, after Dmitry Vyukov's design.
+// Every slot carries a sequence number saying whether it is free for the producer at that
+// position or filled for the consumer, so neither side ever takes a lock.
+template <typename T, size_t Size>
+class MpscRing
+{
+    static_assert((Size & (Size - 1)) == 0, "ring size must be a power of two");
+
+public:
+    MpscRing() : slots(new Slot[Size])
+    {
+        for (size_t i = 0; i < Size; i++)
+        {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Claim a slot, let fill(T &) write into it and publish it, false when the ring is full
+    template <typename Fill>
+    bool push(Fill &&fill)
+    {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Slot &slot = slots[pos & (Size - 1)];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    fill(slot.value);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Hand the oldest filled slot to use(T &), false when there is nothing to take
+    // Only one thread may ever call this
+    template <typename Use>
+    bool pop(Use &&use)
+    {
+        Slot &slot = slots[head & (Size - 1)];
+        size_t seq = slot.seq.load(std::memory_order_acquire);
+        if (intptr_t(seq) - intptr_t(head + 1) < 0)
+            return false;
+        use(slot.value);
+        slot.seq.store(head + Size, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) size_t head = 0;
+};
+
+struct LogRecord
+{
+    LogLevel level;
+    std::chrono::system_clock::time_point time;
+    uint16_t length;
+    char text[kLogLineSize];
+};
+
+struct CaptureRecord
+{
+    std::chrono::system_clock::time_point time;
+    sockaddr_in src;
+    sockaddr_in dst;
+    uint32_t length;     // Length of the packet on the wire
+    uint32_t capLength;  // Bytes kept in data
+    char data[kCaptureSnapLength];
+};
+
+class Logger
+{
+public:
+    static Logger &instance()
+    {
+        static Logger logger;
+        return logger;
+    }
+
+    void setLevel(LogLevel l) { level.store(l, std::memory_order_relaxed); }
+    bool enabled(LogLevel l) const { return l >= level.load(std::memory_order_relaxed); }
+
+    // Let one in every `every` sampled lines through, per thread
+    void setSampleRate(uint32_t every) { sampleEvery.store(every ? every : 1, std::memory_order_relaxed); }
+    bool sample()
+    {
+        thread_local uint32_t counter = 0;
+        return counter++ % sampleEvery.load(std::memory_order_relaxed) == 0;
+    }
+
+    [[gnu::format(printf, 3, 4)]] void log(LogLevel l, const char *format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        bool queued = lines.push([&](LogRecord &r)
+                                 {
+                                     r.level = l;
+                                     r.time = std::chrono::system_clock::now();
+                                     int n = vsnprintf(r.text, sizeof(r.text), format, args);
+                                     r.length = n < 0 ? 0 : std::min<size_t>(n, sizeof(r.text) - 1); });
+        va_end(args);
+        if (!queued)
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Start writing every captured packet to a pcap file at path, rotated to path.1 at maxBytes
+    bool startCapture(const std::string &path, size_t maxBytes, std::string &error_mes)
+    {
+        capturePath = path;
+        captureMaxBytes = maxBytes;
+        captures.reset(new MpscRing<CaptureRecord, kCaptureRingSize>());
+        if (!openCaptureFile(error_mes))
+            return false;
+        capturingOn.store(true, std::memory_order_release);
+        return true;
+    }
+
+    bool capturing() const { return capturingOn.load(std::memory_order_acquire); }
+
+    void capture(const char *data, size_t length, const sockaddr_in &src, const sockaddr_in &dst)
+    {
+        bool queued = captures->push([&](CaptureRecord &r)
+                                     {
+                                         r.time = std::chrono::system_clock::now();
+                                         r.src = src;
+                                         r.dst = dst;
+                                         r.length = length;
+                                         r.capLength = std::min(length, kCaptureSnapLength);
+                                         memcpy(r.data, data, r.capLength); });
+        if (!queued)
+            droppedPackets.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Run the background writer, stop() drains whatever is left and joins it
+    void start()
+    {
+        if (running.exchange(true))
+            return;
+        writer = std::thread([this]
+                             { drainLoop(); });
+    }
+
+    void stop()
+    {
+        if (!running.exchange(false))
+            return;
+        writer.join();
+    }
+
+    uint64_t droppedLines() const { return dropped.load(std::memory_order_relaxed); }
+    uint64_t droppedCaptures() const { return droppedPackets.load(std::memory_order_relaxed); }
+
+private:
+    Logger() = default;
+
+    std::atomic<LogLevel> level{LogLevel::Info};
+    std::atomic<uint32_t> sampleEvery{1};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> droppedPackets{0};
+    std::atomic<bool> running{false};
+    std::atomic<bool> capturingOn{false};
+    std::thread writer;
+    MpscRing<LogRecord, kLogRingSize> lines;
+
+    std::unique_ptr<MpscRing<CaptureRecord, kCaptureRingSize>> captures;
+    std::string capturePath;
+    size_t captureMaxBytes = kDefaultCaptureBytes;
+    size_t captureBytes = 0;
+    FILE *captureFile = nullptr;
+
+    void drainLoop()
+    {
+        while (true)
+        {
+            // Read the flag first, so everything pushed before stop() is still written
+            bool keepGoing = running.load(std::memory_order_acquire);
+            size_t work = 0;
+            while (lines.pop([](LogRecord &r)
+                             { writeLine(r); }))
+                work++;
+            if (capturingOn.load(std::memory_order_acquire))
+            {
+                while (captures->pop([this](CaptureRecord &r)
+                                     { writePacket(r); }))
+                    work++;
+            }
+            if (work == 0)
+            {
+                fflush(stdout);
+                fflush(stderr);
+                if (captureFile)
+                    fflush(captureFile);
+                if (!keepGoing)
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+        if (captureFile)
+        {
+            fclose(captureFile);
+            captureFile = nullptr;
+        }
+    }
+
+    static void writeLine(const LogRecord &r)
+    {
+        static const char *names[] = {"DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+        auto sinceEpoch = r.time.time_since_epoch();
+        time_t seconds = std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch).count();
+        int millis = std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch).count() % 1000;
+        tm t;
+        gmtime_r(&seconds, &t);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &t);
+        // Warnings and errors go to stderr, the rest to stdout
+        FILE *out = r.level >= LogLevel::Warn ? stderr : stdout;
+        fprintf(out, "%s.%03dZ %-5s %.*s\n", stamp, millis, names[size_t(r.level)], int(r.length), r.text);
+    }
+
+    // pcap file with raw IPv4 link type, every DNS packet gets a made up IPv4 and UDP header
+    // so the capture opens directly in Wireshark or tcpdump
+    bool openCaptureFile(std::string &error_mes)
+    {
+        captureFile = fopen(capturePath.c_str(), "wb");
+        if (!captureFile)
+        {
+            error_mes = "Can not open capture file \"" + capturePath + "\": " + strerror(errno);
+            return false;
+        }
+        struct
+        {
+            uint32_t magic = 0xa1b2c3d4;
+            uint16_t versionMajor = 2;
+            uint16_t versionMinor = 4;
+            int32_t thisZone = 0;
+            uint32_t sigFigs = 0;
+            uint32_t snapLen = kCaptureSnapLength + 28;
+            uint32_t linkType = 101; // LINKTYPE_RAW
+        } header;
+        fwrite(&header, sizeof(header), 1, captureFile);
+        captureBytes = sizeof(header);
+        return true;
+    }
+
+    void writePacket(const CaptureRecord &r)
+    {
+        if (!captureFile)
+            return;
+        if (captureBytes >= captureMaxBytes)
+        {
+            // Keep one older file around, start a fresh one
+            fclose(captureFile);
+            captureFile = nullptr;
+            std::string old = capturePath + ".1";
+            rename(capturePath.c_str(), old.c_str());
+            std::string error_mes;
+            if (!openCaptureFile(error_mes))
+            {
+                fprintf(stderr, "%s\n", error_mes.c_str());
+                return;
+            }
+        }
+        auto sinceEpoch = r.time.time_since_epoch();
+        uint32_t record[4] = {
+            uint32_t(std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch).count()),
+            uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(sinceEpoch).count() % 1000000),
+            r.capLength + 28,
+            r.length + 28,
+        };
+        uint8_t ip[20] = {0x45, 0, 0, 0, 0, 0, 0x40, 0, 64, 17};
+        uint16_t totalLen = htons(r.length + 28);
+        memcpy(ip + 2, &totalLen, 2);
+        memcpy(ip + 12, &r.src.sin_addr, 4);
+        memcpy(ip + 16, &r.dst.sin_addr, 4);
+        uint32_t sum = 0;
+        for (size_t i = 0; i < sizeof(ip); i += 2)
+        {
+            sum += (ip[i] << 8) | ip[i + 1];
+        }
+        while (sum >> 16)
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        uint16_t checksum = htons(~sum);
+        memcpy(ip + 10, &checksum, 2);
+        uint16_t udp[4] = {r.src.sin_port, r.dst.sin_port, htons(r.length + 8), 0};
+
+        fwrite(record, sizeof(record), 1, captureFile);
+        fwrite(ip, sizeof(ip), 1, captureFile);
+        fwrite(udp, sizeof(udp), 1, captureFile);
+        fwrite(r.data, r.capLength, 1, captureFile);
+        captureBytes += sizeof(record) + r.capLength + 28;
+    }
+};
+
+bool parseLogLevel(const std::string &src, LogLevel &dst)
+{
+    static const char *names[] = {"debug", "info", "warn", "error", "off"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (src == names[i])
+        {
+            dst = LogLevel(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Starts the background writer and makes sure everything queued is written on the way out
+struct LoggerGuard
+{
+    LoggerGuard() { Logger::instance().start(); }
+    ~LoggerGuard() { Logger::instance().stop(); }
+};
+
+#define LOG(lvl, ...)                                   \
+    do                                                  \
+    {                                                   \
+        if (Logger::instance().enabled(lvl))            \
+            Logger::instance().log(lvl, __VA_ARGS__);   \
+    } while (0)
+#define LOG_DEBUG(...) LOG(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LogLevel::Warn, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LogLevel::Error, __VA_ARGS__)
+
+// For per-packet events, only one in every --log-sample of them is written
+#define LOG_SAMPLED(lvl, ...)                                                     \
+    do                                                                            \
+    {                                                                             \
+        if (Logger::instance().enabled(lvl) && Logger::instance().sample())       \
+            Logger::instance().log(lvl, __VA_ARGS__);                             \
+    } while (0)
+
+#endif
@@ -5,186 +5,542 @@
 #include <iostream>
 #include <cstring>
 #include "netstruct.hpp"
-#include <fstream>
+#include "forwarder.hpp"
+#include "cache.hpp"
+#include "batchio.hpp"
+#include "logging.hpp"
+#include "zone.hpp"
+#include "templates.hpp"
+#include "metrics.hpp"
+#include "ratelimit.hpp"
+#include <csignal>
+#include <memory>
+#include <thread>
 #include <vector>
 
+const char *usage = "Usage: dns-server --resolver <ip>:<port>[,<ip>:<port>...] [--cache-size <bytes>] [--serve-stale <seconds>] [--templates <n>] [--edns-size <bytes>] [--workers <n>]"
+                    " [--batch <n>] [--zone <file>]... [--zone-image <file>] [--log-level debug|info|warn|error|off] [--log-sample <n>] [--capture <file>] [--capture-size <bytes>] [--metrics <port>]"
+                    " [--rate-limit <qps>] [--rate-limit-prefix <bits>] [--rate-limit-slip <n>]";
+
 // Global variable
-sockaddr_in resolver; // The ultimate higher level resolver, set differently each time run for flexibility and test case?
+std::vector<sockaddr_in> resolvers; // The ultimate higher level resolvers, the fastest healthy one gets each query
+std::vector<std::string> zoneFiles; // Zones we answer for ourselves, as master files
+std::string zoneImage;              // or as one image compiled by zone-compile
 
 bool parse_ip_address(uint32_t &dst_ip, uint16_t &dst_port, std::string src, std::string &error_mes);
-void str_cli(int sockfd);
+bool parse_number(size_t &dst, std::string src, std::string &error_mes);
+int open_listener(int type, std::string &error_mes);
+void run_worker(int listenSocket, int tcpListenSocket, int upstreamSocket, ZoneStore *zoneStore, AnswerCache *cache, RateLimiter *limiter, ForwarderStats *stats, size_t workerIndex, size_t templateCount, size_t ednsSize, size_t batchSize);
+bool load_zones(ZoneIndex &dest, std::string &error_mes);
+void reload_zones(ZoneStore *zoneStore, sigset_t signals);
+void serve_metrics(MetricsServer *server, const ForwarderStats *stats, size_t workers, const AnswerCache *cache);
 
 int main(int argc, char **argv)
 {
-    // Flush after every std::cout / std::cerr
-    std::cout << std::unitbuf;
-    std::cerr << std::unitbuf;
-
-    // Disable output buffering
-    setbuf(stdout, NULL);
-
-    std::cout << "Starting the server..." << std::endl;
-    // Initialize the upstream resolver
-    if (argc != 3)
+    // Every flag comes with a value, see usage
+    // Mistakes on the command line go straight to std::cerr, the logger is not set up yet
+    std::vector<std::string> resolverArgs;
+    size_t cacheBytes = kDefaultCacheBytes;
+    size_t staleSeconds = 0;
+    size_t templateCount = kDefaultTemplateCount;
+    size_t ednsSize = kDefaultEdnsSize;
+    size_t workers = 1;
+    size_t batchSize = kDefaultBatchSize;
+    LogLevel logLevel = LogLevel::Info;
+    size_t logSample = 1;
+    std::string capturePath;
+    size_t captureBytes = kDefaultCaptureBytes;
+    size_t metricsPort = 0;
+    size_t rateLimit = kDefaultRateLimit;
+    size_t rateLimitPrefix = kDefaultRateLimitPrefix;
+    size_t rateLimitSlip = kDefaultRateLimitSlip;
+    std::string temp; // if wrong, it will be error, if not it is string representation of the value
+    for (int i = 1; i < argc; i += 2)
     {
-        std::cerr << "Your are giving " << argc - 1 << " arguments, 2 expected!" << std::endl;
-        return 1;
+        std::string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Flag \"" << flag << "\" expects a value." << std::endl;
+            return 1;
+        }
+        if (flag == "--resolver")
+        {
+            // Several upstreams come as a comma separated list, or as the flag repeated
+            std::string list = argv[i + 1];
+            size_t start = 0;
+            while (true)
+            {
+                size_t comma = list.find(',', start);
+                resolverArgs.push_back(list.substr(start, comma - start));
+                if (comma == std::string::npos)
+                    break;
+                start = comma + 1;
+            }
+        }
+        else if (flag == "--cache-size")
+        {
+            if (!parse_number(cacheBytes, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--serve-stale")
+        {
+            if (!parse_number(staleSeconds, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--templates")
+        {
+            if (!parse_number(templateCount, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--edns-size")
+        {
+            if (!parse_number(ednsSize, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+            if (ednsSize < kClassicUdpSize || ednsSize > kPacketSize)
+            {
+                std::cerr << "The EDNS buffer size should be between " << kClassicUdpSize << " and " << kPacketSize << "." << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--workers")
+        {
+            if (!parse_number(workers, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+            if (workers == 0)
+            {
+                std::cerr << "At least one worker is needed." << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--batch")
+        {
+            if (!parse_number(batchSize, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+            if (batchSize == 0 || batchSize > kMaxBatchSize)
+            {
+                std::cerr << "The batch size should be between 1 and " << kMaxBatchSize << "." << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--zone")
+        {
+            zoneFiles.push_back(argv[i + 1]);
+        }
+        else if (flag == "--zone-image")
+        {
+            zoneImage = argv[i + 1];
+        }
+        else if (flag == "--log-level")
+        {
+            if (!parseLogLevel(argv[i + 1], logLevel))
+            {
+                std::cerr << "Unknown log level \"" << argv[i + 1] << "\"." << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--log-sample")
+        {
+            if (!parse_number(logSample, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--capture")
+        {
+            capturePath = argv[i + 1];
+        }
+        else if (flag == "--capture-size")
+        {
+            if (!parse_number(captureBytes, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--metrics")
+        {
+            if (!parse_number(metricsPort, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+            if (metricsPort == 0 || metricsPort > UINT16_MAX)
+            {
+                std::cerr << "The metrics port should be between 1 and " << UINT16_MAX << "." << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--rate-limit")
+        {
+            if (!parse_number(rateLimit, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--rate-limit-prefix")
+        {
+            if (!parse_number(rateLimitPrefix, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+            // 0 would make the whole of IPv4 one client
+            if (rateLimitPrefix == 0 || rateLimitPrefix > 32)
+            {
+                std::cerr << "The rate limit prefix should be between 1 and 32 bits." << std::endl;
+                return 1;
+            }
+        }
+        else if (flag == "--rate-limit-slip")
+        {
+            if (!parse_number(rateLimitSlip, argv[i + 1], temp))
+            {
+                std::cerr << temp << std::endl;
+                return 1;
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown flag \"" << flag << "\"." << std::endl
+                      << usage << std::endl;
+            return 1;
+        }
     }
-    if (std::string(argv[1]) != "--resolver")
+    // Initialize the upstream resolvers
+    if (resolverArgs.empty())
     {
-        std::cerr << "You are supposed to give flag \"--resolver\", you give \"" << argv[1] << "\"." << std::endl;
+        std::cerr << "You are supposed to give flag \"--resolver\"." << std::endl
+                  << usage << std::endl;
         return 1;
     }
-    uint32_t resolver_ip;
-    uint16_t resolver_port;
-    std::string temp; // if wrong, it will be error, if not it is string representation of address
-    if (!parse_ip_address(resolver_ip, resolver_port, std::string(argv[2]), temp))
+    if (resolverArgs.size() > UINT8_MAX)
     {
-        std::cerr << temp << std::endl;
+        std::cerr << "At most " << UINT8_MAX << " resolvers are supported." << std::endl;
         return 1;
     }
-    std::cout << "Your DNS Server/Forwarder is active and ready to receive packet." << std::endl;
-    std::cout << "It will forward your query to the following DNS server:" << std::endl;
-    std::cout << "IP = " << temp << std::endl;
-    std::cout << "Port = " << resolver_port << std::endl;
-    resolver = {
-        .sin_family = AF_INET,
-        .sin_port = htons(resolver_port),
-        .sin_addr = {resolver_ip},
-    };
-
-    // Create socket
-    int udpSocket;
-    udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udpSocket == -1)
+    for (const std::string &arg : resolverArgs)
     {
-        std::cerr << "Socket creation failed: " << strerror(errno) << "..." << std::endl;
-        return 1;
+        uint32_t resolver_ip;
+        uint16_t resolver_port;
+        if (!parse_ip_address(resolver_ip, resolver_port, arg, temp))
+        {
+            std::cerr << temp << std::endl;
+            return 1;
+        }
+        resolvers.push_back({
+            .sin_family = AF_INET,
+            .sin_port = htons(resolver_port),
+            .sin_addr = {resolver_ip},
+        });
     }
 
-    // Since the tester restarts your program quite often, setting REUSE_PORT
-    // ensures that we don't run into 'Address already in use' errors
-    int reuse = 1;
-    if (setsockopt(udpSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+    if (!zoneFiles.empty() && !zoneImage.empty())
     {
-        std::cerr << "SO_REUSEPORT failed: " << strerror(errno) << std::endl;
+        std::cerr << "Give the zones either as files or as an image, not both." << std::endl;
         return 1;
     }
 
-    sockaddr_in serv_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(2053),
-        .sin_addr = {htonl(INADDR_ANY)},
-    };
+    // SIGHUP is only ever taken by the reload thread, block it before any other thread exists
+    sigset_t reloadSignals;
+    sigemptyset(&reloadSignals);
+    sigaddset(&reloadSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reloadSignals, nullptr);
 
-    if (bind(udpSocket, reinterpret_cast<struct sockaddr *>(&serv_addr), sizeof(serv_addr)) != 0)
+    // From here on everything goes through the asynchronous logger
+    LoggerGuard loggerGuard;
+    Logger::instance().setLevel(logLevel);
+    Logger::instance().setSampleRate(logSample);
+    if (!capturePath.empty())
     {
-        std::cerr << "Bind failed: " << strerror(errno) << std::endl;
-        return 1;
+        if (!Logger::instance().startCapture(capturePath, captureBytes, temp))
+        {
+            LOG_ERROR("%s", temp.c_str());
+            return 1;
+        }
+    }
+    LOG_INFO("Starting the server...");
+    // Every worker reads the same zones, SIGHUP swaps in a fresh copy without stopping them
+    ZoneStore zoneStore(workers);
+    if (!zoneFiles.empty() || !zoneImage.empty())
+    {
+        auto zones = std::make_unique<ZoneIndex>();
+        if (!load_zones(*zones, temp))
+        {
+            LOG_ERROR("%s", temp.c_str());
+            return 1;
+        }
+        zoneStore.publish(std::move(zones));
+        std::thread(reload_zones, &zoneStore, reloadSignals).detach();
+    }
+    for (const sockaddr_in &r : resolvers)
+    {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &r.sin_addr, ip, sizeof(ip));
+        LOG_INFO("It will forward your query to the following DNS server: IP = %s, Port = %u", ip, unsigned(ntohs(r.sin_port)));
     }
 
-    while (true)
+    // Every worker gets its own listening socket on the same port and the kernel spreads the
+    // clients over them, the same for TCP, plus its own upstream socket
+    std::vector<int> listenSockets, tcpListenSockets, upstreamSockets;
+    for (size_t i = 0; i < workers; i++)
+    {
+        int udpSocket = open_listener(SOCK_DGRAM, temp);
+        if (udpSocket == -1)
+        {
+            LOG_ERROR("%s", temp.c_str());
+            return 1;
+        }
+        listenSockets.push_back(udpSocket);
+        int tcpSocket = open_listener(SOCK_STREAM, temp);
+        if (tcpSocket == -1)
+        {
+            LOG_ERROR("%s", temp.c_str());
+            return 1;
+        }
+        tcpListenSockets.push_back(tcpSocket);
+        // Separate socket towards the upstream, so its replies never mix with client queries
+        int upstreamSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (upstreamSocket == -1)
+        {
+            LOG_ERROR("Upstream socket creation failed: %s...", strerror(errno));
+            return 1;
+        }
+        upstreamSockets.push_back(upstreamSocket);
+    }
+    LOG_INFO("Your DNS Server/Forwarder is active and ready to receive packet on port 2053 (UDP and TCP) with %zu worker(s).", workers);
+    if (!capturePath.empty())
+    {
+        LOG_INFO("Capturing client traffic to %s.", capturePath.c_str());
+    }
+
+    // One cache for every worker, a name answered by one is a hit for all of them
+    AnswerCache cache(cacheBytes, std::chrono::seconds(staleSeconds));
+    // And one rate limiter, a client is limited the same whichever worker its queries land on
+    RateLimiter limiter(rateLimit, rateLimitPrefix, rateLimitSlip);
+    if (limiter.enabled())
+    {
+        LOG_INFO("Rate limiting UDP clients to %zu queries per second per /%zu prefix.", rateLimit, rateLimitPrefix);
+    }
+    // Every worker counts into its own stats, the metrics thread sums them up when scraped
+    std::unique_ptr<ForwarderStats[]> stats(new ForwarderStats[workers]);
+    MetricsServer metrics;
+    if (metricsPort)
+    {
+        if (!metrics.open(metricsPort, temp))
+        {
+            LOG_ERROR("%s", temp.c_str());
+            return 1;
+        }
+        std::thread(serve_metrics, &metrics, stats.get(), workers, &cache).detach();
+        LOG_INFO("Serving metrics on http://127.0.0.1:%zu/metrics.", metricsPort);
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++)
+    {
+        threads.emplace_back(run_worker, listenSockets[i], tcpListenSockets[i], upstreamSockets[i], &zoneStore, &cache, &limiter, &stats[i], i, templateCount, ednsSize, batchSize);
+    }
+    run_worker(listenSockets[0], tcpListenSockets[0], upstreamSockets[0], &zoneStore, &cache, &limiter, &stats[0], 0, templateCount, ednsSize, batchSize);
+    for (std::thread &t : threads)
     {
-        str_cli(udpSocket);
+        t.join();
     }
 
-    close(udpSocket);
+    for (size_t i = 0; i < workers; i++)
+    {
+        close(upstreamSockets[i]);
+        close(listenSockets[i]);
+        close(tcpListenSockets[i]);
+    }
 
     return 0;
 }
-void str_cli(int sockfd)
+
+// Create a non-blocking UDP or TCP (type) socket bound to port 2053, return -1 and set error_mes on failure
+// A TCP socket is listening already
+int open_listener(int type, std::string &error_mes)
 {
-    std::cout << "Waiting to receive RFC1035 format DNS query." << std::endl;
-    // Receive data
-    sockaddr_in clientAddress;
-    socklen_t clientAddrLen = sizeof(clientAddress);
-    int bytesRead;
-    char buffer[512];
-    bytesRead = recvfrom(sockfd, buffer, sizeof(buffer), 0,
-                         reinterpret_cast<struct sockaddr *>(&clientAddress), &clientAddrLen);
-    if (bytesRead == -1)
+    int listenSocket = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+    if (listenSocket == -1)
     {
-        std::cerr << "Error receiving data" << std::endl;
-        return;
+        error_mes = "Socket creation failed: " + std::string(strerror(errno)) + "...";
+        return -1;
     }
-    buffer[bytesRead] = '\0';
-    // Read the receive into a file for debugging
-    std::cout << "Received a " << bytesRead << "-byte query, stored in src/clientQuery.txt" << std::endl;
-    std::ofstream file("./src/clientQuery.txt", std::ios::out | std::ios::trunc);
-    file.write(buffer, bytesRead);
-    file.close();
 
-    // Parse the buffer into query
-    DNSMessage query;
-    size_t bufOffset = 0;
-    parseDNSMessage(query, buffer, bufOffset);
-    if (ntohs(query.header.flags) & (1 << 15)) // if flag bit is reply, then wrong
+    // Since the tester restarts your program quite often, setting REUSE_PORT
+    // ensures that we don't run into 'Address already in use' errors
+    // It also lets every worker bind its own socket to the same port
+    int reuse = 1;
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
     {
-        std::cerr << "Expected a query, received reply." << strerror(errno) << std::endl;
-        return;
+        error_mes = "SO_REUSEPORT failed: " + std::string(strerror(errno));
+        close(listenSocket);
+        return -1;
     }
-    std::cout << "Querying to upstream resolver..." << std::endl;
 
-    // Split query if mutiple questions to forward
-    DNSMessage splitForwardQuery, response;
-    int count = ntohs(query.header.qdCount);
-    splitForwardQuery.header = query.header; // Header always the same for each seperate question
+    sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(2053),
+        .sin_addr = {htonl(INADDR_ANY)},
+    };
 
-    splitForwardQuery.header.flags |= htons(1 << 8);
-    // This line is depend on query, but on test case with 1.1.1.1, it requires you to activate this bit
+    if (bind(listenSocket, reinterpret_cast<struct sockaddr *>(&serv_addr), sizeof(serv_addr)) != 0)
+    {
+        error_mes = "Bind failed: " + std::string(strerror(errno));
+        close(listenSocket);
+        return -1;
+    }
+    if (type == SOCK_STREAM && listen(listenSocket, SOMAXCONN) != 0)
+    {
+        error_mes = "Listen failed: " + std::string(strerror(errno));
+        close(listenSocket);
+        return -1;
+    }
+    return listenSocket;
+}
 
-    splitForwardQuery.header.qdCount = htons(1); // IMPORTANT!!!
+// Body of every worker thread, the forwarder and all its state belong to this thread only
+void run_worker(int listenSocket, int tcpListenSocket, int upstreamSocket, ZoneStore *zoneStore, AnswerCache *cache, RateLimiter *limiter, ForwarderStats *stats, size_t workerIndex, size_t templateCount, size_t ednsSize, size_t batchSize)
+{
+    Forwarder forwarder(listenSocket, tcpListenSocket, upstreamSocket, resolvers, *zoneStore, *cache, *limiter, *stats, workerIndex, templateCount, ednsSize, batchSize);
+    forwarder.run();
+}
 
-    // Construct response
-    response.header = query.header;
-    response.header.anCount = response.header.qdCount;
-    response.header.flags = query.header.flags | htons(1 << 15); // Set it as response
-    for (int i = 0; i < count; i++)
+// Parse the zone files or map the zone image given on the command line
+bool load_zones(ZoneIndex &dest, std::string &error_mes)
+{
+    if (!zoneImage.empty())
     {
-        // Construct query for resolver and send
-        while (splitForwardQuery.questions.size())
+        if (!dest.map(zoneImage, error_mes))
+            return false;
+        LOG_INFO("Serving zone image %s: %zu names, %zu RRsets, %zu bytes mapped.", zoneImage.c_str(),
+                 dest.nameCount(), dest.rrsetCount(), dest.bytes());
+        return true;
+    }
+    if (!dest.load(zoneFiles, error_mes))
+        return false;
+    LOG_INFO("Serving %zu zone file(s): %zu names, %zu RRsets in a %zu-byte index.", zoneFiles.size(),
+             dest.nameCount(), dest.rrsetCount(), dest.bytes());
+    return true;
+}
+
+// Answer metric scrapes forever, with the counters of every worker summed up
+void serve_metrics(MetricsServer *server, const ForwarderStats *stats, size_t workers, const AnswerCache *cache)
+{
+    server->serve([=](std::string &out)
+                  {
+        MetricsWriter writer(out);
+        // One line per counter, the name, its help and where it is in ForwarderStats
+        struct CounterInfo
+        {
+            const char *name;
+            const char *help;
+            Counter ForwarderStats::*field;
+        };
+        static const CounterInfo counters[] = {
+            {"dns_queries_total", "Queries received, over UDP and TCP.", &ForwarderStats::queries},
+            {"dns_tcp_queries_total", "Queries received over TCP.", &ForwarderStats::tcpQueries},
+            {"dns_tcp_connections_total", "Client TCP connections accepted.", &ForwarderStats::tcpConnections},
+            {"dns_responses_total", "Responses sent.", &ForwarderStats::responses},
+            {"dns_dropped_total", "Queries dropped without a response.", &ForwarderStats::dropped},
+            {"dns_malformed_total", "Malformed queries and upstream replies.", &ForwarderStats::malformed},
+            {"dns_truncated_total", "Responses sent with TC set.", &ForwarderStats::truncated},
+            {"dns_local_answers_total", "Responses written from the local zones.", &ForwarderStats::localAnswers},
+            {"dns_template_answers_total", "Responses copied from a template.", &ForwarderStats::templateAnswers},
+            {"dns_cache_hits_total", "Questions answered from the cache.", &ForwarderStats::cacheHits},
+            {"dns_cache_misses_total", "Questions the cache could not answer.", &ForwarderStats::cacheMisses},
+            {"dns_cache_prefetches_total", "Cached answers fetched again ahead of their expiry.", &ForwarderStats::prefetches},
+            {"dns_stale_answers_total", "Questions answered stale after an upstream failure.", &ForwarderStats::staleAnswers},
+            {"dns_coalesced_total", "Questions that waited on an identical one in flight.", &ForwarderStats::coalesced},
+            {"dns_rate_limited_total", "UDP queries refused for going over the rate of their client prefix.", &ForwarderStats::rateLimited},
+            {"dns_rate_limit_slips_total", "Refused queries answered truncated.", &ForwarderStats::slipped},
+            {"dns_upstream_queries_total", "Tries sent to the upstreams.", &ForwarderStats::upstreamQueries},
+            {"dns_upstream_tcp_queries_total", "Tries sent to the upstreams over TCP.", &ForwarderStats::upstreamTcpQueries},
+            {"dns_upstream_replies_total", "Upstream replies that matched a query.", &ForwarderStats::upstreamReplies},
+            {"dns_upstream_timeouts_total", "Upstream tries that timed out.", &ForwarderStats::upstreamTimeouts},
+            {"dns_upstream_retries_total", "Upstream tries sent again after a timeout.", &ForwarderStats::upstreamRetries},
+        };
+        for (const CounterInfo &c : counters)
         {
-            splitForwardQuery.questions.pop_back();
+            uint64_t total = 0;
+            for (size_t i = 0; i < workers; i++)
+            {
+                total += (stats[i].*c.field).get();
+            }
+            writer.counter(c.name, c.help, total);
         }
-        splitForwardQuery.questions.push_back(query.questions[i]);
-        response.questions.push_back(query.questions[i]);
 
-        char sendTempBuf[512];
-        size_t offsetTemp = 0;
-        serializeDNSMessage(sendTempBuf, splitForwardQuery, offsetTemp);
-        if (sendto(sockfd, sendTempBuf, offsetTemp, 0, reinterpret_cast<sockaddr *>(&resolver), sizeof(resolver)) == -1)
+        writer.header("dns_responses_by_rcode_total", "counter", "Responses sent, by RCODE.");
+        for (size_t rcode = 0; rcode < 16; rcode++)
         {
-            std::cerr << "Send data fails. Please try again!" << std::endl;
+            uint64_t total = 0;
+            for (size_t i = 0; i < workers; i++)
+            {
+                total += stats[i].rcodes[rcode].get();
+            }
+            if (total)
+            {
+                char label[32];
+                snprintf(label, sizeof(label), "rcode=\"%zu\"", rcode);
+                writer.sample("dns_responses_by_rcode_total", label, total);
+            }
         }
-        // Receive and add into real query
-        char recvTempBuf[512];
-        size_t offsetRcvTemp = 0;
-        sockaddr_in recvAddr;
-        socklen_t recvAddrLen = sizeof(sockaddr_in);
-        int bytesReceived = recvfrom(sockfd, recvTempBuf, sizeof(recvTempBuf), 0, reinterpret_cast<sockaddr *>(&recvAddr), &recvAddrLen);
-        if (bytesReceived == -1)
+
+        HistogramSnapshot client, upstream;
+        for (size_t i = 0; i < workers; i++)
         {
-            std::cerr << "Error receiving dns response! " << std::endl;
-            return;
+            client.add(stats[i].clientLatency);
+            upstream.add(stats[i].upstreamRtt);
         }
-        DNSMessage temp;
-        parseDNSMessage(temp, recvTempBuf, offsetRcvTemp);
-        response.answers.push_back(temp.answers[0]);
-    }
+        writer.histogram("dns_response_latency_seconds", "From receiving a query to sending its response.", client);
+        writer.histogram("dns_upstream_rtt_seconds", "Round trip of answered upstream tries over UDP.", upstream);
+        writer.gauge("dns_cache_slots", "Entries the shared cache can hold.", cache->capacity());
+        writer.gauge("dns_workers", "Worker threads.", workers); });
+}
 
-    char sendBuf[512];
-    size_t sendOffset = 0;
-    serializeDNSMessage(sendBuf, response, sendOffset);
-    if (sendto(sockfd, sendBuf, sendOffset, 0, reinterpret_cast<sockaddr *>(&clientAddress), clientAddrLen) == -1)
+// Wait for SIGHUP and swap in freshly loaded zones, a broken reload keeps the zones served so far
+void reload_zones(ZoneStore *zoneStore, sigset_t signals)
+{
+    while (true)
     {
-        std::cerr << "Send data fails. Please try again!" << std::endl;
+        int signal;
+        if (sigwait(&signals, &signal) != 0)
+            continue;
+        LOG_INFO("SIGHUP received, reloading the zones...");
+        auto zones = std::make_unique<ZoneIndex>();
+        std::string error_mes;
+        if (!load_zones(*zones, error_mes))
+        {
+            LOG_ERROR("Reload failed, keeping the current zones: %s", error_mes.c_str());
+            continue;
+        }
+        zoneStore->publish(std::move(zones));
     }
 }
 
 bool parse_ip_address(uint32_t &dst_ip, uint16_t &dst_port, std::string src, std::string &error_mes)
 {
     // Split into both path with the first ":"
-    int pos = src.find(":");
+    size_t pos = src.find(":");
     if (pos == std::string::npos)
     {
         error_mes = "The arguement should be in format <ip>:<port>, e.g: 0.0.0.0:80. You give " + src + ".";
@@ -215,4 +571,25 @@ bool parse_ip_address(uint32_t &dst_ip, uint16_t &dst_port, std::string src, std
     }
     error_mes = ip;
     return true;
-}
\ No newline at end of file
+}
+
+bool parse_number(size_t &dst, std::string src, std::string &error_mes)
+{
+    try
+    {
+        size_t idx = 0;
+        dst = std::stoull(src, &idx);
+
+        // Check if the entire string was consumed
+        if (idx != src.size() || src[0] == '-')
+        {
+            throw std::invalid_argument("");
+        }
+    }
+    catch (...)
+    {
+        error_mes = "Can not convert into a non-negative integer from \"" + src + "\"!";
+        return false;
+    }
+    return true;
+}
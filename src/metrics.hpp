@@ -0,0 +1,268 @@
+#ifndef MY_METRICS_CLASS
+#define MY_METRICS_CLASS
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdarg>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+
+// Counters and latency histograms every worker keeps for itself, and the HTTP endpoint that
+// shows them to Prometheus.
+// Only the owning worker writes a counter or a histogram, with plain relaxed stores, so the hot
+// path never takes a lock or a locked instruction. The metrics thread reads them whenever it is
+// scraped and sums the workers up, a value it reads may be a few events behind.
+
+// Written by one thread, readable by any
+class Counter
+{
+public:
+    void operator++(int) { add(1); }
+    void operator+=(uint64_t n) { add(n); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+};
+
+// Log-linear buckets in the HDR histogram way: every power of two of microseconds is cut into
+// 16 buckets, so a value is known within about 6% from 1 us up to hours, in 4 KiB
+class LatencyHistogram
+{
+public:
+    static constexpr size_t kSubBuckets = 16;
+    static constexpr size_t kMaxExponent = 36; // 2^36 us, about 19 hours, longer goes in the last bucket
+    static constexpr size_t kBucketCount = kSubBuckets + (kMaxExponent - 4) * kSubBuckets;
+
+    void record(std::chrono::nanoseconds elapsed)
+    {
+        uint64_t us = std::max<int64_t>(0, elapsed.count() / 1000);
+        Counter &bucket = buckets[bucketOf(us)];
+        bucket++;
+        count++;
+        sum += elapsed.count() > 0 ? elapsed.count() : 0;
+    }
+
+    uint64_t bucket(size_t i) const { return buckets[i].get(); }
+    uint64_t total() const { return count.get(); }
+    uint64_t sumNanoseconds() const { return sum.get(); }
+
+    // Bucket i holds the microsecond values from lowerBound(i) up to lowerBound(i + 1)
+    static uint64_t lowerBound(size_t i)
+    {
+        if (i < kSubBuckets)
+            return i;
+        size_t exponent = (i - kSubBuckets) / kSubBuckets + 4;
+        return (kSubBuckets + (i - kSubBuckets) % kSubBuckets) << (exponent - 4);
+    }
+
+    static size_t bucketOf(uint64_t us)
+    {
+        if (us < kSubBuckets)
+            return us;
+        size_t exponent = 63 - __builtin_clzll(us);
+        if (exponent >= kMaxExponent)
+            return kBucketCount - 1;
+        return kSubBuckets + (exponent - 4) * kSubBuckets + ((us >> (exponent - 4)) & (kSubBuckets - 1));
+    }
+
+private:
+    Counter buckets[kBucketCount];
+    Counter count;
+    Counter sum;
+};
+
+// Several workers' histograms summed at scrape time
+struct HistogramSnapshot
+{
+    uint64_t buckets[LatencyHistogram::kBucketCount] = {};
+    uint64_t count = 0;
+    uint64_t sumNanoseconds = 0;
+
+    void add(const LatencyHistogram &h)
+    {
+        for (size_t i = 0; i < LatencyHistogram::kBucketCount; i++)
+        {
+            buckets[i] += h.bucket(i);
+        }
+        count += h.total();
+        sumNanoseconds += h.sumNanoseconds();
+    }
+
+    // Upper bound in microseconds of the bucket the q quantile falls in
+    uint64_t quantile(double q) const
+    {
+        uint64_t rank = uint64_t(q * count), seen = 0;
+        for (size_t i = 0; i < LatencyHistogram::kBucketCount; i++)
+        {
+            seen += buckets[i];
+            if (seen > rank)
+                return LatencyHistogram::lowerBound(i + 1);
+        }
+        return 0;
+    }
+};
+
+// Text exposition format (version 0.0.4) written into a string
+class MetricsWriter
+{
+public:
+    explicit MetricsWriter(std::string &out) : out(out) {}
+
+    void header(const char *name, const char *type, const char *help)
+    {
+        append("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    }
+
+    void counter(const char *name, const char *help, uint64_t value)
+    {
+        header(name, "counter", help);
+        append("%s %llu\n", name, (unsigned long long)value);
+    }
+
+    void gauge(const char *name, const char *help, double value)
+    {
+        header(name, "gauge", help);
+        append("%s %.9g\n", name, value);
+    }
+
+    void sample(const char *name, const char *labels, uint64_t value)
+    {
+        append("%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    }
+
+    // A Prometheus histogram in seconds over fixed bounds, then the p50, p99 and p999 as gauges
+    // The HDR buckets are finer than the bounds, each one counts under the first bound above it
+    void histogram(const char *name, const char *help, const HistogramSnapshot &h)
+    {
+        static const double bounds[] = {0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                        0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5};
+        header(name, "histogram", help);
+        uint64_t cumulative = 0;
+        size_t next = 0;
+        for (double bound : bounds)
+        {
+            while (next < LatencyHistogram::kBucketCount && LatencyHistogram::lowerBound(next + 1) <= bound * 1e6)
+            {
+                cumulative += h.buckets[next++];
+            }
+            append("%s_bucket{le=\"%g\"} %llu\n", name, bound, (unsigned long long)cumulative);
+        }
+        append("%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h.count);
+        append("%s_sum %.9g\n", name, h.sumNanoseconds / 1e9);
+        append("%s_count %llu\n", name, (unsigned long long)h.count);
+
+        std::string quantiles = std::string(name) + "_quantile";
+        header(quantiles.c_str(), "gauge", "Quantiles of the histogram above, within its bucket precision.");
+        for (double q : {0.5, 0.99, 0.999})
+        {
+            append("%s{quantile=\"%g\"} %.9g\n", quantiles.c_str(), q, h.quantile(q) / 1e6);
+        }
+    }
+
+private:
+    std::string &out;
+
+    void append(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char line[256];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        if (n > 0)
+            out.append(line, std::min<size_t>(n, sizeof(line) - 1));
+    }
+};
+
+// Answers GET /metrics on a local TCP port, one connection at a time on its own thread
+// Scrapes are rare and small, so it blocks and keeps away from the workers' event loops
+class MetricsServer
+{
+public:
+    using Render = std::function<void(std::string &)>;
+
+    // Bind 127.0.0.1:port, false with error set on failure
+    bool open(uint16_t port, std::string &error)
+    {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            error = "Metrics socket creation failed: " + std::string(strerror(errno));
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 16) != 0)
+        {
+            error = "Metrics endpoint on port " + std::to_string(port) + " failed: " + std::string(strerror(errno));
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // Serve scrapes forever, render writes the body of every one
+    void serve(const Render &render)
+    {
+        std::string body;
+        while (true)
+        {
+            int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client == -1)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                return;
+            }
+            // A slow client must not hold the endpoint forever
+            timeval timeout = {2, 0};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            char request[1024];
+            ssize_t n = recv(client, request, sizeof(request) - 1, 0);
+            if (n > 0)
+            {
+                request[n] = '\0';
+                body.clear();
+                const char *status = "200 OK";
+                if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+                    render(body);
+                else
+                    status = "404 Not Found";
+                std::string response = "HTTP/1.1 " + std::string(status) +
+                                       "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                       std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+                for (size_t sent = 0; sent < response.size();)
+                {
+                    ssize_t w = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                    if (w <= 0)
+                        break;
+                    sent += w;
+                }
+            }
+            close(client);
+        }
+    }
+
+private:
+    int fd = -1;
+};
+
+#endif
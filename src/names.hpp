@@ -0,0 +1,382 @@
+#ifndef MY_NAMES_CLASS
+#define MY_NAMES_CLASS
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// The byte crunching done on wire-format names for every query: lowercasing them for the cache,
+// zone and template keys, comparing them case-insensitively, hashing them, and finding the dots
+// of a text name. A name is at most 255 bytes, so rather than a loop per byte every routine goes
+// over whole 16 byte (SSE2) or 32 byte (AVX2) blocks and ends with one more block overlapping the
+// previous one, names under 16 bytes are done 8 bytes at a time in plain registers.
+// SSE2 is always there on x86-64, AVX2 is checked once at runtime (or assumed with -mavx2), other
+// targets get the plain loops. Every variant can be called by name, netstruct-bench compares them.
+
+#if defined(__SSE2__)
+#define NAMES_SSE2 1
+#endif
+#if defined(NAMES_SSE2) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define NAMES_AVX2 1
+#endif
+
+/////////////////////////////////////////////
+//////////      8 bytes at once     /////////
+/////////////////////////////////////////////
+inline uint64_t loadWord(const char *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+inline void storeWord(char *p, uint64_t w) { memcpy(p, &w, sizeof(w)); }
+
+// tolower on each of the 8 bytes, bytes from 0x80 up are left alone as the C locale does
+// Every byte is tested on its low 7 bits so the sums never carry into the next byte
+inline uint64_t lowerWord(uint64_t w)
+{
+    constexpr uint64_t ones = 0x0101010101010101ull;
+    constexpr uint64_t highs = 0x8080808080808080ull;
+    uint64_t low7 = w & ~highs;
+    uint64_t atLeastA = low7 + (0x80 - 'A') * ones;
+    uint64_t pastZ = low7 + (0x80 - 'Z' - 1) * ones;
+    uint64_t upper = atLeastA & ~pastZ & ~w & highs;
+    return w | (upper >> 2);
+}
+
+inline char lowerByte(char c) { return char(uint8_t(c - 'A') < 26 ? c | 0x20 : c); }
+
+/////////////////////////////////////////////
+//////////        lowercasing       /////////
+/////////////////////////////////////////////
+// Length bytes are below 'A' (labels are at most 63), so a whole wire name can be lowercased at once
+
+void lowercaseWireScalar(char *wire, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        wire[i] = lowerByte(wire[i]);
+    }
+}
+
+// Under 16 bytes, the vector versions hand over to this
+void lowercaseWireShort(char *wire, size_t len)
+{
+    if (len < 8)
+    {
+        lowercaseWireScalar(wire, len);
+        return;
+    }
+    // Two words overlapping in the middle, lowering a byte twice changes nothing
+    uint64_t first = lowerWord(loadWord(wire));
+    uint64_t last = lowerWord(loadWord(wire + len - 8));
+    storeWord(wire, first);
+    storeWord(wire + len - 8, last);
+}
+
+#ifdef NAMES_SSE2
+inline __m128i lowerBlock(__m128i v)
+{
+    // Shifted so 'A'..'Z' are the 26 lowest signed bytes, then one compare finds them
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8(char(0x80 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(char(0x80 + 26)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+void lowercaseWireSSE2(char *wire, size_t len)
+{
+    if (len < 16)
+    {
+        lowercaseWireShort(wire, len);
+        return;
+    }
+    // The last block is read before anything is stored, reading it back after the store of the
+    // block it overlaps would wait for that store to retire
+    __m128i *last = reinterpret_cast<__m128i *>(wire + len - 16);
+    __m128i lastBlock = lowerBlock(_mm_loadu_si128(last));
+    for (size_t i = 0; i + 16 < len; i += 16)
+    {
+        __m128i *p = reinterpret_cast<__m128i *>(wire + i);
+        _mm_storeu_si128(p, lowerBlock(_mm_loadu_si128(p)));
+    }
+    _mm_storeu_si128(last, lastBlock);
+}
+#endif
+
+#ifdef NAMES_AVX2
+__attribute__((target("avx2"))) inline __m256i lowerBlock256(__m256i v)
+{
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8(char(0x80 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(char(0x80 + 26)), shifted);
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) void lowercaseWireAVX2(char *wire, size_t len)
+{
+    if (len < 32)
+    {
+        lowercaseWireSSE2(wire, len);
+        return;
+    }
+    __m256i *last = reinterpret_cast<__m256i *>(wire + len - 32);
+    __m256i lastBlock = lowerBlock256(_mm256_loadu_si256(last));
+    for (size_t i = 0; i + 32 < len; i += 32)
+    {
+        __m256i *p = reinterpret_cast<__m256i *>(wire + i);
+        _mm256_storeu_si256(p, lowerBlock256(_mm256_loadu_si256(p)));
+    }
+    _mm256_storeu_si256(last, lastBlock);
+}
+#endif
+
+// Checked once, the answer does not change while we run
+inline bool cpuHasAVX2()
+{
+#if defined(__AVX2__)
+    return true;
+#elif defined(NAMES_AVX2)
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+#else
+    return false;
+#endif
+}
+
+void lowercaseWire(char *wire, size_t len)
+{
+#ifdef NAMES_AVX2
+    if (len >= 32 && cpuHasAVX2())
+    {
+        lowercaseWireAVX2(wire, len);
+        return;
+    }
+#endif
+#ifdef NAMES_SSE2
+    lowercaseWireSSE2(wire, len);
+#else
+    if (len < 16)
+        lowercaseWireShort(wire, len);
+    else
+        lowercaseWireScalar(wire, len);
+#endif
+}
+
+// Copy len bytes lowercased, dest and src must not overlap
+// Better than copying and then lowercasing in place: the wide loads of the second pass would read
+// bytes just written by narrower stores, which the CPU can not forward and waits for instead.
+// Mostly called a label at a time, at most 63 bytes, SSE2 is as wide as that needs.
+void lowercaseCopy(char *dest, const char *src, size_t len)
+{
+#ifdef NAMES_SSE2
+    if (len >= 16)
+    {
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i), lowerBlock(v));
+        }
+        if (i < len)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + len - 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + len - 16), lowerBlock(v));
+        }
+        return;
+    }
+#endif
+    if (len >= 8)
+    {
+        for (size_t i = 0; i + 8 < len; i += 8)
+        {
+            storeWord(dest + i, lowerWord(loadWord(src + i)));
+        }
+        storeWord(dest + len - 8, lowerWord(loadWord(src + len - 8)));
+        return;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = lowerByte(src[i]);
+    }
+}
+
+/////////////////////////////////////////////
+//////////  case-insensitive compare /////////
+/////////////////////////////////////////////
+// Are the len bytes at a and b the same once lowercased (RFC 1035 2.3.3)
+
+bool equalIgnoringCaseScalar(const char *a, const char *b, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (lowerByte(a[i]) != lowerByte(b[i]))
+            return false;
+    }
+    return true;
+}
+
+bool equalIgnoringCaseShort(const char *a, const char *b, size_t len)
+{
+    if (len < 8)
+        return equalIgnoringCaseScalar(a, b, len);
+    return lowerWord(loadWord(a)) == lowerWord(loadWord(b)) &&
+           lowerWord(loadWord(a + len - 8)) == lowerWord(loadWord(b + len - 8));
+}
+
+#ifdef NAMES_SSE2
+inline bool equalBlocks(const char *a, const char *b)
+{
+    __m128i x = lowerBlock(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)));
+    __m128i y = lowerBlock(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+}
+
+bool equalIgnoringCaseSSE2(const char *a, const char *b, size_t len)
+{
+    if (len < 16)
+        return equalIgnoringCaseShort(a, b, len);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        if (!equalBlocks(a + i, b + i))
+            return false;
+    }
+    return i == len || equalBlocks(a + len - 16, b + len - 16);
+}
+#endif
+
+#ifdef NAMES_AVX2
+__attribute__((target("avx2"))) inline bool equalBlocks256(const char *a, const char *b)
+{
+    __m256i x = lowerBlock256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a)));
+    __m256i y = lowerBlock256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(b)));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) == -1;
+}
+
+__attribute__((target("avx2"))) bool equalIgnoringCaseAVX2(const char *a, const char *b, size_t len)
+{
+    if (len < 32)
+        return equalIgnoringCaseSSE2(a, b, len);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        if (!equalBlocks256(a + i, b + i))
+            return false;
+    }
+    return i == len || equalBlocks256(a + len - 32, b + len - 32);
+}
+#endif
+
+bool equalIgnoringCase(const char *a, const char *b, size_t len)
+{
+#ifdef NAMES_AVX2
+    if (len >= 32 && cpuHasAVX2())
+        return equalIgnoringCaseAVX2(a, b, len);
+#endif
+#ifdef NAMES_SSE2
+    return equalIgnoringCaseSSE2(a, b, len);
+#else
+    return len < 16 ? equalIgnoringCaseShort(a, b, len) : equalIgnoringCaseScalar(a, b, len);
+#endif
+}
+
+/////////////////////////////////////////////
+//////////          hashing         /////////
+/////////////////////////////////////////////
+// 64 x 64 -> 128 bit product, both halves folded together
+inline uint64_t foldMultiply(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 p = static_cast<unsigned __int128>(a) * b;
+    return uint64_t(p) ^ uint64_t(p >> 64);
+#else
+    uint64_t aLow = uint32_t(a), aHigh = a >> 32, bLow = uint32_t(b), bHigh = b >> 32;
+    uint64_t low = aLow * bLow, mid1 = aHigh * bLow, mid2 = aLow * bHigh, high = aHigh * bHigh;
+    uint64_t mid = (low >> 32) + uint32_t(mid1) + uint32_t(mid2);
+    return ((mid << 32) | uint32_t(low)) ^ (high + (mid1 >> 32) + (mid2 >> 32) + (mid >> 32));
+#endif
+}
+
+// Hash of a key that starts with a lowercased wire name, any bytes really
+// 16 bytes go into every multiply, a vector unit has nothing as wide, and the result is the same
+// on every build with this byte order, compiled zone images store it.
+uint32_t hashWireName(const char *wire, size_t len)
+{
+    constexpr uint64_t k0 = 0xa0761d6478bd642full, k1 = 0xe7037ed1a0b428dbull, k2 = 0x8ebc6af09c88c6e3ull;
+    uint64_t h = k0 ^ len;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        h = foldMultiply(loadWord(wire + i) ^ k1, loadWord(wire + i + 8) ^ h);
+    }
+    // The rest, read as two overlapping pieces when there are enough bytes
+    size_t rest = len - i;
+    uint64_t a = 0, b = 0;
+    if (rest >= 8)
+    {
+        a = loadWord(wire + i);
+        b = loadWord(wire + len - 8);
+    }
+    else if (rest >= 4)
+    {
+        uint32_t x, y;
+        memcpy(&x, wire + i, sizeof(x));
+        memcpy(&y, wire + len - 4, sizeof(y));
+        a = x;
+        b = y;
+    }
+    else if (rest > 0)
+    {
+        a = (uint64_t(uint8_t(wire[i])) << 16) | (uint64_t(uint8_t(wire[i + rest / 2])) << 8) | uint8_t(wire[len - 1]);
+    }
+    h = foldMultiply(a ^ k1, b ^ h);
+    h = foldMultiply(h ^ k2, len ^ k1);
+    return uint32_t(h ^ (h >> 32));
+}
+
+/////////////////////////////////////////////
+//////////      finding a byte      /////////
+/////////////////////////////////////////////
+// Call fn(i) for every i where text[i] == c, in order, until fn returns false
+// Return false if fn stopped it
+template <typename Fn>
+bool forEachByte(const char *text, size_t len, char c, Fn &&fn)
+{
+    size_t i = 0;
+#ifdef NAMES_SSE2
+    __m128i needle = _mm_set1_epi8(c);
+    for (; i + 16 <= len; i += 16)
+    {
+        unsigned found = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i)), needle));
+        for (; found; found &= found - 1)
+        {
+            if (!fn(i + __builtin_ctz(found)))
+                return false;
+        }
+    }
+    if (i < len && len >= 16)
+    {
+        // The last block again, minus the bytes already looked at
+        size_t from = len - 16;
+        unsigned found = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(text + from)), needle));
+        found &= ~0u << (i - from);
+        for (; found; found &= found - 1)
+        {
+            if (!fn(from + __builtin_ctz(found)))
+                return false;
+        }
+        return true;
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if (text[i] == c && !fn(i))
+            return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,522 @@
+/////////////////////////////////////////////
+//////////     codec benchmark      /////////
+/////////////////////////////////////////////
+// Google Benchmark microbenchmarks for the codec in netstruct.hpp, over a handful of packets
+// shaped like real traffic. Every benchmark reports ns/op and allocs/op, the heap allocations
+// counted by the operator new below.
+// --save-baseline=<file> writes the results out, --baseline=<file> compares against such a file
+// and exits with 1 when something got slower by more than --max-regression=<percent> (default 10)
+// or allocates more than before. Build with -DCMAKE_BUILD_TYPE=Release for numbers that mean anything.
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "netstruct.hpp"
+
+/////////////////////////////////////////////
+//////////    allocation counting   /////////
+/////////////////////////////////////////////
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Count the allocations made while the benchmark loop runs, as a per iteration average
+// Rounded to hundredths, the framework allocates a couple of times around the loop itself
+class AllocationCounter
+{
+public:
+    explicit AllocationCounter(benchmark::State &state) : state(state), start(allocations.load(std::memory_order_relaxed)) {}
+    ~AllocationCounter()
+    {
+        double perOp = double(allocations.load(std::memory_order_relaxed) - start) / std::max<uint64_t>(1, state.iterations());
+        state.counters["allocs/op"] = std::round(perOp * 100) / 100;
+    }
+
+private:
+    benchmark::State &state;
+    uint64_t start;
+};
+
+/////////////////////////////////////////////
+//////////         packets          /////////
+/////////////////////////////////////////////
+std::string wire(const std::string &dotted)
+{
+    char temp[kMaxNameLength];
+    return std::string(temp, dottedToWire(dotted, temp));
+}
+
+DNSAnswer record(const std::string &name, uint16_t type, std::string rData, uint32_t ttl = 300)
+{
+    DNSAnswer a;
+    a.name = wire(name);
+    a.type = htons(type);
+    a._class = htons(kClassIN);
+    a.ttl = htonl(ttl);
+    a.rdLength = htons(rData.size());
+    a.rData = std::move(rData);
+    return a;
+}
+
+std::string ipv4(uint32_t address)
+{
+    address = htonl(address);
+    return std::string(reinterpret_cast<const char *>(&address), 4);
+}
+
+DNSMessage message(uint16_t flags, std::initializer_list<std::pair<const char *, uint16_t>> questions)
+{
+    DNSMessage m;
+    m.header = {};
+    m.header.transactionId = htons(0x1234);
+    m.header.flags = htons(flags);
+    for (const auto &[name, type] : questions)
+    {
+        DNSQuestion q;
+        q.qName = wire(name);
+        q.qType = htons(type);
+        q.qClass = htons(kClassIN);
+        m.questions.push_back(q);
+    }
+    return m;
+}
+
+void addOpt(DNSMessage &m)
+{
+    DNSAnswer opt = record("", kTypeOPT, "", 0);
+    opt._class = htons(kDefaultEdnsSize);
+    m.additionals.push_back(opt);
+}
+
+std::string serialize(DNSMessage m)
+{
+    char buffer[4096];
+    size_t pos = 0;
+    serializeDNSMessage(buffer, sizeof(buffer), m, pos);
+    return std::string(buffer, pos);
+}
+
+struct Packet
+{
+    const char *name;
+    std::string bytes;
+};
+
+// What a forwarder sees: small queries, and responses from plain to long and heavily compressed
+std::vector<Packet> make_packets()
+{
+    std::vector<Packet> packets;
+
+    DNSMessage shortQuery = message(0x0100, {{"a.io", kTypeA}});
+    addOpt(shortQuery);
+    packets.push_back({"query_short", serialize(shortQuery)});
+
+    DNSMessage longQuery = message(0x0100, {{"a-rather-long-first-label-for-a-host.eu-west-3.compute.internal-services.example-corporation.com", kTypeAAAA}});
+    addOpt(longQuery);
+    packets.push_back({"query_long", serialize(longQuery)});
+
+    DNSMessage multiQuery = message(0x0100, {{"codecrafters.io", kTypeA}, {"www.codecrafters.io", kTypeAAAA}, {"mail.codecrafters.io", kTypeMX}});
+    packets.push_back({"query_multi", serialize(multiQuery)});
+
+    // A CNAME chain through a CDN, NS in authority and their glue, every name compressed
+    DNSMessage chain = message(0x8180, {{"www.example.com", kTypeA}});
+    chain.answers.push_back(record("www.example.com", kTypeCNAME, wire("www.example.com.cdn.example.net")));
+    chain.answers.push_back(record("www.example.com.cdn.example.net", kTypeCNAME, wire("e1234.a.cdn.example.net"), 60));
+    chain.answers.push_back(record("e1234.a.cdn.example.net", kTypeA, ipv4(0xC0000201), 20));
+    chain.answers.push_back(record("e1234.a.cdn.example.net", kTypeA, ipv4(0xC0000202), 20));
+    chain.authorities.push_back(record("a.cdn.example.net", kTypeNS, wire("ns1.example.net"), 3600));
+    chain.authorities.push_back(record("a.cdn.example.net", kTypeNS, wire("ns2.example.net"), 3600));
+    chain.additionals.push_back(record("ns1.example.net", kTypeA, ipv4(0xC6336401), 3600));
+    chain.additionals.push_back(record("ns2.example.net", kTypeA, ipv4(0xC6336402), 3600));
+    addOpt(chain);
+    packets.push_back({"response_compressed", serialize(chain)});
+
+    DNSMessage many = message(0x8180, {{"pool.example.com", kTypeA}});
+    for (uint32_t i = 0; i < 25; i++)
+    {
+        many.answers.push_back(record("pool.example.com", kTypeA, ipv4(0x0A000001 + i)));
+    }
+    addOpt(many);
+    packets.push_back({"response_many", serialize(many)});
+    return packets;
+}
+
+/////////////////////////////////////////////
+//////////        benchmarks        /////////
+/////////////////////////////////////////////
+// The zero-copy parser the forwarder runs on every packet
+void BM_parseDNSMessageView(benchmark::State &state, const std::string &packet)
+{
+    DNSMessageView view;
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parseDNSMessageView(view, packet.data(), packet.size()));
+        benchmark::DoNotOptimize(view);
+    }
+    state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+// The copying parser, into std::string and std::vector
+void BM_parseDNSMessage(benchmark::State &state, const std::string &packet)
+{
+    DNSMessage message;
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parseDNSMessage(message, packet.data(), packet.size()));
+        benchmark::DoNotOptimize(message);
+    }
+    state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+// Writing the parsed message back out, name compression included
+void BM_serializeDNSMessage(benchmark::State &state, const std::string &packet)
+{
+    DNSMessage message;
+    parseDNSMessage(message, packet.data(), packet.size());
+    char buffer[4096];
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        size_t pos = 0;
+        benchmark::DoNotOptimize(serializeDNSMessage(buffer, sizeof(buffer), message, pos));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+// The first name after the header, and the last one, which in responses is behind a pointer
+void BM_parseNameView(benchmark::State &state, const std::string &packet, bool last)
+{
+    DNSMessageView view;
+    parseDNSMessageView(view, packet.data(), packet.size());
+    size_t at = last && view.answerCount ? view.records[view.answerCount + view.authorityCount - 1].name.offset : 12;
+    DNSNameView name;
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        size_t pos = at;
+        benchmark::DoNotOptimize(parseNameView(name, packet.data(), packet.size(), pos));
+        benchmark::DoNotOptimize(name);
+    }
+}
+
+void BM_dottedToWire(benchmark::State &state, std::string dotted)
+{
+    char wire[kMaxNameLength];
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(dottedToWire(dotted, wire));
+        benchmark::ClobberMemory();
+    }
+}
+
+// Names that share suffixes written one after the other, so every one searches the compression table
+void BM_writeName(benchmark::State &state)
+{
+    static const std::string names[] = {wire("www.example.com"), wire("example.com"), wire("mail.example.com"),
+                                        wire("e1234.a.cdn.example.net"), wire("ns1.example.net"), wire("ns2.example.net"),
+                                        wire("a.cdn.example.net"), wire("www.example.com")};
+    char buffer[4096];
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        DNSWriter writer(buffer, sizeof(buffer));
+        for (const std::string &name : names)
+        {
+            writer.writeName(name);
+        }
+        benchmark::DoNotOptimize(writer.size());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * std::size(names));
+}
+
+// The name toolkit one version at a time, on a wire name as the cache keys hold it
+std::string wire_name(const char *dotted)
+{
+    char wire[kMaxNameLength];
+    return std::string(wire, dottedToWire(dotted, wire));
+}
+
+void BM_lowercaseWire(benchmark::State &state, void (*lower)(char *, size_t), std::string wire)
+{
+    // In place, going round a few copies so a name is not read back right after being stored,
+    // lowering it again costs the same as the first time
+    std::vector<std::string> copies(64, wire);
+    size_t next = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        std::string &w = copies[next++ % copies.size()];
+        lower(w.data(), w.size());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * wire.size());
+}
+
+void BM_equalIgnoringCase(benchmark::State &state, bool (*equal)(const char *, const char *, size_t), std::string wire)
+{
+    std::string other = wire;
+    for (char &c : other)
+    {
+        c = toupper(uint8_t(c));
+    }
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(equal(wire.data(), other.data(), wire.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * wire.size());
+}
+
+void BM_hashWireName(benchmark::State &state, std::string wire)
+{
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(hashWireName(wire.data(), wire.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * wire.size());
+}
+
+// What every cache, zone and template lookup starts with: the question name lowercased and hashed
+void BM_nameKey(benchmark::State &state, const std::string &packet)
+{
+    DNSMessageView view;
+    parseDNSMessageView(view, packet.data(), packet.size());
+    char wire[kMaxNameLength];
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        size_t length = view.questions[0].qName.toLowerWire(wire);
+        benchmark::DoNotOptimize(hashWireName(wire, length));
+    }
+}
+
+// The question of an upstream reply checked against the one asked, spelled differently
+void BM_equalNames(benchmark::State &state, const std::string &packet)
+{
+    std::string upper = packet;
+    for (size_t i = sizeof(DNSHeader); i < upper.size(); i++)
+    {
+        upper[i] = toupper(uint8_t(upper[i]));
+    }
+    DNSMessageView a, b;
+    parseDNSMessageView(a, packet.data(), packet.size());
+    parseDNSMessageView(b, upper.data(), upper.size());
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(equalNames(a.questions[0].qName, b.questions[0].qName));
+    }
+}
+
+/////////////////////////////////////////////
+//////////         baseline         /////////
+/////////////////////////////////////////////
+struct Result
+{
+    double nsPerOp = 0;
+    double allocsPerOp = 0;
+};
+
+// Prints as usual and keeps every result for the baseline, the median one when repeated
+class BaselineReporter : public benchmark::ConsoleReporter
+{
+public:
+    std::map<std::string, Result> results;
+
+    void ReportRuns(const std::vector<Run> &runs) override
+    {
+        for (const Run &run : runs)
+        {
+            if (run.error_occurred || (run.run_type == Run::RT_Aggregate && run.aggregate_name != "median"))
+                continue;
+            std::string name = run.run_type == Run::RT_Aggregate ? run.run_name.str() : run.benchmark_name();
+            auto allocs = run.counters.find("allocs/op");
+            results[name] = {run.GetAdjustedCPUTime() * 1e9 / benchmark::GetTimeUnitMultiplier(run.time_unit),
+                             allocs == run.counters.end() ? 0 : double(allocs->second)};
+        }
+        ConsoleReporter::ReportRuns(runs);
+    }
+};
+
+bool save_baseline(const std::map<std::string, Result> &results, const std::string &path)
+{
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    file << "# benchmark ns/op allocs/op\n";
+    for (const auto &[name, r] : results)
+    {
+        file << name << ' ' << r.nsPerOp << ' ' << r.allocsPerOp << '\n';
+    }
+    return bool(file);
+}
+
+bool load_baseline(std::map<std::string, Result> &results, const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        std::string name;
+        Result r;
+        if (fields >> name >> r.nsPerOp >> r.allocsPerOp)
+            results[name] = r;
+    }
+    return true;
+}
+
+// Print the change of every benchmark found in both, false if any regressed
+bool compare(const std::map<std::string, Result> &baseline, const std::map<std::string, Result> &now, double maxRegression)
+{
+    bool ok = true;
+    printf("\n%-56s %12s %12s %8s %14s\n", "Benchmark", "base ns/op", "now ns/op", "change", "allocs/op");
+    for (const auto &[name, r] : now)
+    {
+        auto base = baseline.find(name);
+        if (base == baseline.end())
+        {
+            printf("%-56s %12s %12.1f %8s %14.2f  (new)\n", name.c_str(), "-", r.nsPerOp, "-", r.allocsPerOp);
+            continue;
+        }
+        const Result &b = base->second;
+        double change = b.nsPerOp > 0 ? 100 * (r.nsPerOp - b.nsPerOp) / b.nsPerOp : 0;
+        bool slower = change > maxRegression;
+        bool allocates = r.allocsPerOp > b.allocsPerOp + 0.01;
+        char allocs[32];
+        snprintf(allocs, sizeof(allocs), "%.2f -> %.2f", b.allocsPerOp, r.allocsPerOp);
+        printf("%-56s %12.1f %12.1f %+7.1f%% %14s%s\n", name.c_str(), b.nsPerOp, r.nsPerOp, change, allocs,
+               slower || allocates ? "  REGRESSION" : "");
+        ok = ok && !slower && !allocates;
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    // Our own flags are taken out before Google Benchmark sees the rest
+    std::string savePath, baselinePath;
+    double maxRegression = 10;
+    int kept = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--save-baseline=", 0) == 0)
+            savePath = arg.substr(16);
+        else if (arg.rfind("--baseline=", 0) == 0)
+            baselinePath = arg.substr(11);
+        else if (arg.rfind("--max-regression=", 0) == 0)
+            maxRegression = std::stod(arg.substr(17));
+        else
+            argv[kept++] = argv[i];
+    }
+    argc = kept;
+
+#ifndef __OPTIMIZE__
+    std::cerr << "netstruct-bench was built without optimization, configure with -DCMAKE_BUILD_TYPE=Release." << std::endl;
+#endif
+
+    static std::vector<Packet> packets = make_packets();
+    for (const Packet &p : packets)
+    {
+        benchmark::RegisterBenchmark((std::string("parseDNSMessageView/") + p.name).c_str(), BM_parseDNSMessageView, p.bytes);
+        benchmark::RegisterBenchmark((std::string("parseDNSMessage/") + p.name).c_str(), BM_parseDNSMessage, p.bytes);
+        benchmark::RegisterBenchmark((std::string("serializeDNSMessage/") + p.name).c_str(), BM_serializeDNSMessage, p.bytes);
+    }
+    benchmark::RegisterBenchmark("parseNameView/short", BM_parseNameView, packets[0].bytes, false);
+    benchmark::RegisterBenchmark("parseNameView/long", BM_parseNameView, packets[1].bytes, false);
+    benchmark::RegisterBenchmark("parseNameView/compressed", BM_parseNameView, packets[3].bytes, true);
+    benchmark::RegisterBenchmark("dottedToWire/short", BM_dottedToWire, std::string("a.io"));
+    benchmark::RegisterBenchmark("dottedToWire/long", BM_dottedToWire, std::string("a-rather-long-first-label-for-a-host.eu-west-3.compute.internal-services.example-corporation.com"));
+    benchmark::RegisterBenchmark("writeName/compressed", BM_writeName);
+
+    const char *shortName = "www.example.com";
+    const char *longName = "a-rather-long-first-label-for-a-host.eu-west-3.compute.internal-services.example-corporation.com";
+    struct
+    {
+        const char *name;
+        void (*lower)(char *, size_t);
+        bool (*equal)(const char *, const char *, size_t);
+    } variants[] = {
+        {"scalar", lowercaseWireScalar, equalIgnoringCaseScalar},
+#ifdef NAMES_SSE2
+        {"sse2", lowercaseWireSSE2, equalIgnoringCaseSSE2},
+#endif
+#ifdef NAMES_AVX2
+        {"avx2", lowercaseWireAVX2, equalIgnoringCaseAVX2},
+#endif
+        {"dispatch", lowercaseWire, equalIgnoringCase},
+    };
+    for (const auto &v : variants)
+    {
+#ifdef NAMES_AVX2
+        if (v.lower == lowercaseWireAVX2 && !cpuHasAVX2())
+            continue;
+#endif
+        for (const char *dotted : {shortName, longName})
+        {
+            std::string size = dotted == shortName ? "short/" : "long/";
+            benchmark::RegisterBenchmark(("lowercaseWire/" + size + v.name).c_str(), BM_lowercaseWire, v.lower, wire_name(dotted));
+            benchmark::RegisterBenchmark(("equalIgnoringCase/" + size + v.name).c_str(), BM_equalIgnoringCase, v.equal, wire_name(dotted));
+        }
+    }
+    benchmark::RegisterBenchmark("hashWireName/short", BM_hashWireName, wire_name(shortName));
+    benchmark::RegisterBenchmark("hashWireName/long", BM_hashWireName, wire_name(longName));
+    benchmark::RegisterBenchmark("nameKey/short", BM_nameKey, packets[0].bytes);
+    benchmark::RegisterBenchmark("nameKey/long", BM_nameKey, packets[1].bytes);
+    benchmark::RegisterBenchmark("equalNames/short", BM_equalNames, packets[0].bytes);
+    benchmark::RegisterBenchmark("equalNames/long", BM_equalNames, packets[1].bytes);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    BaselineReporter reporter;
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    benchmark::Shutdown();
+
+    if (!savePath.empty())
+    {
+        if (!save_baseline(reporter.results, savePath))
+        {
+            std::cerr << "Can not write baseline \"" << savePath << "\"." << std::endl;
+            return 1;
+        }
+        std::cout << "Baseline saved to " << savePath << "." << std::endl;
+    }
+    if (!baselinePath.empty())
+    {
+        std::map<std::string, Result> baseline;
+        if (!load_baseline(baseline, baselinePath))
+        {
+            std::cerr << "Can not read baseline \"" << baselinePath << "\"." << std::endl;
+            return 1;
+        }
+        if (!compare(baseline, reporter.results, maxRegression))
+            return 1;
+    }
+    return 0;
+}
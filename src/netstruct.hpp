@@ -4,10 +4,16 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <algorithm>
 #include <string>
 #include <cstring>
+#include <strings.h>
+#include <cctype>
 #include <arpa/inet.h>
 #include <vector>
+#include <memory_resource>
+#include <string_view>
+#include "names.hpp"
 
 // Default should be network order byte, so need to change to host byte order for executing
 struct DNSHeader
@@ -18,242 +24,983 @@ struct DNSHeader
     uint16_t anCount;
     uint16_t nsCount;
     uint16_t arCount;
-    DNSHeader &operator=(const DNSHeader &rhs)
-    {
-        if (this != &rhs)
-        {
-            this->transactionId = rhs.transactionId;
-            this->flags = rhs.flags;
-            this->qdCount = rhs.qdCount;
-            this->anCount = rhs.anCount;
-            this->nsCount = rhs.nsCount;
-            this->arCount = rhs.arCount;
-        }
-        return *this;
-    }
 };
 
+// Questions, records and messages are allocator-aware: the forwarder builds the results of a
+// query in the arena of its request (see arena.hpp), everywhere else they live on the heap as before
+using DNSString = std::pmr::string;
+template <typename T>
+using DNSVector = std::pmr::vector<T>;
+
 struct DNSQuestion
 {
-    std::string qName; // codecrafters.io or google.com, parse later
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    DNSString qName; // Uncompressed wire format as received, \x0ccodecrafters\x02io\x00
     uint16_t qType;
     uint16_t qClass;
-    DNSQuestion &operator=(const DNSQuestion &rhs)
-    {
-        if (this != &rhs)
-        {
-            this->qName = rhs.qName;
-            this->qType = rhs.qType;
-            this->qClass = rhs.qClass;
-        }
-        return *this;
-    }
+
+    DNSQuestion() = default;
+    explicit DNSQuestion(const allocator_type &alloc) : qName(alloc) {}
+    DNSQuestion(const DNSQuestion &rhs, const allocator_type &alloc = {})
+        : qName(rhs.qName, alloc), qType(rhs.qType), qClass(rhs.qClass) {}
+    DNSQuestion(DNSQuestion &&rhs, const allocator_type &alloc)
+        : qName(std::move(rhs.qName), alloc), qType(rhs.qType), qClass(rhs.qClass) {}
+    DNSQuestion(DNSQuestion &&) = default;
+    DNSQuestion &operator=(const DNSQuestion &) = default;
+    DNSQuestion &operator=(DNSQuestion &&) = default;
 };
 struct DNSAnswer
 {
-    std::string name; // codecrafters.io or google.com, parse later
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    DNSString name; // Uncompressed wire format as received, like DNSQuestion::qName
     uint16_t type;
     uint16_t _class;
     uint32_t ttl;
     uint16_t rdLength;
-    std::string rData;
-    DNSAnswer &operator=(const DNSAnswer &rhs)
+    DNSString rData;
+
+    DNSAnswer() = default;
+    explicit DNSAnswer(const allocator_type &alloc) : name(alloc), rData(alloc) {}
+    DNSAnswer(const DNSAnswer &rhs, const allocator_type &alloc = {})
+        : name(rhs.name, alloc), type(rhs.type), _class(rhs._class), ttl(rhs.ttl), rdLength(rhs.rdLength), rData(rhs.rData, alloc) {}
+    DNSAnswer(DNSAnswer &&rhs, const allocator_type &alloc)
+        : name(std::move(rhs.name), alloc), type(rhs.type), _class(rhs._class), ttl(rhs.ttl), rdLength(rhs.rdLength),
+          rData(std::move(rhs.rData), alloc) {}
+    DNSAnswer(DNSAnswer &&) = default;
+    // Assignment keeps the allocator of the record assigned to
+    DNSAnswer &operator=(const DNSAnswer &) = default;
+    DNSAnswer &operator=(DNSAnswer &&) = default;
+};
+constexpr size_t kMaxNameLength = 255; // Wire format, length bytes and root included
+
+// Record types and classes we know by name, host byte order
+constexpr uint16_t kTypeA = 1;
+constexpr uint16_t kTypeNS = 2;
+constexpr uint16_t kTypeCNAME = 5;
+constexpr uint16_t kTypeSOA = 6;
+constexpr uint16_t kTypePTR = 12;
+constexpr uint16_t kTypeMX = 15;
+constexpr uint16_t kTypeTXT = 16;
+constexpr uint16_t kTypeAAAA = 28;
+constexpr uint16_t kTypeSRV = 33;
+constexpr uint16_t kTypeOPT = 41;
+constexpr uint16_t kTypeANY = 255;
+constexpr uint16_t kClassIN = 1;
+
+struct RRTypeName
+{
+    uint16_t type;
+    const char *name;
+};
+constexpr RRTypeName kTypeNames[] = {
+    {kTypeA, "A"}, {kTypeNS, "NS"}, {kTypeCNAME, "CNAME"}, {kTypeSOA, "SOA"}, {kTypePTR, "PTR"}, {kTypeMX, "MX"},
+    {kTypeTXT, "TXT"}, {kTypeAAAA, "AAAA"}, {kTypeSRV, "SRV"}, {kTypeOPT, "OPT"}, {kTypeANY, "ANY"},
+};
+
+// Mnemonic of a type, nullptr for the ones without a name here
+const char *typeName(uint16_t type)
+{
+    for (const RRTypeName &t : kTypeNames)
     {
-        if (this != &rhs)
+        if (t.type == type)
+            return t.name;
+    }
+    return nullptr;
+}
+
+// Type from its mnemonic, case-insensitive, or from the TYPEnnn form (RFC 3597)
+bool parseTypeName(std::string_view text, uint16_t &type)
+{
+    for (const RRTypeName &t : kTypeNames)
+    {
+        if (text.size() == strlen(t.name) && strncasecmp(text.data(), t.name, text.size()) == 0)
         {
-            this->name = rhs.name;
-            this->_class = rhs._class;
-            this->ttl = rhs.ttl;
-            this->rdLength = rhs.rdLength;
-            this->rData = rhs.rData;
+            type = t.type;
+            return true;
         }
-        return *this;
     }
+    if (text.size() < 5 || text.size() > 9 || strncasecmp(text.data(), "TYPE", 4) != 0)
+        return false;
+    uint32_t value = 0;
+    for (size_t i = 4; i < text.size(); i++)
+    {
+        if (!isdigit(uint8_t(text[i])))
+            return false;
+        value = value * 10 + (text[i] - '0');
+    }
+    if (value > UINT16_MAX)
+        return false;
+    type = value;
+    return true;
+}
+
+// RDATA of these types holds domain names (RFC 1035 3.3, RFC 2782): fixed bytes, the names,
+// then fixed bytes again. Only the RFC 1035 types may have their names compressed (RFC 3597 4).
+struct RDataLayout
+{
+    uint16_t type;
+    uint8_t prefix; // Fixed bytes before the first name
+    uint8_t names;
+    uint8_t suffix; // Fixed bytes after the last name
+    bool compress;
+};
+constexpr RDataLayout kRDataLayouts[] = {
+    {kTypeNS, 0, 1, 0, true}, {kTypeCNAME, 0, 1, 0, true}, {kTypePTR, 0, 1, 0, true},
+    {kTypeMX, 2, 1, 0, true}, {kTypeSOA, 0, 2, 20, true}, {kTypeSRV, 6, 1, 0, false},
 };
-struct DNSMessage // Flexible with the number of questions and answers
+constexpr size_t kMaxLayoutNames = 2;
+// Largest RDATA of a typed record once its names are expanded
+constexpr size_t kMaxTypedRData = kMaxLayoutNames * kMaxNameLength + 32;
+
+// Layout of a type in host byte order, nullptr when its RDATA has no names in it
+const RDataLayout *rdataLayout(uint16_t type)
 {
+    for (const RDataLayout &l : kRDataLayouts)
+    {
+        if (l.type == type)
+            return &l;
+    }
+    return nullptr;
+}
+
+// Find where each name inside uncompressed RDATA ends, false if it does not match the layout
+bool splitRData(std::string_view rData, const RDataLayout &layout, size_t *nameEnds)
+{
+    size_t at = layout.prefix;
+    for (size_t n = 0; n < layout.names; n++)
+    {
+        size_t start = at;
+        while (true)
+        {
+            if (at >= rData.size())
+                return false;
+            uint8_t len = uint8_t(rData[at]);
+            if (len > 63)
+                return false; // Pointers have no place in RDATA copied out of its packet
+            at += len + 1;
+            if (len == 0)
+                break;
+        }
+        if (at - start > kMaxNameLength)
+            return false;
+        nameEnds[n] = at;
+    }
+    return at <= rData.size() && rData.size() - at == layout.suffix;
+}
+
+struct DNSMessage // Flexible with the number of questions and records
+{
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
     DNSHeader header;
-    std::vector<DNSQuestion> questions;
-    std::vector<DNSAnswer> answers;
+    DNSVector<DNSQuestion> questions;
+    DNSVector<DNSAnswer> answers;
+    DNSVector<DNSAnswer> authorities;
+    DNSVector<DNSAnswer> additionals;
+
+    DNSMessage() = default;
+    explicit DNSMessage(const allocator_type &alloc) : questions(alloc), answers(alloc), authorities(alloc), additionals(alloc) {}
 };
 
-// Serialize the name into labels, codecrafters.io -> \x0ccodecrafters\x02io\x00
-// Not dealing with compressed packet now
-std::string serializeName(std::string name)
+// Convert a name into labels, codecrafters.io -> \x0ccodecrafters\x02io\x00, written straight into dest
+// dest needs room for kMaxNameLength bytes, return the bytes written or 0 if the name is invalid
+size_t dottedToWire(std::string_view name, char *dest)
 {
-    std::string result = "";
-    std::string temp = "";
-    uint8_t len = 0; // length of each octet(label)
-    for (int i = 0; i < name.length(); i++)
+    if (!name.empty() && name.back() == '.')
+        name.remove_suffix(1);
+    if (name.empty())
     {
-        if (len > 63)
+        dest[0] = '\0';
+        return 1;
+    }
+    // The whole name at most 255 bytes with its first length byte and the root
+    if (name.length() + 2 > kMaxNameLength)
+        return 0;
+    // Copied one byte further along, then every dot turns into the length of the label after it
+    memcpy(dest + 1, name.data(), name.length());
+    size_t lengthAt = 0;
+    bool valid = forEachByte(name.data(), name.length(), '.', [&](size_t dot)
+                             {
+                                 // Labels are 1 to 63 characters
+                                 size_t len = dot - lengthAt;
+                                 if (len == 0 || len > 63)
+                                     return false;
+                                 dest[lengthAt] = len;
+                                 lengthAt = dot + 1;
+                                 return true; });
+    size_t len = name.length() - lengthAt;
+    if (!valid || len == 0 || len > 63)
+        return 0;
+    dest[lengthAt] = len;
+    dest[name.length() + 1] = '\0';
+    return name.length() + 2;
+}
+
+// Names are compared case-insensitively (RFC 1035 2.3.3), wire format or dotted alike
+bool equalNames(std::string_view a, std::string_view b)
+{
+    return a.length() == b.length() && equalIgnoringCase(a.data(), b.data(), a.length());
+}
+
+/////////////////////////////////////////////
+//////////   Zero allocation views  /////////
+/////////////////////////////////////////////
+// Views point into the received buffer instead of copying out of it, parsing a message
+// this way never touches the heap. The buffer has to outlive every view made from it.
+// Every length, count and pointer is checked against the packet size, a malformed message is
+// refused with the reason instead of being read past its end.
+
+constexpr size_t kMaxViewQuestions = 16; // More questions than this and the message is refused
+constexpr size_t kMaxViewRecords = 384;  // Resource records kept, all sections together, enough for a 4 KiB message
+constexpr size_t kMaxPointerHops = 32;   // Compression pointers followed for a single name
+
+// Why a message was refused, anything but Ok should be answered with FORMERR
+enum class ParseStatus
+{
+    Ok,
+    Truncated,        // A field runs past the end of the packet
+    BadLabel,         // Label type 0b01 or 0b10, both reserved
+    PointerLoop,      // A pointer that does not point backwards, or too many of them
+    NameTooLong,      // More than kMaxNameLength bytes once expanded
+    BadCounts,        // Section counts that can not possibly fit in the packet
+    TooManyQuestions, // More than kMaxViewQuestions
+    BadRData,         // RDATA that does not match the layout of its type
+    BadOpt,           // More than one OPT record, or one out of place
+};
+
+const char *parseStatusText(ParseStatus status)
+{
+    switch (status)
+    {
+    case ParseStatus::Ok:
+        return "ok";
+    case ParseStatus::Truncated:
+        return "truncated";
+    case ParseStatus::BadLabel:
+        return "bad label type";
+    case ParseStatus::PointerLoop:
+        return "compression pointer loop";
+    case ParseStatus::NameTooLong:
+        return "name too long";
+    case ParseStatus::BadCounts:
+        return "section counts do not fit";
+    case ParseStatus::TooManyQuestions:
+        return "too many questions";
+    case ParseStatus::BadRData:
+        return "bad rdata";
+    case ParseStatus::BadOpt:
+        return "bad OPT record";
+    }
+    return "unknown";
+}
+
+// Walk the labels of the name starting at offset, following compression pointers in a loop
+// fn(label, len) is called for every label except the root
+// inPlaceLen is set to the bytes the name takes at offset (up to and including the first pointer)
+// A pointer has to point before the label it is found in, so pointer chains can not loop, and
+// at most kMaxPointerHops are followed so a crafted chain can not eat the CPU either
+template <typename Fn>
+ParseStatus walkName(const char *packet, size_t packetLen, size_t offset, size_t &inPlaceLen, Fn &&fn)
+{
+    size_t i = offset;
+    size_t lowest = offset; // Every pointer must go below this
+    size_t hops = 0;
+    size_t wireLen = 1;     // Expanded length so far, root included
+    while (true)
+    {
+        if (i >= packetLen)
+            return ParseStatus::Truncated;
+        uint8_t len = uint8_t(packet[i]);
+        if ((len & 0b11000000) == 0b11000000)
         {
-            std::cerr << "Invalid length for each label for serializ"
-                      << "ing,maximum allowed is 63, receive " << len << " characters." << std::endl;
+            if (i + 1 >= packetLen)
+                return ParseStatus::Truncated;
+            size_t target = ((size_t(len) & 0b00111111) << 8) | uint8_t(packet[i + 1]);
+            if (hops == 0)
+                inPlaceLen = i + 2 - offset;
+            if (target >= lowest || ++hops > kMaxPointerHops)
+                return ParseStatus::PointerLoop;
+            lowest = target;
+            i = target;
+            continue;
         }
-        if (name[i] == '.')
+        if (len & 0b11000000)
+            return ParseStatus::BadLabel;
+        if (len == 0)
         {
+            if (hops == 0)
+                inPlaceLen = i + 1 - offset;
+            return ParseStatus::Ok;
+        }
+        if (i + 1 + len > packetLen)
+            return ParseStatus::Truncated;
+        wireLen += len + 1;
+        if (wireLen > kMaxNameLength)
+            return ParseStatus::NameTooLong;
+        fn(packet + i + 1, len);
+        i += len + 1;
+    }
+}
+
+struct DNSNameView
+{
+    const char *packet; // Start of the message, compression pointers are offsets into it
+    uint16_t packetLen;
+    uint16_t offset;    // Where the name starts
+    uint16_t wireLen;   // Length once written out as uncompressed labels, root included
+
+    // Write the uncompressed labels into dest (at least wireLen bytes), return wireLen
+    size_t toWire(char *dest) const
+    {
+        size_t pos = 0, dummy = 0;
+        walkName(packet, packetLen, offset, dummy, [&](const char *label, uint8_t len)
+                 {
+                     dest[pos++] = len;
+                     memcpy(dest + pos, label, len);
+                     pos += len; });
+        dest[pos++] = '\0';
+        return pos;
+    }
+
+    // Same as toWire, lowercased on the way, as the cache, zone and template keys want it
+    size_t toLowerWire(char *dest) const
+    {
+        size_t pos = 0, dummy = 0;
+        walkName(packet, packetLen, offset, dummy, [&](const char *label, uint8_t len)
+                 {
+                     dest[pos++] = len;
+                     lowercaseCopy(dest + pos, label, len);
+                     pos += len; });
+        dest[pos++] = '\0';
+        return pos;
+    }
+
+    // Write codecrafters.io style text into dest (at least wireLen bytes), return its length
+    size_t toDotted(char *dest) const
+    {
+        size_t pos = 0, dummy = 0;
+        walkName(packet, packetLen, offset, dummy, [&](const char *label, uint8_t len)
+                 {
+                     if (pos)
+                         dest[pos++] = '.';
+                     memcpy(dest + pos, label, len);
+                     pos += len; });
+        return pos;
+    }
+
+    std::string toString() const
+    {
+        char temp[kMaxNameLength];
+        return std::string(temp, toDotted(temp));
+    }
+};
+
+// Type and class stay in network byte order like the rest of the structs
+struct DNSQuestionView
+{
+    DNSNameView qName;
+    uint16_t qType;
+    uint16_t qClass;
+};
+
+struct DNSRecordView
+{
+    DNSNameView name;
+    uint16_t type;
+    uint16_t _class;
+    uint32_t ttl;
+    uint16_t rdLength;
+    std::string_view rData; // Raw bytes, names in it may point anywhere earlier in the packet
+};
+
+// Records of all three sections share one array: answers, then authority, then additional
+struct DNSMessageView
+{
+    DNSHeader header;
+    size_t questionCount = 0;
+    DNSQuestionView questions[kMaxViewQuestions];
+    size_t answerCount = 0;
+    size_t authorityCount = 0;
+    size_t additionalCount = 0;
+    size_t droppedRecords = 0; // Records past kMaxViewRecords, checked but not kept
+    DNSRecordView records[kMaxViewRecords];
+
+    const DNSRecordView *answers() const { return records; }
+    const DNSRecordView *authorities() const { return records + answerCount; }
+    const DNSRecordView *additionals() const { return records + answerCount + authorityCount; }
+};
 
-            result.push_back(len);
-            result += temp;
-            len = 0;
-            temp = "";
+// Parse one name in place and advance pos past it
+ParseStatus parseNameView(DNSNameView &dest, const char *src, size_t len, size_t &pos)
+{
+    size_t inPlaceLen = 0, wireLen = 1;
+    ParseStatus status = walkName(src, len, pos, inPlaceLen, [&](const char *, uint8_t labelLen)
+                                  { wireLen += labelLen + 1; });
+    if (status != ParseStatus::Ok)
+        return status;
+    dest = {src, uint16_t(len), uint16_t(pos), uint16_t(wireLen)};
+    pos += inPlaceLen;
+    return ParseStatus::Ok;
+}
+
+// Copy a fixed-size field out of the packet and advance pos, false if it runs past the end
+bool parseFixed(const char *src, size_t len, size_t &pos, void *dest, size_t size)
+{
+    if (pos + size > len)
+        return false;
+    memcpy(dest, src + pos, size);
+    pos += size;
+    return true;
+}
+
+// The names inside the RDATA of a record have to be valid and stay inside it,
+// so they can be expanded later without any more checks
+ParseStatus checkRData(const DNSRecordView &r, const char *src)
+{
+    uint16_t type = ntohs(r.type);
+    if ((type == kTypeA && r.rData.size() != 4) || (type == kTypeAAAA && r.rData.size() != 16))
+        return ParseStatus::BadRData;
+    const RDataLayout *layout = rdataLayout(type);
+    if (!layout)
+        return ParseStatus::Ok;
+    size_t start = r.rData.data() - src, end = start + r.rData.size();
+    size_t pos = start + layout->prefix, inPlace;
+    if (pos > end)
+        return ParseStatus::BadRData;
+    for (size_t n = 0; n < layout->names; n++)
+    {
+        ParseStatus status = walkName(src, end, pos, inPlace, [](const char *, uint8_t) {});
+        if (status == ParseStatus::Truncated)
+            return ParseStatus::BadRData; // Runs past the RDATA, not necessarily past the packet
+        if (status != ParseStatus::Ok)
+            return status;
+        pos += inPlace;
+    }
+    return end - pos == layout->suffix ? ParseStatus::Ok : ParseStatus::BadRData;
+}
+
+// Parse the header, questions and records of a len-byte message without copying anything
+ParseStatus parseDNSMessageView(DNSMessageView &dest, const char *src, size_t len)
+{
+    if (len < sizeof(DNSHeader))
+        return ParseStatus::Truncated;
+    if (len > UINT16_MAX)
+        return ParseStatus::BadCounts;
+    memcpy(&dest.header, src, sizeof(DNSHeader));
+    size_t pos = sizeof(DNSHeader);
+    dest.questionCount = 0;
+    dest.answerCount = dest.authorityCount = dest.additionalCount = dest.droppedRecords = 0;
+
+    // Cheap sanity check before touching any name: a question takes at least 5 bytes (root,
+    // type, class) and a record at least 11, counts that can not fit are refused right away
+    size_t numQ = ntohs(dest.header.qdCount);
+    size_t numRecords = size_t(ntohs(dest.header.anCount)) + ntohs(dest.header.nsCount) + ntohs(dest.header.arCount);
+    if (numQ * 5 + numRecords * 11 > len - pos)
+        return ParseStatus::BadCounts;
+    if (numQ > kMaxViewQuestions)
+        return ParseStatus::TooManyQuestions;
+
+    ParseStatus status;
+    for (size_t i = 0; i < numQ; i++)
+    {
+        DNSQuestionView &q = dest.questions[i];
+        if ((status = parseNameView(q.qName, src, len, pos)) != ParseStatus::Ok)
+            return status;
+        if (!parseFixed(src, len, pos, &q.qType, sizeof(uint16_t)) ||
+            !parseFixed(src, len, pos, &q.qClass, sizeof(uint16_t)))
+            return ParseStatus::Truncated;
+        dest.questionCount++;
+    }
+
+    size_t *sectionCounts[] = {&dest.answerCount, &dest.authorityCount, &dest.additionalCount};
+    uint16_t sectionSizes[] = {dest.header.anCount, dest.header.nsCount, dest.header.arCount};
+    for (size_t section = 0; section < 3; section++)
+    {
+        size_t numR = ntohs(sectionSizes[section]);
+        for (size_t i = 0; i < numR; i++)
+        {
+            DNSRecordView a;
+            if ((status = parseNameView(a.name, src, len, pos)) != ParseStatus::Ok)
+                return status;
+            if (!parseFixed(src, len, pos, &a.type, sizeof(uint16_t)) ||
+                !parseFixed(src, len, pos, &a._class, sizeof(uint16_t)) ||
+                !parseFixed(src, len, pos, &a.ttl, sizeof(uint32_t)) ||
+                !parseFixed(src, len, pos, &a.rdLength, sizeof(uint16_t)))
+                return ParseStatus::Truncated;
+            size_t rdLen = ntohs(a.rdLength);
+            if (pos + rdLen > len)
+                return ParseStatus::Truncated;
+            a.rData = std::string_view(src + pos, rdLen);
+            pos += rdLen;
+            if ((status = checkRData(a, src)) != ParseStatus::Ok)
+                return status;
+            size_t kept = dest.answerCount + dest.authorityCount + dest.additionalCount;
+            if (kept < kMaxViewRecords)
+            {
+                dest.records[kept] = a;
+                (*sectionCounts[section])++;
+            }
+            else
+            {
+                dest.droppedRecords++;
+            }
         }
-        else if (name[i] != '.')
+    }
+    return ParseStatus::Ok;
+}
+
+// Names are compared case-insensitively, without building strings
+bool equalNames(const DNSNameView &a, const DNSNameView &b)
+{
+    if (a.wireLen != b.wireLen)
+        return false;
+    char wireA[kMaxNameLength], wireB[kMaxNameLength];
+    a.toWire(wireA);
+    b.toWire(wireB);
+    return equalIgnoringCase(wireA, wireB, a.wireLen);
+}
+
+// RDATA of a viewed record with the names in it expanded, so it means the same outside its packet
+// Typed RDATA is written into temp, anything else points straight into the packet
+std::string_view expandRData(const DNSRecordView &r, char (&temp)[kMaxTypedRData])
+{
+    const RDataLayout *layout = rdataLayout(ntohs(r.type));
+    if (!layout)
+        return r.rData;
+    // checkRData already walked every name here, they are known to be valid
+    const char *packet = r.name.packet;
+    size_t start = r.rData.data() - packet, pos = start + layout->prefix;
+    memcpy(temp, r.rData.data(), layout->prefix);
+    size_t length = layout->prefix;
+    for (size_t n = 0; n < layout->names; n++)
+    {
+        size_t inPlace = 0;
+        walkName(packet, r.name.packetLen, pos, inPlace, [&](const char *label, uint8_t len)
+                 {
+                     temp[length++] = len;
+                     memcpy(temp + length, label, len);
+                     length += len; });
+        temp[length++] = '\0';
+        pos += inPlace;
+    }
+    memcpy(temp + length, packet + pos, layout->suffix);
+    length += layout->suffix;
+    return std::string_view(temp, length);
+}
+
+// Copy a viewed record out of the packet into a, its name and the names inside rData are expanded
+// byte for byte, case and any odd label bytes included
+// Written in place, so the strings come from whatever allocator a already has
+void toDNSAnswer(const DNSRecordView &r, DNSAnswer &a)
+{
+    char name[kMaxNameLength];
+    char temp[kMaxTypedRData];
+    a.name.assign(name, r.name.toWire(name));
+    a.type = r.type;
+    a._class = r._class;
+    a.ttl = r.ttl;
+    a.rData = expandRData(r, temp);
+    a.rdLength = htons(a.rData.size());
+}
+
+void toDNSQuestion(const DNSQuestionView &q, DNSQuestion &dest)
+{
+    char name[kMaxNameLength];
+    dest.qName.assign(name, q.qName.toWire(name));
+    dest.qType = q.qType;
+    dest.qClass = q.qClass;
+}
+
+// Parse the len-byte buffer into DNSMessage, copying everything out of it
+// Goes through the view parser, so the same checks apply
+ParseStatus parseDNSMessage(DNSMessage &dest, const char *src, size_t len)
+{
+    DNSMessageView view;
+    ParseStatus status = parseDNSMessageView(view, src, len);
+    if (status != ParseStatus::Ok)
+        return status;
+    dest.header = view.header;
+    dest.questions.clear();
+    dest.answers.clear();
+    dest.authorities.clear();
+    dest.additionals.clear();
+    for (size_t i = 0; i < view.questionCount; i++)
+    {
+        toDNSQuestion(view.questions[i], dest.questions.emplace_back());
+    }
+    for (size_t i = 0; i < view.answerCount; i++)
+    {
+        toDNSAnswer(view.answers()[i], dest.answers.emplace_back());
+    }
+    for (size_t i = 0; i < view.authorityCount; i++)
+    {
+        toDNSAnswer(view.authorities()[i], dest.authorities.emplace_back());
+    }
+    for (size_t i = 0; i < view.additionalCount; i++)
+    {
+        toDNSAnswer(view.additionals()[i], dest.additionals.emplace_back());
+    }
+    return ParseStatus::Ok;
+}
+
+// What the upstream said about one question, section by section
+struct DNSResult
+{
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    uint16_t rcode = 0;
+    DNSVector<DNSAnswer> answers;
+    DNSVector<DNSAnswer> authorities;
+    DNSVector<DNSAnswer> additionals;
+
+    DNSResult() = default;
+    explicit DNSResult(const allocator_type &alloc) : answers(alloc), authorities(alloc), additionals(alloc) {}
+    DNSResult(const DNSResult &rhs, const allocator_type &alloc = {})
+        : rcode(rhs.rcode), answers(rhs.answers, alloc), authorities(rhs.authorities, alloc), additionals(rhs.additionals, alloc) {}
+    DNSResult(DNSResult &&rhs, const allocator_type &alloc)
+        : rcode(rhs.rcode), answers(std::move(rhs.answers), alloc), authorities(std::move(rhs.authorities), alloc),
+          additionals(std::move(rhs.additionals), alloc) {}
+    DNSResult(DNSResult &&) = default;
+    DNSResult &operator=(const DNSResult &) = default;
+    DNSResult &operator=(DNSResult &&) = default;
+
+    void clear()
+    {
+        rcode = 0;
+        answers.clear();
+        authorities.clear();
+        additionals.clear();
+    }
+};
+
+// Copy the records of a reply out of its packet, OPT is left out as it only holds for one hop
+void toDNSResult(const DNSMessageView &view, DNSResult &dest)
+{
+    dest.clear();
+    dest.rcode = ntohs(view.header.flags) & 0xF;
+    auto copy = [](const DNSRecordView *records, size_t count, DNSVector<DNSAnswer> &to)
+    {
+        for (size_t i = 0; i < count; i++)
         {
-            len++;
-            temp += name[i];
+            if (ntohs(records[i].type) != kTypeOPT)
+                toDNSAnswer(records[i], to.emplace_back());
         }
+    };
+    copy(view.answers(), view.answerCount, dest.answers);
+    copy(view.authorities(), view.authorityCount, dest.authorities);
+    copy(view.additionals(), view.additionalCount, dest.additionals);
+}
+
+/////////////////////////////////////////////
+//////////          EDNS(0)         /////////
+/////////////////////////////////////////////
+// The OPT pseudo-record (RFC 6891) sits in the additional section. Its class is the UDP payload
+// size the sender can take, its TTL holds the upper RCODE bits, the version and the DO bit.
+// It only holds for one hop, so the OPT of a message is read and never passed on.
+
+constexpr size_t kClassicUdpSize = 512; // Without EDNS, also the least an OPT may advertise
+constexpr size_t kDefaultEdnsSize = 1232; // Fits any IPv6 path without fragments, can be changed with --edns-size
+constexpr size_t kOptRecordSize = 11;    // Root owner and fixed fields, no options
+constexpr uint16_t kRcodeBadVers = 16;
+
+struct Edns
+{
+    bool present = false;
+    uint16_t udpSize = kClassicUdpSize;
+    uint8_t version = 0;
+    bool dnssecOk = false;
+
+    // Largest response the sender takes, 512 without EDNS and never more than we advertise
+    size_t responseLimit(size_t advertised) const
+    {
+        if (!present)
+            return kClassicUdpSize;
+        return std::clamp<size_t>(udpSize, kClassicUdpSize, advertised);
     }
-    // Final label
-    result.push_back(len);
-    result += temp;
-    // Add null terminate
-    result.push_back('\0');
-    return result;
+};
+
+// Read the OPT record of a parsed message, if any
+// More than one, one outside the additional section or one not owned by the root is refused
+ParseStatus parseEdns(const DNSMessageView &view, Edns &dest)
+{
+    dest = Edns();
+    size_t count = view.answerCount + view.authorityCount + view.additionalCount;
+    for (size_t i = 0; i < count; i++)
+    {
+        const DNSRecordView &r = view.records[i];
+        if (ntohs(r.type) != kTypeOPT)
+            continue;
+        if (i < view.answerCount + view.authorityCount || dest.present || r.name.wireLen != 1)
+            return ParseStatus::BadOpt;
+        uint32_t ttl = ntohl(r.ttl);
+        dest.present = true;
+        dest.udpSize = ntohs(r._class);
+        dest.version = (ttl >> 16) & 0xFF;
+        dest.dnssecOk = ttl & 0x8000;
+    }
+    return ParseStatus::Ok;
+}
+
+// Write an OPT record without options into dest (kOptRecordSize bytes)
+// rcode only gives the upper 8 bits, the lower 4 go in the header
+void encodeOpt(char *dest, uint16_t udpSize, bool dnssecOk, uint16_t rcode = 0)
+{
+    uint16_t type = htons(kTypeOPT), _class = htons(udpSize), rdLength = 0;
+    uint32_t ttl = htonl((uint32_t(rcode >> 4) << 24) | (dnssecOk ? 0x8000 : 0));
+    dest[0] = '\0';
+    memcpy(dest + 1, &type, sizeof(uint16_t));
+    memcpy(dest + 3, &_class, sizeof(uint16_t));
+    memcpy(dest + 5, &ttl, sizeof(uint32_t));
+    memcpy(dest + 9, &rdLength, sizeof(uint16_t));
 }
-// Parse the labels into name \x0ccodecrafters\x02io\x00 -> codecrafters.io
-// Only works with correct serialized format from beginning
-// Store total_len for future use
-// Pointer only use last
-std::string parseName(char *buffer, size_t &pos, size_t &total_len)
-{
-    std::string result = "";
-    size_t i = pos;
-    bool compressed = false;
-    while (uint8_t(buffer[i]) != 0)
-    { // parse each label by taking out the labels
-        uint8_t len = uint8_t(buffer[i]);
-        if (i != pos)
-            result += '.';
-        if (len & 0b11000000) // this indicate it is pointer, handle pointer recursively
+
+/////////////////////////////////////////////
+//////////        Serializer        /////////
+/////////////////////////////////////////////
+// DNSWriter puts a message straight into the caller's buffer. Every name it writes is looked up
+// in a small compression table first, so a suffix already in the message becomes a 2-byte pointer.
+// It never writes past capacity: a question or record that does not fit is left out entirely
+// and truncated() reports it, the caller then sets TC.
+
+constexpr size_t kMaxCompressionEntries = 64;
+
+class DNSWriter
+{
+public:
+    DNSWriter(char *dest, size_t capacity) : dest(dest), capacity(capacity) {}
+
+    bool writeHeader(const DNSHeader &h) { return writeBytes(&h, sizeof(DNSHeader)); }
+    // Overwrite the header written first, once the final counts and flags are known
+    void patchHeader(const DNSHeader &h) { memcpy(dest, &h, sizeof(DNSHeader)); }
+
+    // Write uncompressed labels, the longest suffix already in the message is replaced by a pointer
+    // Only a suffix spelled the same byte for byte is reused, so names go out exactly as given
+    bool writeWireName(const char *wire, size_t wireLen)
+    {
+        size_t i = 0;
+        while (i < wireLen && wire[i] != 0)
+        {
+            uint16_t found;
+            if (findSuffix(wire + i, wireLen - i, found))
+            {
+                uint16_t pointer = htons(0xC000 | found);
+                return writeBytes(&pointer, sizeof(uint16_t));
+            }
+            // Only offsets that fit in the 14 bits of a pointer are worth remembering
+            if (pos < 0x4000 && entryCount < kMaxCompressionEntries)
+                entries[entryCount++] = {uint16_t(pos), uint16_t(wireLen - i)};
+            size_t len = uint8_t(wire[i]);
+            if (len > 63 || i + len + 1 >= wireLen)
+                return false; // Not a wire name, or one without its root
+            if (!writeBytes(wire + i, len + 1))
+                return false;
+            i += len + 1;
+        }
+        return writeBytes("", 1);
+    }
+
+    bool writeName(const DNSNameView &name)
+    {
+        char wire[kMaxNameLength];
+        size_t wireLen = name.toWire(wire);
+        return writeWireName(wire, wireLen);
+    }
+
+    // A name as DNSQuestion and DNSAnswer hold it, already in wire format
+    bool writeName(std::string_view wire) { return writeWireName(wire.data(), wire.size()); }
+
+    // Questions and records are all or nothing, a partial one is rolled back
+    template <typename Name>
+    bool writeQuestion(const Name &qName, uint16_t qType, uint16_t qClass)
+    {
+        Mark m = mark();
+        if (writeName(qName) && writeBytes(&qType, sizeof(uint16_t)) && writeBytes(&qClass, sizeof(uint16_t)))
+            return true;
+        rollback(m);
+        return false;
+    }
+
+    bool writeQuestion(const DNSQuestionView &q) { return writeQuestion(q.qName, q.qType, q.qClass); }
+    bool writeQuestion(const DNSQuestion &q) { return writeQuestion(std::string_view(q.qName), q.qType, q.qClass); }
+
+    // rData is already encoded for the wire with its names uncompressed, see writeRData
+    template <typename Name>
+    bool writeRecord(const Name &name, uint16_t type, uint16_t _class, uint32_t ttl, std::string_view rData)
+    {
+        Mark m = mark();
+        if (writeName(name) && writeBytes(&type, sizeof(uint16_t)) && writeBytes(&_class, sizeof(uint16_t)) &&
+            writeBytes(&ttl, sizeof(uint32_t)) && writeRData(ntohs(type), rData))
+            return true;
+        rollback(m);
+        return false;
+    }
+
+    bool writeRecord(const DNSAnswer &a) { return writeRecord(std::string_view(a.name), a.type, a._class, a.ttl, a.rData); }
+    bool writeRecord(const DNSRecordView &r)
+    {
+        char temp[kMaxTypedRData];
+        return writeRecord(r.name, r.type, r._class, r.ttl, expandRData(r, temp));
+    }
+
+    // Owner name in uncompressed wire format, then type, class, TTL, RDLENGTH and RDATA already encoded
+    bool writeWireRecord(const char *wireName, size_t wireLen, const char *fixed, size_t fixedLen)
+    {
+        Mark m = mark();
+        if (writeWireName(wireName, wireLen) && writeBytes(fixed, fixedLen))
+            return true;
+        rollback(m);
+        return false;
+    }
+
+    bool writeOpt(uint16_t udpSize, bool dnssecOk, uint16_t rcode = 0)
+    {
+        char record[kOptRecordSize];
+        encodeOpt(record, udpSize, dnssecOk, rcode);
+        return writeBytes(record, sizeof(record));
+    }
+
+    // Hand back room held aside at construction, for a record that has to go last (the OPT)
+    void grow(size_t bytes) { capacity += bytes; }
+
+    size_t size() const { return pos; }
+    bool truncated() const { return overflow; }
+
+private:
+    struct Entry
+    {
+        uint16_t offset;  // Where the suffix starts in the message
+        uint16_t wireLen; // Its uncompressed length, checked before comparing
+    };
+    struct Mark
+    {
+        size_t pos;
+        size_t entryCount;
+    };
+
+    char *dest;
+    size_t capacity;
+    size_t pos = 0;
+    bool overflow = false;
+    Entry entries[kMaxCompressionEntries];
+    size_t entryCount = 0;
+
+    // RDLENGTH and RDATA, the names inside the RFC 1035 types are compressed like any other
+    // RDATA that does not match the layout of its type goes out untouched
+    bool writeRData(uint16_t type, std::string_view rData)
+    {
+        if (rData.size() > UINT16_MAX)
+            return false;
+        size_t lengthAt = pos;
+        uint16_t rdLength = htons(rData.size());
+        if (!writeBytes(&rdLength, sizeof(uint16_t)))
+            return false;
+        const RDataLayout *layout = rdataLayout(type);
+        size_t nameEnds[kMaxLayoutNames];
+        if (!layout || !layout->compress || !splitRData(rData, *layout, nameEnds))
+            return writeBytes(rData.data(), rData.size());
+
+        size_t start = pos, at = layout->prefix;
+        if (!writeBytes(rData.data(), at))
+            return false;
+        for (size_t n = 0; n < layout->names; n++)
         {
-            // Construct pointer then find offset
-            uint16_t pointer = (uint16_t(len) << 8) | uint8_t(buffer[i + 1]);
-            uint16_t offset = pointer & ~(0b11000000 << 8);
-            size_t temp_pos = offset, dummy = 0;
-            std::string temp = parseName(buffer, temp_pos, dummy);
-            result += temp;
-            i += 2;
-            compressed = true;
-            break;
+            if (!writeWireName(rData.data() + at, nameEnds[n] - at))
+                return false;
+            at = nameEnds[n];
         }
-        for (int j = 1; j <= len; j++)
+        if (!writeBytes(rData.data() + at, rData.size() - at))
+            return false;
+        rdLength = htons(pos - start);
+        memcpy(dest + lengthAt, &rdLength, sizeof(uint16_t));
+        return true;
+    }
+
+    bool writeBytes(const void *src, size_t len)
+    {
+        if (pos + len > capacity)
         {
-            result += buffer[i + j];
+            overflow = true;
+            return false;
         }
-        i += len + 1;
+        memcpy(dest + pos, src, len);
+        pos += len;
+        return true;
     }
-    // Acount for \0
-    if (compressed == false)
+
+    Mark mark() const { return {pos, entryCount}; }
+    void rollback(const Mark &m)
     {
-        i++;
+        pos = m.pos;
+        entryCount = m.entryCount;
     }
-    total_len = i - pos;
-    pos = i;
-    return result;
-}
 
-// Serialize the message into buffer and current offset len.
-void serializeDNSMessage(char *dest, DNSMessage &src, size_t &pos)
-{
-    // Serialize header section
-    memcpy(dest + pos, &(src.header), sizeof(src.header));
-    pos += sizeof(src.header);
-
-    // Serialize question section
-    size_t numQ = ntohs(src.header.qdCount);
-    // Serialize each question
-    for (int i = 0; i < numQ; i++)
-    {
-        const DNSQuestion &q = src.questions[i];
-        std::string temp = serializeName(q.qName);
-        memcpy(dest + pos, temp.data(), (size_t)temp.length());
-        pos += temp.length();
-        memcpy(dest + pos, &(q.qType), sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-        memcpy(dest + pos, &(q.qClass), sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-    }
-    // Serialize each answer
-    size_t numA = ntohs(src.header.anCount);
-    for (int i = 0; i < numA; i++)
-    {
-        const DNSAnswer &a = src.answers[i];
-        std::string temp = serializeName(a.name);
-        memcpy(dest + pos, temp.data(), (size_t)temp.length());
-        pos += temp.length();
-        memcpy(dest + pos, &(a.type), sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-        memcpy(dest + pos, &(a._class), sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-        memcpy(dest + pos, &(a.ttl), sizeof(uint32_t));
-        pos += sizeof(uint32_t);
-        memcpy(dest + pos, &(a.rdLength), sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-        uint32_t tempIP;
-        inet_pton(AF_INET, a.rData.data(), &tempIP);
-        memcpy(dest + pos, &tempIP, sizeof(uint32_t));
-        pos += sizeof(uint32_t);
+    bool findSuffix(const char *wire, size_t wireLen, uint16_t &offset)
+    {
+        for (size_t e = 0; e < entryCount; e++)
+        {
+            if (entries[e].wireLen != wireLen)
+                continue;
+            // The suffix already written may itself end in a pointer, expand it to compare
+            DNSNameView written = {dest, uint16_t(pos), entries[e].offset, entries[e].wireLen};
+            char temp[kMaxNameLength];
+            written.toWire(temp);
+            if (memcmp(temp, wire, wireLen) == 0)
+            {
+                offset = entries[e].offset;
+                return true;
+            }
+        }
+        return false;
     }
-}
+};
 
-// Parse the byte buffer into DNSMessage
-void parseDNSMessage(DNSMessage &dest, char *src, size_t &pos)
+// Serialize the message into dest starting at pos, never past capacity, and advance pos
+// Questions and records that do not fit are left out, TC is set and false returned
+bool serializeDNSMessage(char *dest, size_t capacity, DNSMessage &src, size_t &pos)
 {
-    // Parse header section, mimic ID, Opcode and RD only, else turn 0 except QR
+    if (capacity < pos + sizeof(DNSHeader))
+        return false;
+    DNSWriter writer(dest + pos, capacity - pos);
+    DNSHeader header = src.header;
+    header.qdCount = header.anCount = header.nsCount = header.arCount = 0;
+    writer.writeHeader(header);
 
-    memcpy(&dest.header, src + pos, sizeof(DNSHeader));
-    pos += sizeof(DNSHeader);
-
-    // Parse the question section,
-    // Parse each question
-    size_t numQ = ntohs(dest.header.qdCount);
-    for (int i = 0; i < numQ; i++)
-    {
-        DNSQuestion q;
-        size_t label_len = 0;
-        q.qName = parseName(src, pos, label_len);
-        memcpy(&q.qType, src + pos, sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-        memcpy(&q.qClass, src + pos, sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-        dest.questions.push_back(q);
-    }
-    size_t numA = ntohs(dest.header.anCount);
-    std::cout << "Hello from inside " << numA << std::endl;
-
-    for (int i = 0; i < numA; i++)
-    {
-        DNSAnswer a;
-        size_t label_len = 0;
-        a.name = parseName(src, pos, label_len);
-
-        memcpy(&a.type, src + pos, sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-        memcpy(&a._class, src + pos, sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-
-        memcpy(&a.ttl, src + pos, sizeof(uint32_t));
-        pos += sizeof(uint32_t);
-        memcpy(&a.rdLength, src + pos, sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-
-        int ansLen = ntohs(a.rdLength);
-        // Convert raw bytes → dotted IPv4 string
-        for (int j = 0; j < ansLen; j++)
+    for (const DNSQuestion &q : src.questions)
+    {
+        if (!writer.writeQuestion(q))
+        {
+            if (writer.truncated())
+                break;
+            continue; // Not a valid name, leave it out
+        }
+        header.qdCount++;
+    }
+    DNSVector<DNSAnswer> *sections[] = {&src.answers, &src.authorities, &src.additionals};
+    uint16_t *counts[] = {&header.anCount, &header.nsCount, &header.arCount};
+    for (size_t section = 0; section < 3 && !writer.truncated(); section++)
+    {
+        for (const DNSAnswer &a : *sections[section])
         {
-            if (j)
-                a.rData += '.';
-            unsigned char temp = src[pos + j];
-            a.rData += std::to_string(int(temp));
+            if (!writer.writeRecord(a))
+            {
+                if (writer.truncated())
+                    break;
+                continue;
+            }
+            (*counts[section])++;
         }
-        // char ipBuffer[INET_ADDRSTRLEN];
-        // inet_ntop(AF_INET, src + pos, ipBuffer, sizeof(ipBuffer));
-        // a.rData = ipBuffer;
-        pos += 4;
-        dest.answers.push_back(a);
     }
+    header.qdCount = htons(header.qdCount);
+    header.anCount = htons(header.anCount);
+    header.nsCount = htons(header.nsCount);
+    header.arCount = htons(header.arCount);
+    if (writer.truncated())
+        header.flags |= htons(1 << 9);
+    writer.patchHeader(header);
+    pos += writer.size();
+    return !writer.truncated();
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+#ifndef MY_RATELIMIT_CLASS
+#define MY_RATELIMIT_CLASS
+
+#include <netinet/in.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+
+// Per client rate limiting of UDP queries, shared by every worker, checked on the raw datagram
+// before anything is parsed.
+// Clients are counted by source prefix (a /24 by default), since one host spoofing or spreading
+// its queries over neighbouring addresses should not get more than one. Every prefix has a token
+// bucket of `rate` queries per second with room for one second of them in a burst. A query over
+// the limit is dropped, except one in every `slip` that is answered empty with TC set (as RRL
+// does), so a real client whose address is being spoofed can still get through over TCP.
+// TCP is never limited here, its source can not be spoofed.
+//
+// Layout: a fixed table of kRateLimitSets sets of kRateLimitWays buckets, one 64-bit word each,
+// a prefix can only live in the set its hash picks. The word holds a tag of the prefix and the
+// time its bucket gets full again (GCRA, a bucket is just that time), so a check is a few loads
+// and one compare-and-swap, without a lock. A bucket that is full again is free for any prefix.
+// When every bucket of a set is busy with other prefixes, the query is let through: under a
+// flood from random addresses, no single prefix sends enough to be limited anyway.
+
+// Queries per second and client prefix, 0 to not limit, can be changed with --rate-limit
+constexpr size_t kDefaultRateLimit = 0;
+// Leading bits of the source address that make one client, can be changed with --rate-limit-prefix
+constexpr size_t kDefaultRateLimitPrefix = 24;
+// One in this many limited queries is answered truncated, 0 to drop them all, see --rate-limit-slip
+constexpr size_t kDefaultRateLimitSlip = 2;
+// Table size, 16K sets of 4 buckets is 512 KiB whatever the traffic
+constexpr size_t kRateLimitSets = 1 << 14;
+constexpr size_t kRateLimitWays = 4;
+
+class RateLimiter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // rate: queries per second of every client prefix, 0 to let everything through
+    // prefixLength: leading bits of the IPv4 source address that are one client, 1 to 32
+    RateLimiter(size_t rate = kDefaultRateLimit, size_t prefixLength = kDefaultRateLimitPrefix, size_t slip = kDefaultRateLimitSlip)
+        : slipEvery(slip), start(Clock::now())
+    {
+        if (rate == 0)
+            return;
+        // Kept in microseconds, the finest rate is a query per microsecond
+        interval = std::max<uint64_t>(1, 1000000 / rate);
+        burst = 1000000 - std::min<uint64_t>(interval, 1000000);
+        mask = prefixLength >= 32 ? 0xFFFFFFFFu : ~(0xFFFFFFFFu >> prefixLength);
+        // A secret seed, so nobody can pick addresses that land in the same set on purpose
+        seed = (uint64_t(std::random_device{}()) << 32) | std::random_device{}();
+        sets.reset(new Set[kRateLimitSets]);
+    }
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    bool enabled() const { return interval != 0; }
+    // One in this many refused queries should get a truncated answer, 0 for none
+    size_t slip() const { return slipEvery; }
+
+    // Whether a query from address may go on, taking a token from its prefix if so
+    bool admit(const sockaddr_in &address, Clock::time_point now)
+    {
+        if (!enabled())
+            return true;
+        uint64_t hash = ((ntohl(address.sin_addr.s_addr) & mask) ^ seed) * 0x9E3779B97F4A7C15ull;
+        Set &set = sets[hash >> (64 - kSetBits)];
+        uint64_t tag = (hash >> (64 - kSetBits - kTagBits)) & kTagMask;
+        uint64_t t = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+
+        // The bucket of this prefix, or else one that is full again and can be taken over
+        std::atomic<uint64_t> *bucket = nullptr;
+        for (std::atomic<uint64_t> &b : set.buckets)
+        {
+            uint64_t word = b.load(std::memory_order_relaxed);
+            if ((word >> kTimeBits) == tag)
+            {
+                bucket = &b;
+                break;
+            }
+            if (bucket == nullptr && (word & kTimeMask) <= t)
+                bucket = &b;
+        }
+        if (bucket == nullptr)
+            return true;
+
+        uint64_t word = bucket->load(std::memory_order_relaxed);
+        while (true)
+        {
+            uint64_t full = word & kTimeMask;
+            if ((word >> kTimeBits) != tag)
+            {
+                // Another prefix got to the free bucket first
+                if (full > t)
+                    return true;
+                full = 0;
+            }
+            // Full again at `full`, every query pushes that an interval further, up to a burst ahead
+            full = std::max(full, t);
+            if (full - t > burst)
+                return false;
+            uint64_t next = (tag << kTimeBits) | ((full + interval) & kTimeMask);
+            if (bucket->compare_exchange_weak(word, next, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+private:
+    // Bucket word: tag in the top bits, microseconds since start below, good for 8 years
+    static constexpr unsigned kTimeBits = 48;
+    static constexpr uint64_t kTimeMask = (uint64_t(1) << kTimeBits) - 1;
+    static constexpr unsigned kTagBits = 64 - kTimeBits;
+    static constexpr uint64_t kTagMask = (uint64_t(1) << kTagBits) - 1;
+    static constexpr unsigned kSetBits = 14;
+    static_assert(kRateLimitSets == size_t(1) << kSetBits);
+
+    // A set per half cache line, a check touches one line only
+    struct alignas(32) Set
+    {
+        std::atomic<uint64_t> buckets[kRateLimitWays] = {};
+    };
+
+    uint64_t interval = 0; // Microseconds a query takes from its bucket, 0 when not limiting
+    uint64_t burst = 0;    // How far ahead of now a bucket may be pushed
+    uint32_t mask = 0;
+    uint64_t seed = 0;
+    size_t slipEvery;
+    Clock::time_point start;
+    std::unique_ptr<Set[]> sets;
+};
+
+#endif
@@ -1,157 +1,318 @@
 /////////////////////////////////////////////
 //////////       server side        /////////
 /////////////////////////////////////////////
-// Directly response DNS Server with fake response
+// Stub upstream: answers every query with made up records, after an optional delay, and drops or
+// fails a share of them on purpose. Run dns-server with --resolver 127.0.0.1:<port> against it
+// and the whole forwarding path can be benchmarked on one machine without a network.
 #include <iostream>
+#include <cmath>
 #include <cstring>
-#include "netstruct.hpp"
-#include <fstream>
+#include <poll.h>
+#include <queue>
+#include <random>
+#include <thread>
 #include <vector>
+#include "netstruct.hpp"
+#include "batchio.hpp"
 
-int main()
-{
-    // Flush after every std::cout / std::cerr
-    std::cout << std::unitbuf;
-    std::cerr << std::unitbuf;
+const char *usage = "Usage: dns-stub [--port <port>] [--delay <ms>] [--jitter <ms>] [--drop <percent>] [--servfail <percent>]"
+                    " [--answers <n>] [--ttl <seconds>] [--threads <n>]";
 
-    // Disable output buffering
-    setbuf(stdout, NULL);
+struct StubOptions
+{
+    uint16_t port = 5353;
+    std::chrono::microseconds delay{0};
+    std::chrono::microseconds jitter{0}; // A random extra delay up to this long, replies may overtake each other
+    unsigned drop = 0;                   // Percent of queries never answered
+    unsigned servfail = 0;               // Percent of queries answered with SERVFAIL
+    size_t answers = 1;                  // Records per A or AAAA answer
+    uint32_t ttl = 300;
+};
 
-    // You can use print statements as follows for debugging, they'll be visible when running tests.
-    std::cout << "Logs from your program will appear here!" << std::endl;
+// A reply waiting for its delay to pass
+struct DelayedReply
+{
+    std::chrono::steady_clock::time_point due;
+    sockaddr_in address;
+    std::string packet;
 
-    int udpSocket;
-    sockaddr_in clientAddress;
+    bool operator>(const DelayedReply &other) const { return due > other.due; }
+};
 
-    udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udpSocket == -1)
-    {
-        std::cerr << "Socket creation failed: " << strerror(errno) << "..." << std::endl;
-        return 1;
-    }
+// Write the reply to query into out, return its length, 0 to ignore the query
+// Questions are copied as they are, every A or AAAA one gets `answers` records pointing back at its
+// name, other types get an empty NOERROR. Replies that would not fit in 512 bytes (or 1232 when
+// the query carries an OPT) are sent empty with TC set.
+size_t build_reply(const char *query, size_t length, char *out, const StubOptions &options, bool servfail, uint32_t &serial)
+{
+    if (length < 12 || (query[2] & 0x80))
+        return 0;
+    uint16_t qdCount = (uint8_t(query[4]) << 8) | uint8_t(query[5]);
+    bool edns = query[10] || query[11];
+    size_t limit = edns ? 1232 : 512;
 
-    // Since the tester restarts your program quite often, setting REUSE_PORT
-    // ensures that we don't run into 'Address already in use' errors
-    int reuse = 1;
-    if (setsockopt(udpSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+    // Find where the question section ends, queries never compress their names
+    std::vector<uint16_t> names;
+    size_t pos = 12;
+    for (uint16_t q = 0; q < qdCount; q++)
     {
-        std::cerr << "SO_REUSEPORT failed: " << strerror(errno) << std::endl;
-        return 1;
+        names.push_back(pos);
+        while (pos < length && query[pos] != 0)
+        {
+            if (uint8_t(query[pos]) >= 0xC0)
+                return 0;
+            pos += uint8_t(query[pos]) + 1;
+        }
+        pos += 5;
+        if (pos > length || pos > limit)
+            return 0;
     }
+    memcpy(out, query, pos);
+    out[2] = char(0x80 | (query[2] & 0x79)); // QR, keep the opcode and RD
+    out[3] = char(servfail ? 0x82 : 0x80);   // RA and the RCODE
+    memset(out + 6, 0, 6);
 
-    sockaddr_in serv_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(2053),
-        .sin_addr = {htonl(INADDR_ANY)},
-    };
-
-    if (bind(udpSocket, reinterpret_cast<struct sockaddr *>(&serv_addr), sizeof(serv_addr)) != 0)
+    size_t end = pos;
+    uint16_t anCount = 0;
+    for (uint16_t q = 0; q < qdCount && !servfail; q++)
     {
-        std::cerr << "Bind failed: " << strerror(errno) << std::endl;
-        return 1;
+        const char *typeAt = query + names[q];
+        while (*typeAt)
+        {
+            typeAt += uint8_t(*typeAt) + 1;
+        }
+        typeAt++;
+        uint16_t type = (uint8_t(typeAt[0]) << 8) | uint8_t(typeAt[1]);
+        size_t rdLength = type == kTypeA ? 4 : type == kTypeAAAA ? 16 : 0;
+        if (!rdLength)
+            continue;
+        for (size_t i = 0; i < options.answers; i++)
+        {
+            if (end + 12 + rdLength > limit)
+            {
+                out[2] |= 0x02; // TC, the client is to ask again over TCP, which we do not serve
+                memset(out + 6, 0, 2);
+                return pos;
+            }
+            char *r = out + end;
+            r[0] = char(0xC0 | (names[q] >> 8));
+            r[1] = char(names[q] & 0xFF);
+            memcpy(r + 2, typeAt, 4); // Type and class of the question
+            uint32_t ttl = htonl(options.ttl);
+            memcpy(r + 6, &ttl, 4);
+            r[10] = 0;
+            r[11] = char(rdLength);
+            // 10.x.y.z, a different address for every record, or the same inside fd00::/8
+            uint32_t address = htonl(0x0A000000 | (serial++ & 0xFFFFFF));
+            memset(r + 12, 0, rdLength);
+            if (type == kTypeAAAA)
+                r[12] = char(0xFD);
+            memcpy(r + 12 + rdLength - 4, &address, 4);
+            end += 12 + rdLength;
+            anCount++;
+        }
     }
+    out[6] = char(anCount >> 8);
+    out[7] = char(anCount & 0xFF);
+    return end;
+}
 
-    int bytesRead;
-    char buffer[512];
-    socklen_t clientAddrLen = sizeof(clientAddress);
+// One thread with its own SO_REUSEPORT socket, the kernel spreads the forwarder's upstream sockets
+// over them
+void run_stub(int udpSocket, const StubOptions &options, unsigned seed)
+{
+    BatchReceiver in(kDefaultBatchSize);
+    BatchSender out(udpSocket, kDefaultBatchSize);
+    std::priority_queue<DelayedReply, std::vector<DelayedReply>, std::greater<DelayedReply>> delayed;
+    std::mt19937 random(seed);
+    uint32_t serial = 1;
+    bool delaying = options.delay.count() || options.jitter.count();
 
     while (true)
     {
-        // Receive data
-        bytesRead = recvfrom(udpSocket, buffer, sizeof(buffer), 0, reinterpret_cast<struct sockaddr *>(&clientAddress), &clientAddrLen);
-        if (bytesRead == -1)
-        {
-            perror("Error receiving data");
-            break;
-        }
-
-        buffer[bytesRead] = '\0';
-        std::cout << "Received " << bytesRead << " bytes." << std::endl;
-        // Read the receive into a file for debugging
-        std::ofstream file("./src/clientQuery.txt", std::ios::out | std::ios::trunc);
-        file.write(buffer, bytesRead);
-        file.close();
-        std::cout << "Just received a dns query, stored in src/clientQuery.txt." << std::endl;
-
-        // Parse the buffer into query
-        DNSMessage query;
-        size_t bufOffset = 0;
-        parseDNSMessage(query, buffer, bufOffset);
-
-        // Create an empty message and craft the response with the query
-        DNSMessage response;
-        // Handle Header
-        response.header.transactionId = query.header.transactionId;
-        if (ntohs(query.header.flags) & (1 << 15)) // if flag bit is reply, then wrong
-        {
-            std::cerr << "Expected a query, received reply." << strerror(errno) << std::endl;
-            return 1;
+        int timeout = -1;
+        if (!delayed.empty())
+        {
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(delayed.top().due - std::chrono::steady_clock::now());
+            timeout = std::max<int>(0, wait.count());
         }
-        response.header.flags = query.header.flags | htons(1 << 15);
-        response.header.qdCount = query.header.qdCount;
-        // 0 should be same for both network and host byte.
-        response.header.anCount = response.header.qdCount;
-        response.header.nsCount = 0;
-        response.header.arCount = 0;
+        pollfd p = {udpSocket, POLLIN, 0};
+        poll(&p, 1, timeout);
 
-        // Handle question
-        size_t numQ = ntohs(response.header.qdCount);
-        for (int i = 0; i < numQ; i++)
+        auto now = std::chrono::steady_clock::now();
+        while (size_t n = in.receive(udpSocket))
         {
-            DNSQuestion q;
-            q.qName = query.questions[i].qName;
-            if (ntohs(query.questions[i].qType) != 1 || ntohs(query.questions[i].qClass) != 1)
+            for (size_t i = 0; i < n; i++)
             {
-                std::cerr << "Expected a 'A' record type and 'IN' record class for questions only. Wrong index =" << i << std::endl;
-                return 1;
+                if (options.drop && random() % 100 < options.drop)
+                    continue;
+                bool servfail = options.servfail && random() % 100 < options.servfail;
+                if (!delaying)
+                {
+                    size_t length = build_reply(in.data(i), in.length(i), out.reserve(), options, servfail, serial);
+                    if (length)
+                        out.commit(length, in.address(i), in.addressLen(i));
+                    continue;
+                }
+                char reply[kPacketSize];
+                size_t length = build_reply(in.data(i), in.length(i), reply, options, servfail, serial);
+                if (!length)
+                    continue;
+                auto extra = options.jitter.count() ? std::chrono::microseconds(random() % options.jitter.count()) : std::chrono::microseconds(0);
+                delayed.push({now + options.delay + extra, in.address(i), std::string(reply, length)});
             }
-            q.qType = query.questions[i].qType;
-            q.qClass = query.questions[i].qClass;
-            response.questions.push_back(q);
+            if (n < in.capacity())
+                break;
         }
-
-        // Handle answer
-        size_t numA = ntohs(response.header.qdCount);
-        for (int i = 0; i < numA; i++)
+        while (!delayed.empty() && delayed.top().due <= now)
         {
-            DNSAnswer a;
-            a.name = query.questions[i].qName;
-            if (ntohs(query.questions[i].qType) != 1 || ntohs(query.questions[i].qClass) != 1)
-            {
-                std::cerr << "Expected a 'A' record type and 'IN' record class for answers only. Wrong index =" << i << std::endl;
-                return 1;
-            }
-            a.type = query.questions[i].qType;
-            a._class = query.questions[i].qClass;
-            a.ttl = htonl(60);
-            a.rdLength = htons(4);
-            a.rData = "\x08"
-                      "\x08"
-                      "\x08"
-                      "\x08";
-            response.answers.push_back(a);
+            const DelayedReply &r = delayed.top();
+            memcpy(out.reserve(), r.packet.data(), r.packet.size());
+            out.commit(r.packet.size(), r.address, sizeof(r.address));
+            delayed.pop();
         }
+        out.flush();
+    }
+}
 
-        // Serialize everything into a buffer:
-        char sendBuf[512];
-        size_t offset = 0;
-        serializeDNSMessage(sendBuf, response, offset);
-        // Send response
+// Whole string as a non-negative integer, false on anything else
+bool parse_number(size_t &dst, const std::string &src)
+{
+    try
+    {
+        size_t idx = 0;
+        dst = std::stoull(src, &idx);
+        return idx == src.size() && src[0] != '-';
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+// Whole string as a finite non-negative number, false on anything else
+bool parse_decimal(double &dst, const std::string &src)
+{
+    try
+    {
+        size_t idx = 0;
+        dst = std::stod(src, &idx);
+        return idx == src.size() && std::isfinite(dst) && dst >= 0;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
 
-        if (sendto(udpSocket, sendBuf, offset, 0, reinterpret_cast<struct sockaddr *>(&clientAddress), sizeof(clientAddress)) == -1)
+int main(int argc, char **argv)
+{
+    // Flush after every std::cout / std::cerr
+    std::cout << std::unitbuf;
+    std::cerr << std::unitbuf;
+
+    StubOptions options;
+    size_t threads = 1;
+    for (int i = 1; i < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+        std::string value = argv[i + 1];
+        bool valid = true;
+        size_t number = 0;
+        double ms = 0;
+        if (flag == "--port")
+        {
+            valid = parse_number(number, value) && number <= UINT16_MAX;
+            options.port = number;
+        }
+        else if (flag == "--delay")
+        {
+            valid = parse_decimal(ms, value);
+            options.delay = std::chrono::microseconds(long(ms * 1000));
+        }
+        else if (flag == "--jitter")
+        {
+            valid = parse_decimal(ms, value);
+            options.jitter = std::chrono::microseconds(long(ms * 1000));
+        }
+        else if (flag == "--drop")
+        {
+            valid = parse_number(number, value);
+            options.drop = std::min<size_t>(100, number);
+        }
+        else if (flag == "--servfail")
+        {
+            valid = parse_number(number, value);
+            options.servfail = std::min<size_t>(100, number);
+        }
+        else if (flag == "--answers")
+            valid = parse_number(options.answers, value);
+        else if (flag == "--ttl")
+        {
+            valid = parse_number(number, value) && number <= UINT32_MAX;
+            options.ttl = number;
+        }
+        else if (flag == "--threads")
+        {
+            valid = parse_number(number, value);
+            threads = std::max<size_t>(1, number);
+        }
+        else
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+        if (!valid)
         {
-            perror("Failed to send response");
+            std::cerr << "Not a correct value for " << flag << ": " << value << std::endl
+                      << usage << std::endl;
+            return 1;
         }
-        std::cout << "Send back DNS reply to answer the query" << std::endl;
     }
 
-    close(udpSocket);
+    std::vector<int> sockets;
+    for (size_t t = 0; t < threads; t++)
+    {
+        int udpSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (udpSocket == -1)
+        {
+            std::cerr << "Socket creation failed: " << strerror(errno) << "..." << std::endl;
+            return 1;
+        }
+        int reuse = 1;
+        if (setsockopt(udpSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+        {
+            std::cerr << "SO_REUSEPORT failed: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        sockaddr_in serv_addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(options.port),
+            .sin_addr = {htonl(INADDR_LOOPBACK)},
+        };
+        if (bind(udpSocket, reinterpret_cast<struct sockaddr *>(&serv_addr), sizeof(serv_addr)) != 0)
+        {
+            std::cerr << "Bind failed: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        sockets.push_back(udpSocket);
+    }
+    std::cout << "Stub upstream on 127.0.0.1:" << options.port << " with " << threads << " thread(s), delay "
+              << options.delay.count() / 1000.0 << " ms, drop " << options.drop << "%, SERVFAIL " << options.servfail << "%." << std::endl;
 
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers.emplace_back(run_stub, sockets[t], std::cref(options), unsigned(t + 1));
+    }
+    for (std::thread &w : workers)
+    {
+        w.join();
+    }
     return 0;
 }
-/*
-Test command
-cat input.txt | nc -u 127.0.0.1 2053 > output.txt
-
-hexdump -C output.txt
-*/
@@ -0,0 +1,132 @@
+#ifndef MY_TCP_CLASS
+#define MY_TCP_CLASS
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// DNS over TCP (RFC 7766): every message is preceded by its length as two bytes.
+// A TcpStream wraps one non-blocking connection, client or upstream alike. Messages are cut out
+// of whatever bytes have arrived, several of them may be in flight at once and their replies go
+// back in any order, the transaction id tells them apart.
+
+// Largest message the two byte length prefix can carry
+constexpr size_t kMaxTcpMessage = UINT16_MAX;
+// Client connections kept open per worker, more are accepted and closed right away
+constexpr size_t kMaxTcpClients = 512;
+// Queries of one client connection waiting on the upstream before we stop reading from it
+constexpr size_t kMaxTcpPipeline = 64;
+// Responses queued on a client connection before we stop reading from it, a client that sends
+// queries and never reads the answers can not make us buffer without end
+constexpr size_t kMaxTcpOutput = 4 * kMaxTcpMessage;
+// A client connection with nothing in flight is closed after this long (RFC 7766 6.2.3), one
+// that keeps more than kMaxTcpOutput unread as well
+constexpr std::chrono::seconds kTcpIdleTimeout{10};
+// An upstream connection nothing was sent on for this long is closed
+constexpr std::chrono::seconds kUpstreamTcpIdleTimeout{30};
+
+class TcpStream
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    int fd = -1;
+    Clock::time_point lastActive;
+
+    // Read what the socket has, one read per call so a busy connection can not starve the others
+    // False once the peer closed or the connection broke
+    bool receive()
+    {
+        char chunk[16384];
+        while (true)
+        {
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n > 0)
+            {
+                input.insert(input.end(), chunk, chunk + n);
+                return true;
+            }
+            if (n == 0)
+                return false;
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+
+    // Cut the next complete message out of the input, false when the rest of it has not arrived
+    // The message stays valid until next returns false or receive is called again
+    bool next(std::string_view &message)
+    {
+        size_t left = input.size() - consumed;
+        if (left >= 2)
+        {
+            size_t length = (size_t(uint8_t(input[consumed])) << 8) | uint8_t(input[consumed + 1]);
+            if (left - 2 >= length)
+            {
+                message = std::string_view(input.data() + consumed + 2, length);
+                consumed += 2 + length;
+                return true;
+            }
+        }
+        // Keep only the partial message, at the front of the buffer
+        input.erase(input.begin(), input.begin() + consumed);
+        consumed = 0;
+        return false;
+    }
+
+    // Queue a message behind its length, it goes out on the next flush
+    void queue(const char *message, size_t length)
+    {
+        output.push_back(char(length >> 8));
+        output.push_back(char(length & 0xFF));
+        output.insert(output.end(), message, message + length);
+    }
+
+    // Write as much of the queued output as the socket takes, false if the connection broke
+    bool flush()
+    {
+        while (sent < output.size())
+        {
+            ssize_t n = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                sent += n;
+                continue;
+            }
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            return false;
+        }
+        output.clear();
+        sent = 0;
+        return true;
+    }
+
+    bool writing() const { return sent < output.size(); }
+    size_t queuedBytes() const { return output.size() - sent; }
+
+    void close()
+    {
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+        input.clear();
+        output.clear();
+        consumed = sent = 0;
+    }
+
+private:
+    std::vector<char> input;
+    size_t consumed = 0; // Input bytes already cut into messages
+    std::vector<char> output;
+    size_t sent = 0; // Output bytes already written
+};
+
+#endif
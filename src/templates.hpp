@@ -0,0 +1,268 @@
+#ifndef MY_TEMPLATES_CLASS
+#define MY_TEMPLATES_CLASS
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "netstruct.hpp"
+#include "batchio.hpp"
+
+// Ready-made responses for the questions asked most.
+// The response to a single question query is kept exactly as it was sent: header, question and
+// records. The next query for the same question is answered by copying it and patching the
+// transaction id, the RD and CD bits, the spelling of the question and the TTLs, nothing is
+// parsed or rebuilt. A question gets a template the second time it is answered, so names asked
+// for once do not churn the store, and a CLOCK sweep evicts the ones not asked for lately.
+
+// Templates kept per worker, can be changed with --templates
+constexpr size_t kDefaultTemplateCount = 4096;
+// TTL fields patched per template, responses with more records are not kept
+constexpr size_t kMaxTemplateRecords = 64;
+
+// Lowercased wire name, then type and class in network order, then the EDNS flags
+// A response carries an OPT record only for queries that had one, so they get their own template
+struct TemplateKey
+{
+    char data[kMaxNameLength + 2 * sizeof(uint16_t) + 1];
+    size_t length;
+
+    TemplateKey(const DNSQuestionView &q, const Edns &edns)
+    {
+        length = q.qName.toLowerWire(data);
+        memcpy(data + length, &q.qType, sizeof(uint16_t));
+        length += sizeof(uint16_t);
+        memcpy(data + length, &q.qClass, sizeof(uint16_t));
+        length += sizeof(uint16_t);
+        data[length++] = (edns.present ? 1 : 0) | (edns.dnssecOk ? 2 : 0);
+    }
+
+    std::string_view view() const { return std::string_view(data, length); }
+};
+
+class ResponseTemplates
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // The index nodes come from memory, a worker hands in its own pool
+    explicit ResponseTemplates(size_t capacity = kDefaultTemplateCount, std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+        : entries(capacity), index(memory), seen(capacity / 8 + 1)
+    {
+        index.reserve(capacity);
+    }
+
+    // Write the response to a query for q into dest (limit bytes), return its length
+    // Return 0 when there is no live template for the question, or it is bigger than limit
+    size_t render(const DNSHeader &query, const DNSQuestionView &q, const Edns &edns, char *dest, size_t limit,
+                  Clock::time_point now)
+    {
+        if (entries.empty())
+            return 0;
+        TemplateKey key(q, edns);
+        auto it = index.find(key.view());
+        if (it == index.end())
+        {
+            misses++;
+            return 0;
+        }
+        Entry &e = entries[it->second];
+        if (e.countDown && e.expiry <= now)
+        {
+            erase(it->second);
+            misses++;
+            return 0;
+        }
+        // In the last tenth of its lifetime the query goes on to the cache, which refreshes popular answers
+        if (e.countDown && (e.expiry - now) * 10 < e.expiry - e.storedAt)
+        {
+            misses++;
+            return 0;
+        }
+        if (e.length > limit)
+        {
+            misses++;
+            return 0;
+        }
+        e.referenced = true;
+        memcpy(dest, e.response.data(), e.length);
+
+        DNSHeader header;
+        memcpy(&header, dest, sizeof(DNSHeader));
+        header.transactionId = query.transactionId;
+        header.flags = (header.flags & htons(~0x0110)) | (query.flags & htons(0x0110)); // RD and CD
+        memcpy(dest, &header, sizeof(DNSHeader));
+        // Echo the question the way the client spelled it, same length as the stored one
+        q.qName.toWire(dest + sizeof(DNSHeader));
+        if (e.countDown)
+        {
+            uint32_t elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - e.storedAt).count();
+            for (size_t i = 0; i < e.ttlCount; i++)
+            {
+                uint32_t ttl;
+                memcpy(&ttl, e.response.data() + e.ttlOffsets[i], sizeof(uint32_t));
+                ttl = htonl(ntohl(ttl) - elapsed);
+                memcpy(dest + e.ttlOffsets[i], &ttl, sizeof(uint32_t));
+            }
+        }
+        hits++;
+        return e.length;
+    }
+
+    // Keep a copy of the response just written for q
+    // countDown: the TTLs run out (upstream data), otherwise it stays valid until clear
+    void offer(const DNSQuestionView &q, const Edns &edns, const char *response, size_t length, bool countDown,
+               Clock::time_point now)
+    {
+        if (entries.empty() || length > kPacketSize)
+            return;
+        TemplateKey key(q, edns);
+        if (index.find(key.view()) != index.end() || !admit(hashWireName(key.data, key.length)))
+            return;
+        uint16_t offsets[kMaxTemplateRecords];
+        size_t count;
+        uint32_t minTtl;
+        if (!findTtls(response, length, offsets, count, minTtl) || (countDown && minTtl == 0))
+            return;
+
+        uint32_t slot = evict();
+        Entry &e = entries[slot];
+        e.used = true;
+        e.referenced = false;
+        e.countDown = countDown;
+        e.keyLength = key.length;
+        memcpy(e.key, key.data, key.length);
+        e.length = length;
+        e.response.assign(response, response + length);
+        e.ttlCount = count;
+        memcpy(e.ttlOffsets, offsets, count * sizeof(uint16_t));
+        e.storedAt = now;
+        e.expiry = now + std::chrono::seconds(minTtl);
+        index.emplace(std::string_view(e.key, e.keyLength), slot);
+    }
+
+    // Forget everything, the zones the templates were made from have changed
+    void clear()
+    {
+        index.clear();
+        for (Entry &e : entries)
+        {
+            e.used = false;
+        }
+        hand = 0;
+    }
+
+    size_t size() const { return index.size(); }
+    uint64_t hitCount() const { return hits; }
+    uint64_t missCount() const { return misses; }
+
+private:
+    struct Entry
+    {
+        bool used = false;
+        bool referenced = false; // Asked for since the clock hand last went by
+        bool countDown = false;
+        uint8_t ttlCount = 0;
+        uint16_t keyLength = 0;
+        uint16_t length = 0;
+        char key[kMaxNameLength + 2 * sizeof(uint16_t) + 1];
+        std::vector<char> response; // Keeps its capacity when the slot is reused
+        uint16_t ttlOffsets[kMaxTemplateRecords]; // Where the TTL of every record sits in response
+        Clock::time_point storedAt;
+        Clock::time_point expiry; // When the smallest TTL runs out
+    };
+
+    std::vector<Entry> entries; // Never resized, the index points into the keys stored here
+    std::pmr::unordered_map<std::string_view, uint32_t> index;
+    size_t hand = 0;
+    std::vector<uint64_t> seen; // Doorkeeper, one bit per question hash answered once
+    size_t seenCount = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    // True the second time a hash comes by, the doorkeeper starts over once half full
+    bool admit(uint32_t hash)
+    {
+        size_t bit = hash % (seen.size() * 64);
+        uint64_t mask = uint64_t(1) << (bit % 64);
+        if (seen[bit / 64] & mask)
+            return true;
+        seen[bit / 64] |= mask;
+        if (++seenCount > seen.size() * 32)
+        {
+            std::fill(seen.begin(), seen.end(), 0);
+            seenCount = 0;
+        }
+        return false;
+    }
+
+    // Free slot for a new template, evicting the first one not referenced since the last sweep
+    uint32_t evict()
+    {
+        while (true)
+        {
+            uint32_t slot = hand;
+            hand = (hand + 1) % entries.size();
+            Entry &e = entries[slot];
+            if (!e.used)
+                return slot;
+            if (e.referenced)
+            {
+                e.referenced = false;
+                continue;
+            }
+            erase(slot);
+            return slot;
+        }
+    }
+
+    void erase(uint32_t slot)
+    {
+        Entry &e = entries[slot];
+        index.erase(std::string_view(e.key, e.keyLength));
+        e.used = false;
+    }
+
+    // Walk the records of a response we wrote and note where their TTLs are
+    // The TTL field of the OPT record holds flags, it is left alone
+    static bool findTtls(const char *packet, size_t length, uint16_t *offsets, size_t &count, uint32_t &minTtl)
+    {
+        DNSHeader header;
+        memcpy(&header, packet, sizeof(DNSHeader));
+        size_t records = size_t(ntohs(header.anCount)) + ntohs(header.nsCount) + ntohs(header.arCount);
+        if (ntohs(header.qdCount) != 1 || records > kMaxTemplateRecords)
+            return false;
+        auto skip = [](const char *, uint8_t) {};
+        size_t pos = sizeof(DNSHeader), inPlace;
+        if (walkName(packet, length, pos, inPlace, skip) != ParseStatus::Ok)
+            return false;
+        pos += inPlace + 2 * sizeof(uint16_t);
+        count = 0;
+        minTtl = UINT32_MAX;
+        for (size_t i = 0; i < records; i++)
+        {
+            if (walkName(packet, length, pos, inPlace, skip) != ParseStatus::Ok)
+                return false;
+            pos += inPlace;
+            if (pos + 10 > length)
+                return false;
+            uint16_t type, rdLength;
+            uint32_t ttl;
+            memcpy(&type, packet + pos, sizeof(uint16_t));
+            memcpy(&ttl, packet + pos + 4, sizeof(uint32_t));
+            memcpy(&rdLength, packet + pos + 8, sizeof(uint16_t));
+            if (ntohs(type) != kTypeOPT)
+            {
+                offsets[count++] = pos + 4;
+                minTtl = std::min(minTtl, ntohl(ttl));
+            }
+            pos += 10 + ntohs(rdLength);
+        }
+        return pos == length;
+    }
+};
+
+#endif
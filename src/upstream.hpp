@@ -0,0 +1,170 @@
+#ifndef MY_UPSTREAM_CLASS
+#define MY_UPSTREAM_CLASS
+
+#include <netinet/in.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Set of upstream resolvers with latency based selection.
+// Every upstream keeps a smoothed RTT and RTT variance (the TCP estimator, RFC 6298), queries go
+// to the fastest one that is not backing off, and the per-try timeout follows the estimate, so
+// a slow or lossy upstream is left behind after a few queries instead of stalling every client.
+
+// Bounds of the per-try timeout, the estimate is clamped into this range
+constexpr std::chrono::milliseconds kMinUpstreamTimeout{100};
+constexpr std::chrono::milliseconds kMaxUpstreamTimeout{2000};
+// Per-try timeout of an upstream that has not answered anything yet
+constexpr std::chrono::milliseconds kInitialUpstreamTimeout{1000};
+// Tries per sub-query before the response is sent without it, each retry goes to another upstream if there is one
+constexpr unsigned kUpstreamAttempts = 3;
+// Consecutive timeouts before an upstream is benched, the bench doubles on every further timeout
+constexpr unsigned kFailuresBeforeBackoff = 3;
+constexpr std::chrono::milliseconds kMinBackoff{500};
+constexpr std::chrono::milliseconds kMaxBackoff{30000};
+// One query in this many goes to a runner-up, so the estimate of a slower upstream stays fresh
+constexpr uint64_t kProbeInterval = 64;
+
+struct Upstream
+{
+    sockaddr_in address;
+    bool measured = false;
+    double srttMs = 0;   // Smoothed RTT
+    double rttVarMs = 0; // Smoothed mean deviation of the RTT
+    unsigned failures = 0; // Consecutive timeouts, reset by any reply
+    std::chrono::steady_clock::time_point backoffUntil;
+    uint64_t queries = 0;
+    uint64_t replies = 0;
+    uint64_t timeouts = 0;
+};
+
+class UpstreamSet
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t npos = SIZE_MAX;
+
+    explicit UpstreamSet(const std::vector<sockaddr_in> &addresses)
+    {
+        for (const sockaddr_in &a : addresses)
+        {
+            Upstream u;
+            u.address = a;
+            upstreams.push_back(u);
+        }
+    }
+
+    size_t size() const { return upstreams.size(); }
+    const Upstream &operator[](size_t i) const { return upstreams[i]; }
+
+    // Index of the upstream a reply came from, npos if it is not one of ours
+    size_t find(const sockaddr_in &from) const
+    {
+        for (size_t i = 0; i < upstreams.size(); i++)
+        {
+            if (upstreams[i].address.sin_addr.s_addr == from.sin_addr.s_addr &&
+                upstreams[i].address.sin_port == from.sin_port)
+                return i;
+        }
+        return npos;
+    }
+
+    // Pick the upstream for the next try, avoiding exclude (the one that just timed out) when possible
+    // Unmeasured upstreams rank first so each gets a chance, benched ones only when all are benched
+    size_t select(Clock::time_point now, size_t exclude = npos)
+    {
+        size_t best = npos, second = npos;
+        for (size_t i = 0; i < upstreams.size(); i++)
+        {
+            if (i == exclude || upstreams[i].backoffUntil > now)
+                continue;
+            if (best == npos || faster(i, best))
+            {
+                second = best;
+                best = i;
+            }
+            else if (second == npos || faster(i, second))
+            {
+                second = i;
+            }
+        }
+        if (best == npos)
+        {
+            // Everything is benched (or excluded), fall back to whichever comes back first
+            for (size_t i = 0; i < upstreams.size(); i++)
+            {
+                if (i == exclude && upstreams.size() > 1)
+                    continue;
+                if (best == npos || upstreams[i].backoffUntil < upstreams[best].backoffUntil)
+                    best = i;
+            }
+        }
+        else if (second != npos && ++selections % kProbeInterval == 0)
+        {
+            best = second;
+        }
+        upstreams[best].queries++;
+        return best;
+    }
+
+    // How long to wait for upstream i before trying again
+    std::chrono::milliseconds timeout(size_t i) const
+    {
+        const Upstream &u = upstreams[i];
+        if (!u.measured)
+            return kInitialUpstreamTimeout;
+        auto rto = std::chrono::milliseconds(int64_t(u.srttMs + 4 * u.rttVarMs));
+        return std::clamp(rto, kMinUpstreamTimeout, kMaxUpstreamTimeout);
+    }
+
+    void onReply(size_t i, Clock::duration rtt)
+    {
+        Upstream &u = upstreams[i];
+        double sample = std::chrono::duration<double, std::milli>(rtt).count();
+        if (!u.measured)
+        {
+            u.srttMs = sample;
+            u.rttVarMs = sample / 2;
+            u.measured = true;
+        }
+        else
+        {
+            u.rttVarMs = 0.75 * u.rttVarMs + 0.25 * std::abs(u.srttMs - sample);
+            u.srttMs = 0.875 * u.srttMs + 0.125 * sample;
+        }
+        u.failures = 0;
+        u.replies++;
+    }
+
+    void onTimeout(size_t i, Clock::time_point now)
+    {
+        Upstream &u = upstreams[i];
+        u.timeouts++;
+        u.failures++;
+        // A timeout counts as a sample of the full timeout, it pushes the upstream down the ranking
+        double waited = std::chrono::duration<double, std::milli>(timeout(i)).count();
+        u.srttMs = std::max(u.srttMs, waited);
+        u.measured = true;
+        if (u.failures >= kFailuresBeforeBackoff)
+        {
+            unsigned shift = std::min(u.failures - kFailuresBeforeBackoff, 6u);
+            u.backoffUntil = now + std::min(kMaxBackoff, kMinBackoff * (1 << shift));
+        }
+    }
+
+private:
+    std::vector<Upstream> upstreams;
+    uint64_t selections = 0;
+
+    bool faster(size_t a, size_t b) const
+    {
+        const Upstream &x = upstreams[a], &y = upstreams[b];
+        if (x.measured != y.measured)
+            return !x.measured;
+        return x.srttMs < y.srttMs;
+    }
+};
+
+#endif
@@ -0,0 +1,1271 @@
+#ifndef MY_ZONE_CLASS
+#define MY_ZONE_CLASS
+
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "netstruct.hpp"
+
+// Authoritative zones answered from memory.
+// Zone files (RFC 1035 master format) are parsed once at startup and flattened into a single
+// contiguous image: an open addressing table of lowercased wire-format owner names, the RRsets
+// of every name, and the records already encoded for the wire. A lookup hashes the question
+// name, probes the table and copies record bytes into the response, nothing is allocated.
+// The image only holds offsets, so it can also be compiled ahead of time with zone-compile and
+// mmapped read-only, startup then costs the same whatever the size of the zones.
+// Not supported: wildcards, and delegations below the apex (NS records there are plain data).
+
+// CNAME hops followed inside our zones for a single question
+constexpr size_t kMaxZoneChain = 8;
+// RRsets one question can pull into the answer section (ANY, CNAME chains)
+constexpr size_t kMaxZoneSets = 16;
+// Nesting of $INCLUDE
+constexpr int kMaxZoneIncludeDepth = 8;
+
+std::string wireToDotted(const char *wire, size_t len)
+{
+    if (len == 1)
+        return ".";
+    return DNSNameView{wire, uint16_t(len), 0, uint16_t(len)}.toString();
+}
+
+/////////////////////////////////////////////
+//////////    Master file parsing   /////////
+/////////////////////////////////////////////
+
+// One record of a zone file, names in wire format and everything in host byte order
+struct ZoneEntry
+{
+    std::string owner; // Lowercased
+    uint16_t type;
+    uint16_t _class;
+    uint32_t ttl;
+    std::string rData; // Encoded for the wire, names uncompressed
+};
+
+struct ZoneToken
+{
+    std::string text; // Escapes are kept, quotes are not
+    bool quoted;
+};
+
+// A record or directive, parentheses may have joined several lines into it
+struct ZoneLine
+{
+    std::vector<ZoneToken> tokens;
+    bool sameOwner; // Started with a blank, the owner of the previous record carries over
+    size_t number;
+};
+
+// Split a master file into logical lines, ';' starts a comment and parentheses join lines
+bool tokenizeZone(const std::string &text, std::vector<ZoneLine> &lines, std::string &error)
+{
+    int depth = 0;
+    size_t number = 0;
+    size_t start = 0;
+    ZoneLine line;
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+            end = text.size();
+        number++;
+        if (depth == 0)
+        {
+            line.tokens.clear();
+            line.sameOwner = start < end && (text[start] == ' ' || text[start] == '\t');
+            line.number = number;
+        }
+        size_t i = start;
+        while (i < end)
+        {
+            char c = text[i];
+            if (c == ' ' || c == '\t' || c == '\r')
+            {
+                i++;
+            }
+            else if (c == ';')
+            {
+                break;
+            }
+            else if (c == '(' || c == ')')
+            {
+                depth += c == '(' ? 1 : -1;
+                if (depth < 0)
+                {
+                    error = "line " + std::to_string(number) + ": unbalanced \")\"";
+                    return false;
+                }
+                i++;
+            }
+            else if (c == '"')
+            {
+                std::string quoted;
+                i++;
+                while (i < end && text[i] != '"')
+                {
+                    if (text[i] == '\\' && i + 1 < end)
+                        quoted += text[i++];
+                    quoted += text[i++];
+                }
+                if (i == end)
+                {
+                    error = "line " + std::to_string(number) + ": unterminated string";
+                    return false;
+                }
+                i++;
+                line.tokens.push_back({quoted, true});
+            }
+            else
+            {
+                std::string word;
+                while (i < end && !strchr(" \t\r;()\"", text[i]))
+                {
+                    if (text[i] == '\\' && i + 1 < end)
+                        word += text[i++];
+                    word += text[i++];
+                }
+                line.tokens.push_back({word, false});
+            }
+        }
+        if (depth == 0 && !line.tokens.empty())
+            lines.push_back(line);
+        start = end + 1;
+    }
+    if (depth != 0)
+    {
+        error = "unbalanced \"(\" at the end of the file";
+        return false;
+    }
+    return true;
+}
+
+// Decode \X and \DDD escapes of a name label or a character-string
+bool unescapeZoneText(const std::string &text, size_t &i, char &c)
+{
+    if (text[i] != '\\')
+    {
+        c = text[i++];
+        return true;
+    }
+    if (i + 3 < text.size() && isdigit(uint8_t(text[i + 1])) && isdigit(uint8_t(text[i + 2])) && isdigit(uint8_t(text[i + 3])))
+    {
+        int value = (text[i + 1] - '0') * 100 + (text[i + 2] - '0') * 10 + (text[i + 3] - '0');
+        if (value > 255)
+            return false;
+        c = value;
+        i += 4;
+        return true;
+    }
+    if (i + 1 >= text.size())
+        return false;
+    c = text[i + 1];
+    i += 2;
+    return true;
+}
+
+// Master file name into wire format, '@' is the origin and names without a trailing dot are relative to it
+// origin is in wire format too, empty when none is known yet
+bool parseZoneName(const std::string &text, const std::string &origin, std::string &wire)
+{
+    if (text == "@")
+    {
+        wire = origin;
+        return !origin.empty();
+    }
+    std::string result;
+    if (text != ".")
+    {
+        std::string label;
+        size_t i = 0;
+        while (i < text.size())
+        {
+            if (text[i] == '.')
+            {
+                if (label.empty() || label.size() > 63)
+                    return false;
+                result += char(label.size());
+                result += label;
+                label.clear();
+                i++;
+                continue;
+            }
+            char c;
+            if (!unescapeZoneText(text, i, c))
+                return false;
+            label += c;
+        }
+        bool absolute = text.back() == '.' && (text.size() < 2 || text[text.size() - 2] != '\\');
+        if (!label.empty())
+        {
+            if (label.size() > 63)
+                return false;
+            result += char(label.size());
+            result += label;
+        }
+        if (!absolute)
+        {
+            if (origin.empty())
+                return false;
+            result += origin;
+        }
+        else
+        {
+            result += '\0';
+        }
+    }
+    else
+    {
+        result += '\0';
+    }
+    if (result.size() > kMaxNameLength)
+        return false;
+    wire = result;
+    return true;
+}
+
+// TTL in seconds, or with BIND style units like 1h30m
+bool parseZoneTtl(const std::string &text, uint32_t &ttl)
+{
+    uint64_t total = 0, value = 0;
+    bool digits = false;
+    for (char c : text)
+    {
+        if (isdigit(uint8_t(c)))
+        {
+            value = value * 10 + (c - '0');
+            digits = true;
+            if (value > INT32_MAX)
+                return false;
+            continue;
+        }
+        uint64_t unit;
+        switch (tolower(uint8_t(c)))
+        {
+        case 's':
+            unit = 1;
+            break;
+        case 'm':
+            unit = 60;
+            break;
+        case 'h':
+            unit = 3600;
+            break;
+        case 'd':
+            unit = 86400;
+            break;
+        case 'w':
+            unit = 604800;
+            break;
+        default:
+            return false;
+        }
+        if (!digits)
+            return false;
+        total += value * unit;
+        value = 0;
+        digits = false;
+    }
+    total += value;
+    // RFC 2181 8, TTLs are at most 2^31 - 1
+    if (text.empty() || total > INT32_MAX)
+        return false;
+    ttl = total;
+    return true;
+}
+
+bool parseZoneNumber(const std::string &text, uint32_t max, uint32_t &value)
+{
+    if (text.empty() || text.size() > 10)
+        return false;
+    uint64_t v = 0;
+    for (char c : text)
+    {
+        if (!isdigit(uint8_t(c)))
+            return false;
+        v = v * 10 + (c - '0');
+    }
+    if (v > max)
+        return false;
+    value = v;
+    return true;
+}
+
+void appendUint16(std::string &dest, uint16_t value)
+{
+    value = htons(value);
+    dest.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void appendUint32(std::string &dest, uint32_t value)
+{
+    value = htonl(value);
+    dest.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Encode the RDATA fields of a record starting at tokens[first], error says what is wrong
+bool encodeZoneRData(uint16_t type, const std::vector<ZoneToken> &tokens, size_t first, const std::string &origin,
+                     std::string &rData, std::string &error)
+{
+    size_t count = tokens.size() - first;
+    auto expect = [&](size_t n)
+    {
+        if (count == n)
+            return true;
+        error = "expected " + std::to_string(n) + " RDATA fields, got " + std::to_string(count);
+        return false;
+    };
+    auto name = [&](size_t i)
+    {
+        std::string wire;
+        if (parseZoneName(tokens[first + i].text, origin, wire))
+        {
+            rData += wire;
+            return true;
+        }
+        error = "bad name \"" + tokens[first + i].text + "\"";
+        return false;
+    };
+    auto number = [&](size_t i, uint32_t max, bool ttlStyle)
+    {
+        uint32_t value;
+        bool ok = ttlStyle ? parseZoneTtl(tokens[first + i].text, value) : parseZoneNumber(tokens[first + i].text, max, value);
+        if (!ok)
+        {
+            error = "bad number \"" + tokens[first + i].text + "\"";
+            return false;
+        }
+        if (max == UINT16_MAX)
+            appendUint16(rData, value);
+        else
+            appendUint32(rData, value);
+        return true;
+    };
+    rData.clear();
+
+    // RFC 3597 generic form works for every type: \# <length> <hex>...
+    if (count >= 2 && !tokens[first].quoted && tokens[first].text == "\\#")
+    {
+        uint32_t length;
+        if (!parseZoneNumber(tokens[first + 1].text, UINT16_MAX, length))
+        {
+            error = "bad RDATA length";
+            return false;
+        }
+        std::string hex;
+        for (size_t i = first + 2; i < tokens.size(); i++)
+        {
+            hex += tokens[i].text;
+        }
+        if (hex.size() != 2 * length)
+        {
+            error = "RDATA length does not match the hex data";
+            return false;
+        }
+        for (size_t i = 0; i < hex.size(); i += 2)
+        {
+            if (!isxdigit(uint8_t(hex[i])) || !isxdigit(uint8_t(hex[i + 1])))
+            {
+                error = "bad hex in RDATA";
+                return false;
+            }
+            rData += char(std::stoi(hex.substr(i, 2), nullptr, 16));
+        }
+        return true;
+    }
+
+    switch (type)
+    {
+    case kTypeA:
+    case kTypeAAAA:
+    {
+        if (!expect(1))
+            return false;
+        char address[16];
+        int family = type == kTypeA ? AF_INET : AF_INET6;
+        if (inet_pton(family, tokens[first].text.c_str(), address) != 1)
+        {
+            error = "bad address \"" + tokens[first].text + "\"";
+            return false;
+        }
+        rData.assign(address, type == kTypeA ? 4 : 16);
+        return true;
+    }
+    case kTypeNS:
+    case kTypeCNAME:
+    case kTypePTR:
+        return expect(1) && name(0);
+    case kTypeMX:
+        return expect(2) && number(0, UINT16_MAX, false) && name(1);
+    case kTypeSRV:
+        return expect(4) && number(0, UINT16_MAX, false) && number(1, UINT16_MAX, false) &&
+               number(2, UINT16_MAX, false) && name(3);
+    case kTypeSOA:
+        return expect(7) && name(0) && name(1) && number(2, UINT32_MAX, false) && number(3, UINT32_MAX, true) &&
+               number(4, UINT32_MAX, true) && number(5, UINT32_MAX, true) && number(6, UINT32_MAX, true);
+    case kTypeTXT:
+    {
+        if (count == 0)
+        {
+            error = "TXT needs at least one string";
+            return false;
+        }
+        for (size_t t = first; t < tokens.size(); t++)
+        {
+            std::string text;
+            size_t i = 0;
+            while (i < tokens[t].text.size())
+            {
+                char c;
+                if (!unescapeZoneText(tokens[t].text, i, c))
+                {
+                    error = "bad escape in TXT";
+                    return false;
+                }
+                text += c;
+            }
+            if (text.size() > 255)
+            {
+                error = "TXT strings are at most 255 bytes";
+                return false;
+            }
+            rData += char(text.size());
+            rData += text;
+        }
+        return true;
+    }
+    default:
+        error = "no text format for this type, use the \\# form";
+        return false;
+    }
+}
+
+// Append the records of a master file to dest
+// origin is the starting $ORIGIN in wire format, empty if the file has to set its own
+bool parseZoneFile(const std::string &path, std::string origin, std::vector<ZoneEntry> &dest, std::string &error, int depth = 0)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        error = "Can not open zone file " + path + ".";
+        return false;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    std::vector<ZoneLine> lines;
+    if (!tokenizeZone(text.str(), lines, error))
+    {
+        error = path + ": " + error;
+        return false;
+    }
+
+    std::string owner;
+    uint32_t defaultTtl = 0;
+    bool haveTtl = false, dollarTtl = false;
+    for (const ZoneLine &line : lines)
+    {
+        auto fail = [&](const std::string &message)
+        {
+            error = path + ":" + std::to_string(line.number) + ": " + message;
+            return false;
+        };
+        const std::vector<ZoneToken> &tokens = line.tokens;
+        const std::string &first = tokens[0].text;
+        if (!tokens[0].quoted && first[0] == '$')
+        {
+            if (strcasecmp(first.c_str(), "$ORIGIN") == 0)
+            {
+                if (tokens.size() != 2 || !parseZoneName(tokens[1].text, origin, origin))
+                    return fail("bad $ORIGIN");
+            }
+            else if (strcasecmp(first.c_str(), "$TTL") == 0)
+            {
+                if (tokens.size() != 2 || !parseZoneTtl(tokens[1].text, defaultTtl))
+                    return fail("bad $TTL");
+                haveTtl = dollarTtl = true;
+            }
+            else if (strcasecmp(first.c_str(), "$INCLUDE") == 0)
+            {
+                if (tokens.size() < 2 || tokens.size() > 3)
+                    return fail("bad $INCLUDE");
+                if (depth >= kMaxZoneIncludeDepth)
+                    return fail("$INCLUDE nested too deep");
+                std::string included = tokens[1].text;
+                size_t slash = path.rfind('/');
+                if (included[0] != '/' && slash != std::string::npos)
+                    included = path.substr(0, slash + 1) + included;
+                // The included file starts from the given origin, its own $ORIGIN does not leak back
+                std::string includedOrigin = origin;
+                if (tokens.size() == 3 && !parseZoneName(tokens[2].text, origin, includedOrigin))
+                    return fail("bad $INCLUDE origin");
+                if (!parseZoneFile(included, includedOrigin, dest, error, depth + 1))
+                    return false;
+            }
+            else
+            {
+                return fail("unknown directive " + first);
+            }
+            continue;
+        }
+
+        size_t t = 0;
+        if (!line.sameOwner)
+        {
+            if (!parseZoneName(tokens[t++].text, origin, owner))
+                return fail("bad owner name \"" + first + "\"");
+        }
+        else if (owner.empty())
+        {
+            return fail("no owner name to carry over");
+        }
+        // TTL and class are both optional and come in either order
+        uint32_t ttl = defaultTtl;
+        bool explicitTtl = false;
+        for (int k = 0; k < 2 && t < tokens.size(); k++)
+        {
+            if (isdigit(uint8_t(tokens[t].text[0])))
+            {
+                if (!parseZoneTtl(tokens[t].text, ttl))
+                    return fail("bad TTL \"" + tokens[t].text + "\"");
+                explicitTtl = true;
+                t++;
+            }
+            else if (strcasecmp(tokens[t].text.c_str(), "IN") == 0)
+            {
+                t++;
+            }
+            else if (strcasecmp(tokens[t].text.c_str(), "CH") == 0 || strcasecmp(tokens[t].text.c_str(), "HS") == 0)
+            {
+                return fail("only class IN is served");
+            }
+        }
+        if (t >= tokens.size())
+            return fail("missing record type");
+        uint16_t type;
+        if (!parseTypeName(tokens[t].text, type) || type == kTypeOPT || type == kTypeANY)
+            return fail("unknown record type \"" + tokens[t].text + "\"");
+        t++;
+        if (explicitTtl && !dollarTtl)
+        {
+            // Without $TTL the last TTL given is the default (RFC 1035 5.1)
+            defaultTtl = ttl;
+            haveTtl = true;
+        }
+        else if (!explicitTtl && !haveTtl)
+        {
+            return fail("no TTL and no $TTL before it");
+        }
+
+        ZoneEntry entry;
+        std::string message;
+        if (!encodeZoneRData(type, tokens, t, origin, entry.rData, message))
+            return fail(message);
+        entry.owner = owner;
+        lowercaseWire(entry.owner.data(), entry.owner.size());
+        entry.type = type;
+        entry._class = kClassIN;
+        entry.ttl = ttl;
+        dest.push_back(entry);
+    }
+    return true;
+}
+
+/////////////////////////////////////////////
+//////////     Flat lookup index    /////////
+/////////////////////////////////////////////
+// Image layout: header, slots, RRsets, owner names, record data. Only offsets inside the image
+// are stored, so it can be used from any address, in memory or straight from a mapped file.
+
+constexpr char kZoneImageMagic[8] = {'D', 'N', 'S', 'Z', 'O', 'N', 'E', '\0'};
+// Bump whenever the layout below or hashWireName changes, older images are then refused
+constexpr uint32_t kZoneImageVersion = 2;
+constexpr uint32_t kZoneImageByteOrder = 0x01020304;
+
+struct ZoneImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder; // Fields are in the byte order of the machine that compiled the image
+    uint32_t slotCount; // Power of two, at most half full
+    uint32_t nameCount;
+    uint32_t rrsetCount;
+    uint32_t slotsOffset;
+    uint32_t rrsetsOffset;
+    uint32_t namesOffset;
+    uint32_t dataOffset;
+    uint32_t size;
+};
+
+struct ZoneSlot
+{
+    uint32_t hash;
+    uint32_t nameOffset; // Into the names section, lowercased wire format
+    uint16_t nameLength; // 0 marks an empty slot
+    uint16_t rrsetCount; // 0 for names that only exist because something below them does
+    uint32_t firstRRset;
+    uint32_t apex; // Slot of the apex of the zone this name belongs to
+};
+
+struct ZoneRRset
+{
+    uint16_t type; // Network order, compared with the question as is
+    uint16_t _class;
+    uint16_t recordCount;
+    uint16_t padding;
+    uint32_t dataOffset; // Records as type, class, TTL, RDLENGTH, RDATA, ready to follow an owner name
+    uint32_t dataLength;
+};
+
+enum class ZoneResult
+{
+    NotOurs, // Outside every zone, forward it
+    Answer,
+    NoData,   // The name exists, but not with this type
+    NXDomain, // Inside a zone, but no such name
+    // The last two also end a CNAME chain inside our zones, the RCODE follows its last name (RFC 6604)
+};
+
+// What a question resolves to, pointers into the index
+struct ZoneAnswer
+{
+    ZoneResult result = ZoneResult::NotOurs;
+    size_t setCount = 0;
+    const ZoneSlot *owners[kMaxZoneSets];
+    const ZoneRRset *sets[kMaxZoneSets];
+    const ZoneSlot *apex = nullptr; // Of the last name looked at, its SOA goes in the authority section of negative answers
+};
+
+class ZoneIndex
+{
+public:
+    ZoneIndex() = default;
+    ZoneIndex(const ZoneIndex &) = delete;
+    ZoneIndex &operator=(const ZoneIndex &) = delete;
+    ~ZoneIndex()
+    {
+        if (mapping != nullptr)
+            munmap(mapping, mappingSize);
+    }
+
+    // Parse every zone file and build the index, each file holds one zone with its SOA at the apex
+    bool load(const std::vector<std::string> &paths, std::string &error)
+    {
+        struct BuildSet
+        {
+            uint32_t ttl;
+            std::vector<std::string> rDatas;
+        };
+        std::map<std::string, std::map<uint16_t, BuildSet>> nodes; // Sorted by wire name
+        std::set<std::string> apexes;
+        for (const std::string &path : paths)
+        {
+            std::vector<ZoneEntry> entries;
+            if (!parseZoneFile(path, "", entries, error))
+                return false;
+            std::string apex;
+            for (const ZoneEntry &e : entries)
+            {
+                if (e.type != kTypeSOA)
+                    continue;
+                if (!apex.empty())
+                {
+                    error = path + ": more than one SOA record.";
+                    return false;
+                }
+                apex = e.owner;
+            }
+            if (apex.empty())
+            {
+                error = path + ": no SOA record, the zone apex is where the SOA is.";
+                return false;
+            }
+            if (!apexes.insert(apex).second)
+            {
+                error = path + ": zone " + wireToDotted(apex.data(), apex.size()) + " is loaded twice.";
+                return false;
+            }
+            for (const ZoneEntry &e : entries)
+            {
+                if (!isBelow(e.owner, apex))
+                {
+                    error = path + ": " + wireToDotted(e.owner.data(), e.owner.size()) + " is outside the zone.";
+                    return false;
+                }
+                BuildSet &set = nodes[e.owner][e.type];
+                if (set.rDatas.empty())
+                    set.ttl = e.ttl; // RFC 2181 5.2, one TTL per RRset
+                if (std::find(set.rDatas.begin(), set.rDatas.end(), e.rData) == set.rDatas.end())
+                    set.rDatas.push_back(e.rData);
+                // Names between the owner and the apex exist even without records of their own
+                std::string parent = e.owner;
+                while (parent != apex)
+                {
+                    parent.erase(0, uint8_t(parent[0]) + 1);
+                    nodes[parent];
+                }
+            }
+        }
+
+        size_t rrsetCount = 0, namesBytes = 0, dataBytes = 0;
+        for (const auto &[owner, sets] : nodes)
+        {
+            if (sets.count(kTypeCNAME) && sets.size() > 1)
+            {
+                error = wireToDotted(owner.data(), owner.size()) + " has a CNAME and other data.";
+                return false;
+            }
+            namesBytes += owner.size();
+            rrsetCount += sets.size();
+            for (const auto &[type, set] : sets)
+            {
+                if (set.rDatas.size() > UINT16_MAX)
+                {
+                    error = wireToDotted(owner.data(), owner.size()) + " has too many records.";
+                    return false;
+                }
+                for (const std::string &rData : set.rDatas)
+                {
+                    dataBytes += 10 + rData.size();
+                }
+            }
+        }
+        uint32_t slotCount = 8;
+        while (slotCount < 2 * nodes.size())
+        {
+            slotCount *= 2;
+        }
+
+        ZoneImageHeader h = {};
+        memcpy(h.magic, kZoneImageMagic, sizeof(h.magic));
+        h.version = kZoneImageVersion;
+        h.byteOrder = kZoneImageByteOrder;
+        h.slotCount = slotCount;
+        h.nameCount = nodes.size();
+        h.rrsetCount = rrsetCount;
+        h.slotsOffset = sizeof(ZoneImageHeader);
+        h.rrsetsOffset = h.slotsOffset + slotCount * sizeof(ZoneSlot);
+        h.namesOffset = h.rrsetsOffset + rrsetCount * sizeof(ZoneRRset);
+        h.dataOffset = h.namesOffset + namesBytes;
+        uint64_t size = uint64_t(h.dataOffset) + dataBytes;
+        if (size > UINT32_MAX)
+        {
+            error = "The zones do not fit in a 4 GiB index.";
+            return false;
+        }
+        h.size = size;
+        std::vector<char> image(h.size);
+        memcpy(image.data(), &h, sizeof(h));
+        ZoneSlot *slots = reinterpret_cast<ZoneSlot *>(image.data() + h.slotsOffset);
+        ZoneRRset *rrsets = reinterpret_cast<ZoneRRset *>(image.data() + h.rrsetsOffset);
+        char *names = image.data() + h.namesOffset;
+        char *data = image.data() + h.dataOffset;
+
+        // Owners first, so every name knows which slot it landed in
+        std::map<std::string, uint32_t> slotOf;
+        uint32_t nameOffset = 0, rrsetIndex = 0, dataOffset = 0;
+        for (const auto &[owner, sets] : nodes)
+        {
+            uint32_t hash = hashWireName(owner.data(), owner.size());
+            uint32_t i = hash & (slotCount - 1);
+            while (slots[i].nameLength != 0)
+            {
+                i = (i + 1) & (slotCount - 1);
+            }
+            ZoneSlot &slot = slots[i];
+            slot.hash = hash;
+            slot.nameOffset = nameOffset;
+            slot.nameLength = owner.size();
+            slot.rrsetCount = sets.size();
+            slot.firstRRset = rrsetIndex;
+            memcpy(names + nameOffset, owner.data(), owner.size());
+            nameOffset += owner.size();
+            slotOf[owner] = i;
+
+            for (const auto &[type, set] : sets)
+            {
+                ZoneRRset &rrset = rrsets[rrsetIndex++];
+                rrset.type = htons(type);
+                rrset._class = htons(kClassIN);
+                rrset.recordCount = set.rDatas.size();
+                rrset.dataOffset = dataOffset;
+                for (const std::string &rData : set.rDatas)
+                {
+                    std::string record;
+                    appendUint16(record, type);
+                    appendUint16(record, kClassIN);
+                    appendUint32(record, set.ttl);
+                    appendUint16(record, rData.size());
+                    record += rData;
+                    memcpy(data + dataOffset, record.data(), record.size());
+                    dataOffset += record.size();
+                }
+                rrset.dataLength = dataOffset - rrset.dataOffset;
+            }
+        }
+        // The closest enclosing apex owns the name, zones may be nested
+        for (const auto &[owner, sets] : nodes)
+        {
+            std::string apex = owner;
+            while (!apexes.count(apex))
+            {
+                apex.erase(0, uint8_t(apex[0]) + 1);
+            }
+            slots[slotOf[owner]].apex = slotOf[apex];
+        }
+
+        storage = std::move(image);
+        attach(storage.data());
+        return true;
+    }
+
+    // Serve from a compiled image, mapped read-only and shared with every other process mapping it
+    // Only the header is checked here, lookups check every offset they follow
+    bool map(const std::string &path, std::string &error)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            error = "Can not open zone image " + path + ": " + strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(ZoneImageHeader))
+        {
+            error = path + " is too small to be a zone image.";
+            close(fd);
+            return false;
+        }
+        void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED)
+        {
+            error = "Can not map zone image " + path + ": " + strerror(errno);
+            return false;
+        }
+        if (!validHeader(static_cast<const ZoneImageHeader *>(m), st.st_size, error) ||
+            !validSlots(static_cast<const char *>(m), error))
+        {
+            error = path + ": " + error;
+            munmap(m, st.st_size);
+            return false;
+        }
+        mapping = m;
+        mappingSize = st.st_size;
+        attach(static_cast<const char *>(m));
+        return true;
+    }
+
+    // Write the image for map(), through a temporary file renamed over path
+    // A server still mapping the old file keeps reading it, the old inode lives until it unmaps
+    bool save(const std::string &path, std::string &error) const
+    {
+        if (header == nullptr)
+        {
+            error = "Nothing to save.";
+            return false;
+        }
+        std::string temp = path + ".tmp";
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            error = "Can not create " + temp + ": " + strerror(errno);
+            return false;
+        }
+        const char *base = reinterpret_cast<const char *>(header);
+        size_t written = 0;
+        while (written < header->size)
+        {
+            ssize_t n = write(fd, base + written, header->size - written);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                error = "Can not write " + temp + ": " + strerror(errno);
+                close(fd);
+                unlink(temp.c_str());
+                return false;
+            }
+            written += n;
+        }
+        if (fsync(fd) == -1 || close(fd) == -1 || rename(temp.c_str(), path.c_str()) == -1)
+        {
+            error = "Can not write " + path + ": " + strerror(errno);
+            unlink(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool empty() const { return header == nullptr || header->nameCount == 0; }
+    size_t nameCount() const { return header ? header->nameCount : 0; }
+    size_t rrsetCount() const { return header ? header->rrsetCount : 0; }
+    size_t bytes() const { return header ? header->size : 0; }
+
+    // Work out what a question resolves to, NotOurs if no zone of ours covers it
+    ZoneResult resolve(const DNSQuestionView &q, ZoneAnswer &answer) const
+    {
+        answer.result = ZoneResult::NotOurs;
+        answer.setCount = 0;
+        answer.apex = nullptr;
+        if (empty() || q.qClass != htons(kClassIN))
+            return answer.result;
+        char wire[kMaxNameLength];
+        size_t len = q.qName.toLowerWire(wire);
+        const ZoneSlot *node = find(wire, len);
+        if (node == nullptr)
+        {
+            if (const ZoneSlot *above = closestAbove(wire, len))
+            {
+                answer.apex = &slots[above->apex];
+                return answer.result = ZoneResult::NXDomain;
+            }
+            return answer.result;
+        }
+
+        for (size_t hop = 0; hop <= kMaxZoneChain; hop++)
+        {
+            answer.apex = &slots[node->apex];
+            const ZoneRRset *sets = rrsets + node->firstRRset;
+            const ZoneRRset *cname = nullptr;
+            size_t found = 0;
+            for (size_t s = 0; s < node->rrsetCount && answer.setCount < kMaxZoneSets; s++)
+            {
+                if (sets[s].type == q.qType || q.qType == htons(kTypeANY))
+                {
+                    answer.owners[answer.setCount] = node;
+                    answer.sets[answer.setCount++] = &sets[s];
+                    found++;
+                }
+                else if (sets[s].type == htons(kTypeCNAME))
+                {
+                    cname = &sets[s];
+                }
+            }
+            if (found)
+                return answer.result = ZoneResult::Answer;
+            // The name, maybe at the end of a chain, exists without the type
+            if (cname == nullptr)
+                return answer.result = ZoneResult::NoData;
+            if (answer.setCount == kMaxZoneSets)
+                break;
+            // Follow the alias while it stays inside our zones, the client chases the rest
+            answer.owners[answer.setCount] = node;
+            answer.sets[answer.setCount++] = cname;
+            const char *record = data + cname->dataOffset;
+            uint16_t rdLength;
+            if (!validRRset(cname) || cname->dataLength < 10)
+                break;
+            memcpy(&rdLength, record + 8, sizeof(uint16_t));
+            char target[kMaxNameLength];
+            size_t targetLen = ntohs(rdLength);
+            if (targetLen > kMaxNameLength || 10 + targetLen > cname->dataLength)
+                break;
+            lowercaseCopy(target, record + 10, targetLen);
+            node = find(target, targetLen);
+            if (node == nullptr)
+            {
+                // An alias to a name of ours that does not exist, the chain ends in NXDOMAIN
+                if (const ZoneSlot *above = closestAbove(target, targetLen))
+                {
+                    answer.apex = &slots[above->apex];
+                    return answer.result = ZoneResult::NXDomain;
+                }
+                break;
+            }
+        }
+        return answer.result = answer.setCount ? ZoneResult::Answer : ZoneResult::NoData;
+    }
+
+    // Write the answer section records of a resolved question, false once the message is full
+    bool writeAnswers(DNSWriter &writer, const ZoneAnswer &answer, uint16_t &count) const
+    {
+        for (size_t s = 0; s < answer.setCount; s++)
+        {
+            if (!writeRRset(writer, answer.owners[s], answer.sets[s], count))
+                return false;
+        }
+        return true;
+    }
+
+    // Negative answers carry the SOA of the zone in the authority section (RFC 2308)
+    bool writeAuthority(DNSWriter &writer, const ZoneAnswer &answer, uint16_t &count) const
+    {
+        const ZoneRRset *soa = negativeSoa(answer);
+        return soa == nullptr || writeRRset(writer, answer.apex, soa, count);
+    }
+
+    // Same records as writeAnswers, for responses assembled from DNSAnswer lists
+    void toDNSAnswers(const ZoneAnswer &answer, DNSVector<DNSAnswer> &dest) const
+    {
+        for (size_t s = 0; s < answer.setCount; s++)
+        {
+            toDNSAnswers(answer.owners[s], answer.sets[s], dest);
+        }
+    }
+
+    // Same records as writeAuthority
+    void toDNSAuthority(const ZoneAnswer &answer, DNSVector<DNSAnswer> &dest) const
+    {
+        if (const ZoneRRset *soa = negativeSoa(answer))
+            toDNSAnswers(answer.apex, soa, dest);
+    }
+
+private:
+    std::vector<char> storage; // Built in memory by load()
+    void *mapping = nullptr;   // Or mapped by map()
+    size_t mappingSize = 0;
+    const ZoneImageHeader *header = nullptr;
+    const ZoneSlot *slots = nullptr;
+    const ZoneRRset *rrsets = nullptr;
+    const char *names = nullptr;
+    const char *data = nullptr;
+
+    void attach(const char *base)
+    {
+        header = reinterpret_cast<const ZoneImageHeader *>(base);
+        slots = reinterpret_cast<const ZoneSlot *>(base + header->slotsOffset);
+        rrsets = reinterpret_cast<const ZoneRRset *>(base + header->rrsetsOffset);
+        names = base + header->namesOffset;
+        data = base + header->dataOffset;
+    }
+
+    static bool validHeader(const ZoneImageHeader *h, size_t fileSize, std::string &error)
+    {
+        if (memcmp(h->magic, kZoneImageMagic, sizeof(h->magic)) != 0)
+        {
+            error = "not a zone image.";
+            return false;
+        }
+        if (h->version != kZoneImageVersion || h->byteOrder != kZoneImageByteOrder)
+        {
+            error = "zone image version " + std::to_string(h->version) + " or byte order does not match this server, compile it again.";
+            return false;
+        }
+        // Sections follow each other in order and end with the file
+        if (h->size != fileSize || h->slotCount == 0 || (h->slotCount & (h->slotCount - 1)) != 0 ||
+            h->slotsOffset != sizeof(ZoneImageHeader) ||
+            uint64_t(h->slotsOffset) + uint64_t(h->slotCount) * sizeof(ZoneSlot) != h->rrsetsOffset ||
+            uint64_t(h->rrsetsOffset) + uint64_t(h->rrsetCount) * sizeof(ZoneRRset) != h->namesOffset ||
+            h->namesOffset > h->dataOffset || h->dataOffset > h->size)
+        {
+            error = "zone image is damaged.";
+            return false;
+        }
+        return true;
+    }
+
+    // Every name a slot points at lies in the names section and is sound, as do its RRsets and its
+    // apex, so nothing read through a slot later can leave the image
+    static bool validSlots(const char *base, std::string &error)
+    {
+        const ZoneImageHeader *h = reinterpret_cast<const ZoneImageHeader *>(base);
+        const ZoneSlot *slots = reinterpret_cast<const ZoneSlot *>(base + h->slotsOffset);
+        const char *names = base + h->namesOffset;
+        uint64_t namesSize = h->dataOffset - h->namesOffset;
+        for (uint32_t i = 0; i < h->slotCount; i++)
+        {
+            const ZoneSlot &slot = slots[i];
+            if (slot.nameLength == 0)
+                continue;
+            if (uint64_t(slot.nameOffset) + slot.nameLength > namesSize || !validName(names + slot.nameOffset, slot.nameLength) ||
+                uint64_t(slot.firstRRset) + slot.rrsetCount > h->rrsetCount || slot.apex >= h->slotCount ||
+                slots[slot.apex].nameLength == 0)
+            {
+                error = "zone image is damaged, slot " + std::to_string(i) + " points outside it.";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool validRRset(const ZoneRRset *set) const
+    {
+        return uint64_t(set->dataOffset) + set->dataLength <= header->size - header->dataOffset;
+    }
+
+    // Labels that end exactly with the root at len
+    static bool validName(const char *wire, size_t len)
+    {
+        size_t i = 0;
+        while (i < len && wire[i] != 0)
+        {
+            i += uint8_t(wire[i]) + 1;
+        }
+        return len <= kMaxNameLength && i + 1 == len;
+    }
+
+    // Is name equal to or below apex, both lowercased wire format
+    static bool isBelow(const std::string &name, const std::string &apex)
+    {
+        size_t i = 0;
+        while (true)
+        {
+            if (name.size() - i == apex.size() && name.compare(i, std::string::npos, apex) == 0)
+                return true;
+            if (name[i] == 0)
+                return false;
+            i += uint8_t(name[i]) + 1;
+        }
+    }
+
+    // The closest name above wire that exists, it tells whether the name would be ours
+    const ZoneSlot *closestAbove(const char *wire, size_t len) const
+    {
+        size_t i = 0;
+        while (i < len && wire[i] != 0)
+        {
+            i += uint8_t(wire[i]) + 1;
+            if (i >= len)
+                break;
+            if (const ZoneSlot *above = find(wire + i, len - i))
+                return above;
+        }
+        return nullptr;
+    }
+
+    const ZoneSlot *find(const char *wire, size_t len) const
+    {
+        uint32_t hash = hashWireName(wire, len);
+        uint32_t mask = header->slotCount - 1;
+        // A sound table is at most half full, the bound only matters for a damaged one
+        for (uint32_t i = hash & mask, probes = 0; probes < header->slotCount; i = (i + 1) & mask, probes++)
+        {
+            const ZoneSlot &slot = slots[i];
+            if (slot.nameLength == 0)
+                return nullptr;
+            // Every slot was checked to stay inside the image when it was mapped, see validSlots
+            if (slot.hash == hash && slot.nameLength == len && memcmp(names + slot.nameOffset, wire, len) == 0)
+                return &slot;
+        }
+        return nullptr;
+    }
+
+    // The SOA of the apex for a negative answer, nullptr for any other
+    const ZoneRRset *negativeSoa(const ZoneAnswer &answer) const
+    {
+        if (answer.result != ZoneResult::NoData && answer.result != ZoneResult::NXDomain)
+            return nullptr;
+        // The apex slot, its name and its RRsets were checked when the image was mapped
+        const ZoneRRset *sets = rrsets + answer.apex->firstRRset;
+        for (size_t s = 0; s < answer.apex->rrsetCount; s++)
+        {
+            if (sets[s].type == htons(kTypeSOA))
+                return &sets[s];
+        }
+        return nullptr;
+    }
+
+    void toDNSAnswers(const ZoneSlot *owner, const ZoneRRset *set, DNSVector<DNSAnswer> &dest) const
+    {
+        if (!validRRset(set))
+            return;
+        const char *record = data + set->dataOffset;
+        const char *end = record + set->dataLength;
+        while (end - record >= 10)
+        {
+            uint16_t rdLength;
+            memcpy(&rdLength, record + 8, sizeof(uint16_t));
+            if (10 + ntohs(rdLength) > end - record)
+                break;
+            DNSAnswer &a = dest.emplace_back();
+            a.name.assign(names + owner->nameOffset, owner->nameLength);
+            memcpy(&a.type, record, sizeof(uint16_t));
+            memcpy(&a._class, record + 2, sizeof(uint16_t));
+            memcpy(&a.ttl, record + 4, sizeof(uint32_t));
+            a.rdLength = rdLength;
+            a.rData.assign(record + 10, ntohs(rdLength));
+            record += 10 + ntohs(rdLength);
+        }
+    }
+
+    bool writeRRset(DNSWriter &writer, const ZoneSlot *owner, const ZoneRRset *set, uint16_t &count) const
+    {
+        if (!validRRset(set))
+            return true;
+        const char *record = data + set->dataOffset;
+        const char *end = record + set->dataLength;
+        while (end - record >= 10)
+        {
+            uint16_t rdLength;
+            memcpy(&rdLength, record + 8, sizeof(uint16_t));
+            size_t length = 10 + ntohs(rdLength);
+            if (length > size_t(end - record))
+                break;
+            if (!writer.writeWireRecord(names + owner->nameOffset, owner->nameLength, record, length))
+                return false;
+            count++;
+            record += length;
+        }
+        return true;
+    }
+};
+
+// The zone index every worker reads, replaced on reload while the workers keep answering.
+// Quiescent-state based reclamation: a worker is busy while it handles a batch of events and
+// idle while it waits in epoll_wait. After swapping the pointer, the reloader frees the old
+// index once every worker has been idle at least once, so the workers never wait on a lock.
+class ZoneStore
+{
+public:
+    explicit ZoneStore(size_t readerCount)
+        : current(new ZoneIndex()), readers(new ReaderState[readerCount]), readerCount(readerCount) {}
+    ZoneStore(const ZoneStore &) = delete;
+    ZoneStore &operator=(const ZoneStore &) = delete;
+    ~ZoneStore() { delete current.load(); }
+
+    // Worker side, reader is the worker number, the index stays valid until leave
+    const ZoneIndex *enter(size_t reader)
+    {
+        readers[reader].state.fetch_add(1); // Odd, busy
+        return current.load();
+    }
+    void leave(size_t reader) { readers[reader].state.fetch_add(1); }
+
+    // Bumped after every swap, read it before enter: a newer generation always comes with the newer index
+    uint64_t generation() const { return published.load(); }
+
+    // Reload side, one caller at a time, returns once the old index is freed
+    void publish(std::unique_ptr<ZoneIndex> next)
+    {
+        const ZoneIndex *old = current.exchange(next.release());
+        published.fetch_add(1);
+        for (size_t i = 0; i < readerCount; i++)
+        {
+            // Idle now means a later batch loads the new pointer, busy means waiting for that batch to end
+            uint64_t seen = readers[i].state.load();
+            while ((seen & 1) && readers[i].state.load() == seen)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        delete old;
+    }
+
+private:
+    struct alignas(64) ReaderState // One cache line each, the workers never share one
+    {
+        std::atomic<uint64_t> state{0};
+    };
+    std::atomic<const ZoneIndex *> current;
+    std::atomic<uint64_t> published{0};
+    std::unique_ptr<ReaderState[]> readers;
+    size_t readerCount;
+};
+
+#endif
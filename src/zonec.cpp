@@ -0,0 +1,50 @@
+/////////////////////////////////////////////
+//////////      zone compiler       /////////
+/////////////////////////////////////////////
+// Compile master format zone files into the image dns-server --zone-image maps at startup.
+// Replace the image in place and send the server SIGHUP to serve the new zones.
+#include <iostream>
+#include <string>
+#include <vector>
+#include "zone.hpp"
+
+const char *usage = "Usage: zone-compile -o <image> <zone file>...";
+
+int main(int argc, char **argv)
+{
+    std::string output;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-o")
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << usage << std::endl;
+                return 1;
+            }
+            output = argv[++i];
+        }
+        else
+        {
+            inputs.push_back(arg);
+        }
+    }
+    if (output.empty() || inputs.empty())
+    {
+        std::cerr << usage << std::endl;
+        return 1;
+    }
+
+    ZoneIndex zones;
+    std::string error;
+    if (!zones.load(inputs, error) || !zones.save(output, error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << output << ": " << inputs.size() << " zone file(s), " << zones.nameCount() << " names, "
+              << zones.rrsetCount() << " RRsets, " << zones.bytes() << " bytes." << std::endl;
+    return 0;
+}